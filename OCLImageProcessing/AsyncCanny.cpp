@@ -0,0 +1,349 @@
+#include "AsyncCanny.h"
+#include "CPUCanny.h"
+#include "Trace.h"
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+using std::vector;
+using std::shared_ptr;
+using std::function;
+using std::future;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::cerr;
+using std::endl;
+using cv::Mat;
+
+
+struct AsyncCanny::Frame
+{
+	Mat input;
+	int rows = 0;
+	int cols = 0;
+	int tLow = 50;
+	int tHigh = 80;
+
+	vector<unsigned char> gaussian;
+	vector<unsigned char> magnitude;
+	vector<unsigned char> theta;
+	vector<unsigned char> nonmaxima;
+
+	EdgeResult result;
+	std::promise<EdgeResult> promise;
+	std::atomic<bool> failed{ false };
+	std::chrono::steady_clock::time_point submitted;
+};
+
+AsyncCanny::AsyncCanny(int threadCount, size_t maxInFlight, int tileRows)
+	: maxInFlight(std::max<size_t>(maxInFlight, 1)), tileRows(std::max(tileRows, 1)),
+	nextWorker(0), stolen(0), completed(0)
+{
+	if (threadCount <= 0)
+	{
+		threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+	}
+
+	for (int i = 0; i < threadCount; i++)
+	{
+		workers.push_back(std::unique_ptr<Worker>(new Worker()));
+	}
+
+	for (int i = 0; i < threadCount; i++)
+	{
+		threads.push_back(std::thread(&AsyncCanny::WorkerLoop, this, i));
+	}
+}
+
+AsyncCanny::~AsyncCanny()
+{
+	// queued frames still finish, their futures stay valid
+	{
+		lock_guard<mutex> guard(sleepLock);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+}
+
+void AsyncCanny::Push(Task task, int self)
+{
+	// follow-up tasks stay with the worker that has the frame in cache
+	size_t index = self >= 0 ? (size_t)self : nextWorker++ % workers.size();
+
+	{
+		lock_guard<mutex> guard(workers[index]->lock);
+		workers[index]->tasks.push_back(std::move(task));
+
+		lock_guard<mutex> sleepGuard(sleepLock);
+		queued++;
+	}
+	wake.notify_one();
+}
+
+bool AsyncCanny::Pop(Task &task, int self)
+{
+	bool found = false;
+
+	// own work newest first
+	{
+		Worker &own = *workers[self];
+		lock_guard<mutex> guard(own.lock);
+		if (!own.tasks.empty())
+		{
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			found = true;
+
+			lock_guard<mutex> sleepGuard(sleepLock);
+			queued--;
+		}
+	}
+
+	// otherwise the oldest task of someone else
+	for (size_t i = 1; i < workers.size() && !found; i++)
+	{
+		Worker &victim = *workers[(self + i) % workers.size()];
+		lock_guard<mutex> guard(victim.lock);
+		if (!victim.tasks.empty())
+		{
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			found = true;
+			stolen++;
+
+			lock_guard<mutex> sleepGuard(sleepLock);
+			queued--;
+		}
+	}
+
+	return found;
+}
+
+void AsyncCanny::WorkerLoop(int self)
+{
+	while (true)
+	{
+		Task task;
+		if (Pop(task, self))
+		{
+			task(self);
+			continue;
+		}
+
+		unique_lock<mutex> guard(sleepLock);
+		wake.wait(guard, [this] { return queued > 0 || stopping; });
+
+		if (stopping && queued == 0)
+		{
+			return;
+		}
+	}
+}
+
+void AsyncCanny::RunTiles(shared_ptr<Frame> frame, int self,
+	function<void(Frame &, int, int)> stage, function<void(int)> next)
+{
+	int tiles = std::max(1, (frame->rows + tileRows - 1) / tileRows);
+	shared_ptr<std::atomic<int> > pending = std::make_shared<std::atomic<int> >(tiles);
+
+	for (int tile = 0; tile < tiles; tile++)
+	{
+		int rowBegin = tile * tileRows;
+		int rowEnd = std::min(frame->rows, rowBegin + tileRows);
+
+		Push([this, frame, stage, next, pending, rowBegin, rowEnd](int worker)
+		{
+			if (!frame->failed)
+			{
+				try
+				{
+					stage(*frame, rowBegin, rowEnd);
+				}
+				catch (...)
+				{
+					Fail(*frame, std::current_exception());
+				}
+			}
+
+			// the last tile of a stage starts the next one
+			if (--*pending == 0)
+			{
+				if (frame->failed)
+				{
+					Release();
+				}
+				else
+				{
+					next(worker);
+				}
+			}
+		}, self);
+	}
+}
+
+void AsyncCanny::Finish(shared_ptr<Frame> frame)
+{
+	try
+	{
+		TRACE_ZONE("Async seams");
+
+		// tiles traced on their own, continue edges across their boundaries
+		for (int seam = tileRows; seam < frame->rows; seam += tileRows)
+		{
+			HysteresisSeam(frame->nonmaxima.data(), frame->result.edges.data, frame->rows, frame->cols, seam, frame->tLow);
+		}
+	}
+	catch (...)
+	{
+		Fail(*frame, std::current_exception());
+		Release();
+		return;
+	}
+
+	frame->result.latencyMicroSec = std::chrono::duration<double, std::micro>(
+		std::chrono::steady_clock::now() - frame->submitted).count();
+	frame->promise.set_value(frame->result);
+	completed++;
+
+	Release();
+}
+
+void AsyncCanny::Fail(Frame &frame, std::exception_ptr error)
+{
+	// tiles of one stage may throw together, the promise takes one
+	if (!frame.failed.exchange(true))
+	{
+		frame.promise.set_exception(error);
+	}
+}
+
+void AsyncCanny::Release()
+{
+	{
+		lock_guard<mutex> guard(flightLock);
+		inFlight--;
+	}
+	flightDone.notify_one();
+}
+
+future<EdgeResult> AsyncCanny::submit(const Mat &input)
+{
+	shared_ptr<Frame> frame = std::make_shared<Frame>();
+
+	// the stages read bytes, one or three per pixel
+	if (input.empty() || (input.type() != CV_8UC1 && input.type() != CV_8UC3))
+	{
+		cerr << "Error: AsyncCanny needs an 8 bit grey or BGR image" << endl;
+		frame->promise.set_value(frame->result);
+		return frame->promise.get_future();
+	}
+
+	// backpressure, wait for a slot before taking the frame
+	{
+		unique_lock<mutex> guard(flightLock);
+		flightDone.wait(guard, [this] { return inFlight < maxInFlight; });
+		inFlight++;
+		frame->tLow = tLow;
+		frame->tHigh = tHigh;
+	}
+
+	frame->submitted = std::chrono::steady_clock::now();
+	frame->input = input.isContinuous() ? input : input.clone();
+	frame->rows = input.rows;
+	frame->cols = input.cols;
+
+	// borders are never written by the stages; a failed allocation
+	// still gives the slot back
+	size_t pixels = input.total();
+	try
+	{
+		frame->gaussian.assign(pixels, 0);
+		frame->magnitude.assign(pixels, 0);
+		frame->theta.assign(pixels, 0);
+		frame->nonmaxima.assign(pixels, 0);
+		frame->result.edges.create(input.rows, input.cols, CV_8UC1);
+	}
+	catch (...)
+	{
+		Release();
+		throw;
+	}
+	memset(frame->result.edges.data, 0x00, pixels);
+
+	future<EdgeResult> result = frame->promise.get_future();
+
+	auto gaussian = [](Frame &f, int rowBegin, int rowEnd)
+	{
+		TRACE_ZONE("Async Gaussian");
+		if (f.input.channels() == 3)
+		{
+			GaussianBGRRows(f.input.data, f.gaussian.data(), f.rows, f.cols, rowBegin, rowEnd);
+		}
+		else
+		{
+			GaussianRows(f.input.data, f.gaussian.data(), f.rows, f.cols, rowBegin, rowEnd);
+		}
+	};
+
+	auto sobel = [](Frame &f, int rowBegin, int rowEnd)
+	{
+		TRACE_ZONE("Async Sobel");
+		SobelRows(f.gaussian.data(), f.magnitude.data(), f.theta.data(), f.rows, f.cols, rowBegin, rowEnd);
+	};
+
+	auto nonmaxima = [](Frame &f, int rowBegin, int rowEnd)
+	{
+		TRACE_ZONE("Async NonMaxima");
+		NonMaximaRows(f.magnitude.data(), f.theta.data(), f.nonmaxima.data(), f.rows, f.cols, rowBegin, rowEnd);
+	};
+
+	auto hysteresis = [](Frame &f, int rowBegin, int rowEnd)
+	{
+		TRACE_ZONE("Async Hysteresis");
+		HysteresisRows(f.nonmaxima.data(), f.result.edges.data, f.rows, f.cols, rowBegin, rowEnd, f.tLow, f.tHigh);
+	};
+
+	RunTiles(frame, -1, gaussian, [=](int self)
+	{
+		RunTiles(frame, self, sobel, [=](int self)
+		{
+			RunTiles(frame, self, nonmaxima, [=](int self)
+			{
+				RunTiles(frame, self, hysteresis, [=](int)
+				{
+					Finish(frame);
+				});
+			});
+		});
+	});
+
+	return result;
+}
+
+void AsyncCanny::setThresholds(int low, int high)
+{
+	lock_guard<mutex> guard(flightLock);
+	tLow = low;
+	tHigh = high;
+}
+
+int AsyncCanny::getThreadCount() const
+{
+	return (int)threads.size();
+}
+
+size_t AsyncCanny::getStolenTasks() const
+{
+	return stolen;
+}
+
+size_t AsyncCanny::getCompletedFrames() const
+{
+	return completed;
+}
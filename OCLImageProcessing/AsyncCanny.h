@@ -0,0 +1,109 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <opencv2/imgproc/imgproc.hpp>
+
+struct EdgeResult
+{
+	// CV_8UC1, 0 or 255
+	cv::Mat edges;
+
+	// from submit to the last seam, including time spent queued
+	double latencyMicroSec = 0.0;
+};
+
+// Long lived CPU Canny engine. Frames are cut into row tiles and every
+// stage of every tile is a task on a persistent pool; each worker owns a
+// deque, takes its newest task first and steals the oldest task of
+// another worker when it runs dry, so tiles of a large frame and of
+// small frames interleave instead of queueing behind each other.
+//
+// A stage only starts once every tile of the previous stage is done
+// (the stencils read the neighbouring tiles), the last tile to finish
+// queues the next stage. submit() blocks while maxInFlight frames are
+// unfinished, which throttles a producer to what the pool manages.
+class AsyncCanny
+{
+private:
+	// runs on the worker with the given index
+	typedef std::function<void(int)> Task;
+
+	struct Frame;
+
+	struct Worker
+	{
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<Worker> > workers;
+	std::vector<std::thread> threads;
+
+	// tasks queued on all workers; changed under sleepLock while the
+	// worker lock of the deque is still held, so it never lags a deque
+	std::mutex sleepLock;
+	std::condition_variable wake;
+	size_t queued = 0;
+	bool stopping = false;
+
+	// frames submitted but not finished
+	std::mutex flightLock;
+	std::condition_variable flightDone;
+	size_t inFlight = 0;
+	size_t maxInFlight;
+
+	// for frames submitted from now on, guarded by flightLock
+	int tLow = 50;
+	int tHigh = 80;
+
+	int tileRows;
+
+	std::atomic<size_t> nextWorker;
+	std::atomic<size_t> stolen;
+	std::atomic<size_t> completed;
+
+	// queue on the calling worker, or spread across workers from outside
+	void Push(Task task, int self);
+	bool Pop(Task &task, int self);
+	void WorkerLoop(int self);
+
+	// queue one task per tile of stage, then 'next' once all are done
+	void RunTiles(std::shared_ptr<Frame> frame, int self,
+		std::function<void(Frame &, int, int)> stage, std::function<void(int)> next);
+
+	void Finish(std::shared_ptr<Frame> frame);
+
+	// the first exception of a frame goes to its future, its remaining
+	// tasks are skipped
+	void Fail(Frame &frame, std::exception_ptr error);
+	void Release();
+
+public:
+	// 0 threads uses one per hardware thread
+	AsyncCanny(int threadCount = 0, size_t maxInFlight = 8, int tileRows = 64);
+	~AsyncCanny();
+
+	AsyncCanny(const AsyncCanny &) = delete;
+	AsyncCanny &operator=(const AsyncCanny &) = delete;
+
+	// 8 bit grey or BGR; the pixels are shared, not copied, so the caller
+	// must not write to the image until the future is ready. Any other
+	// input gives a ready future with empty edges.
+	std::future<EdgeResult> submit(const cv::Mat &input);
+
+	// hysteresis thresholds of frames submitted after this call; frames
+	// already in flight keep theirs
+	void setThresholds(int low, int high);
+
+	int getThreadCount() const;
+	size_t getStolenTasks() const;
+	size_t getCompletedFrames() const;
+};
@@ -0,0 +1,244 @@
+#include "AutoCanny.h"
+#include "Timer.h"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+
+using std::string;
+using std::vector;
+using std::ifstream;
+using std::ofstream;
+using std::istringstream;
+using std::ostream;
+using std::min;
+using std::max;
+using std::endl;
+using cv::Mat;
+
+
+AutoCanny::AutoCanny(const string &profileFile)
+	: profileFile(profileFile)
+{
+	vector<cl::Device> devices = OCLCanny::GetDevices(CL_DEVICE_TYPE_GPU);
+	if (devices.empty())
+	{
+		devices = OCLCanny::GetDevices(CL_DEVICE_TYPE_ALL);
+	}
+
+	if (!devices.empty())
+	{
+		ocl.reset(new OCLCanny(devices[0]));
+
+		// calibrating a device whose kernels did not build would only time failures
+		if (ocl->isInitialized())
+		{
+			deviceName = ocl->getDeviceName();
+		}
+		else
+		{
+			std::cerr << "Error: OpenCL did not initialize on " << ocl->getDeviceName() << ", using the CPU" << endl;
+			ocl.reset();
+		}
+	}
+
+	// nothing to choose between without a device
+	if (ocl && !LoadProfile())
+	{
+		Calibrate();
+		SaveProfile();
+	}
+}
+
+string AutoCanny::getName() const
+{
+	return ocl ? "Auto (CPU, " + deviceName + ")" : "Auto (CPU)";
+}
+
+bool AutoCanny::LoadProfile()
+{
+	ifstream file(profileFile.c_str());
+	string line;
+
+	// first line names the device the timings belong to
+	if (!std::getline(file, line) || line != "device " + deviceName)
+	{
+		return false;
+	}
+
+	profile.clear();
+	while (std::getline(file, line))
+	{
+		Sample sample;
+		istringstream fields(line);
+		if (fields >> sample.pixels >> sample.cpuMicroSec >> sample.oclMicroSec)
+		{
+			profile.push_back(sample);
+		}
+	}
+
+	std::sort(profile.begin(), profile.end(), [](const Sample &a, const Sample &b) { return a.pixels < b.pixels; });
+	return !profile.empty();
+}
+
+void AutoCanny::SaveProfile() const
+{
+	ofstream file(profileFile.c_str());
+	if (!file)
+	{
+		std::cerr << "Error: unable to write " << profileFile << endl;
+		return;
+	}
+
+	file << "device " << deviceName << endl;
+	for (size_t i = 0; i < profile.size(); i++)
+	{
+		file << profile[i].pixels << " " << profile[i].cpuMicroSec << " " << profile[i].oclMicroSec << endl;
+	}
+}
+
+double AutoCanny::TimeEngine(CannyEngine &engine, const Mat &image)
+{
+	Mat edges;
+	Timer timer;
+	double best = 0.0;
+
+	// the first run pays for allocations and kernel caches
+	engine.Process(image, edges);
+
+	for (int run = 0; run < 2; run++)
+	{
+		timer.start();
+		engine.Process(image, edges);
+		timer.stop();
+
+		double elapsed = timer.getElapsedTimeInMicroSec();
+		best = run ? min(best, elapsed) : elapsed;
+	}
+	return best;
+}
+
+void AutoCanny::Calibrate()
+{
+	// two small frames keep start-up short, Select extrapolates from them
+	const int sizes[] = { 128, 512 };
+
+	profile.clear();
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		int size = sizes[i];
+		Mat image = SyntheticFrame(size);
+
+		Sample sample;
+		sample.pixels = size * size;
+		sample.cpuMicroSec = TimeEngine(cpu, image);
+		sample.oclMicroSec = TimeEngine(*ocl, image);
+		profile.push_back(sample);
+	}
+}
+
+CannyEngine &AutoCanny::Select(int rows, int cols)
+{
+	if (!ocl || profile.empty())
+	{
+		return cpu;
+	}
+
+	// interpolate both timings on a log scale; past the largest size both
+	// grow by the cost per pixel of the last two sizes, below the smallest
+	// that one decides
+	double pixels = (double)rows * cols;
+	double cpuTime = profile.front().cpuMicroSec;
+	double oclTime = profile.front().oclMicroSec;
+
+	if (pixels >= profile.back().pixels)
+	{
+		const Sample &high = profile.back();
+		cpuTime = high.cpuMicroSec;
+		oclTime = high.oclMicroSec;
+
+		if (profile.size() > 1)
+		{
+			const Sample &low = profile[profile.size() - 2];
+			double extra = pixels - high.pixels;
+			cpuTime += extra * max(0.0, (high.cpuMicroSec - low.cpuMicroSec) / (high.pixels - low.pixels));
+			oclTime += extra * max(0.0, (high.oclMicroSec - low.oclMicroSec) / (high.pixels - low.pixels));
+		}
+	}
+	else
+	{
+		for (size_t i = 1; i < profile.size(); i++)
+		{
+			if (pixels <= profile[i].pixels && pixels > profile[i - 1].pixels)
+			{
+				const Sample &low = profile[i - 1];
+				const Sample &high = profile[i];
+				double t = (std::log(pixels) - std::log((double)low.pixels)) / (std::log((double)high.pixels) - std::log((double)low.pixels));
+
+				cpuTime = low.cpuMicroSec + t * (high.cpuMicroSec - low.cpuMicroSec);
+				oclTime = low.oclMicroSec + t * (high.oclMicroSec - low.oclMicroSec);
+				break;
+			}
+		}
+	}
+
+	if (oclTime < cpuTime)
+	{
+		return *ocl;
+	}
+	return cpu;
+}
+
+void AutoCanny::Process(const Mat &input, Mat &edges)
+{
+	last = &Select(input.rows, input.cols);
+	last->Process(input, edges);
+}
+
+void AutoCanny::ProcessPacked(const Mat &input, PackedEdgeMap &edges)
+{
+	last = &Select(input.rows, input.cols);
+	last->ProcessPacked(input, edges);
+}
+
+void AutoCanny::Suppress(const Mat &input, Mat &suppressed)
+{
+	Select(input.rows, input.cols).Suppress(input, suppressed);
+}
+
+void AutoCanny::setThresholds(int low, int high)
+{
+	cpu.setThresholds(low, high);
+	if (ocl)
+	{
+		ocl->setThresholds(low, high);
+	}
+}
+
+vector<EdgePoint> AutoCanny::getEdgeList(bool withAttributes)
+{
+	return last ? last->getEdgeList(withAttributes) : vector<EdgePoint>();
+}
+
+vector<HoughLine> AutoCanny::HoughLines(unsigned int threshold, size_t maxLines, int thetaBins, int angleWindow)
+{
+	return last ? last->HoughLines(threshold, maxLines, thetaBins, angleWindow) : vector<HoughLine>();
+}
+
+void AutoCanny::PrintProfile(ostream &out) const
+{
+	if (!ocl)
+	{
+		out << "No OpenCL device, every frame runs on the CPU" << endl;
+		return;
+	}
+
+	out << "Profile for " << deviceName << ":" << endl;
+	for (size_t i = 0; i < profile.size(); i++)
+	{
+		const Sample &sample = profile[i];
+		out << (int)std::sqrt((double)sample.pixels) << "^2: CPU " << (int)sample.cpuMicroSec
+			<< "us OCL " << (int)sample.oclMicroSec << "us -> "
+			<< (sample.oclMicroSec < sample.cpuMicroSec ? "OCL" : "CPU") << endl;
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "CannyEngine.h"
+#include "CPUCanny.h"
+#include "OCLCanny.h"
+
+// Routes every frame to whichever backend was faster for frames of
+// that size. OpenCL pays a fixed launch and transfer cost per stage,
+// so small frames usually belong on the CPU and large ones on the device.
+// The timings are measured once, on two small frames, and kept in a
+// profile file, which is measured again when the OpenCL device changes.
+class AutoCanny : public CannyEngine
+{
+private:
+	struct Sample
+	{
+		int pixels;
+		double cpuMicroSec;
+		double oclMicroSec;
+	};
+
+	CPUCanny cpu;
+
+	// NULL without an OpenCL device, or if it did not initialize
+	std::unique_ptr<OCLCanny> ocl;
+	std::string deviceName;
+
+	// sorted by pixels
+	std::vector<Sample> profile;
+	std::string profileFile;
+
+	// backend of the last frame, for getEdgeList and HoughLines
+	CannyEngine *last = NULL;
+
+	bool LoadProfile();
+	void SaveProfile() const;
+	void Calibrate();
+
+	// fastest of a few runs after a warm-up
+	static double TimeEngine(CannyEngine &engine, const cv::Mat &image);
+
+public:
+	AutoCanny(const std::string &profileFile = "canny_profile.txt");
+
+	std::string getName() const;
+
+	// the backend Process would use for a frame of this size
+	CannyEngine &Select(int rows, int cols);
+
+	void Process(const cv::Mat &input, cv::Mat &edges);
+	void ProcessPacked(const cv::Mat &input, PackedEdgeMap &edges);
+	void Suppress(const cv::Mat &input, cv::Mat &suppressed);
+
+	// both backends, so the switch between them does not change the edges
+	void setThresholds(int low, int high);
+
+	std::vector<EdgePoint> getEdgeList(bool withAttributes = false);
+	std::vector<HoughLine> HoughLines(unsigned int threshold, size_t maxLines = 64, int thetaBins = 180, int angleWindow = 25);
+
+	void PrintProfile(std::ostream &out) const;
+};
@@ -0,0 +1,329 @@
+#include "BatchProcessor.h"
+#include "CannyEngine.h"
+#include "OCLCanny.h"
+#include "Timer.h"
+#include "utils.h"
+#include "Trace.h"
+#include <thread>
+#include <fstream>
+#include <cstring>
+#include <iomanip>
+#include <map>
+#include <algorithm>
+#include <opencv2/highgui/highgui.hpp>
+
+using std::string;
+using std::vector;
+using std::thread;
+using std::ifstream;
+using std::ostream;
+using std::endl;
+using std::cerr;
+using std::shared_ptr;
+using std::make_shared;
+using std::map;
+using cv::Mat;
+
+
+static bool HasExtension(const string &fileName, const string &extension)
+{
+	if (fileName.size() < extension.size())
+	{
+		return false;
+	}
+
+	string tail = fileName.substr(fileName.size() - extension.size());
+	for (size_t i = 0; i < tail.size(); i++)
+	{
+		tail[i] = (char)tolower(tail[i]);
+	}
+	return tail == extension;
+}
+
+static BatchOptions Clamped(BatchOptions options)
+{
+	options.decoderThreads = std::max(1, options.decoderThreads);
+	options.encoderThreads = std::max(1, options.encoderThreads);
+	options.queueDepth = std::max((size_t)1, options.queueDepth);
+	return options;
+}
+
+static string BaseName(const string &inputName)
+{
+	size_t slash = inputName.find_last_of("/\\");
+	string baseName = (slash == string::npos) ? inputName : inputName.substr(slash + 1);
+
+	size_t dot = baseName.find_last_of('.');
+	if (dot != string::npos)
+	{
+		baseName = baseName.substr(0, dot);
+	}
+	return baseName;
+}
+
+BatchProcessor::BatchProcessor(const BatchOptions &options)
+	: options(Clamped(options)),
+	decodedQueue(this->options.queueDepth),
+	edgeQueue(this->options.queueDepth),
+	nextInput(0),
+	activeDecoders(0),
+	processed(0),
+	failed(0),
+	decodeMicroSec(0),
+	cannyMicroSec(0),
+	encodeMicroSec(0)
+{
+}
+
+vector<string> BatchProcessor::ListInputs(const string &path)
+{
+	vector<string> files;
+
+	if (ListDirectory(path, files))
+	{
+		return files;
+	}
+
+	// not a directory, treat as a list of file names
+	ifstream list(path.c_str());
+	string line;
+	while (std::getline(list, line))
+	{
+		if (!line.empty() && line[line.size() - 1] == '\r')
+		{
+			line.erase(line.size() - 1);
+		}
+		if (!line.empty())
+		{
+			files.push_back(line);
+		}
+	}
+	return files;
+}
+
+void BatchProcessor::NameOutputs()
+{
+	// a.png and a.pgm, or dir1/a.png and dir2/a.png, would write the same
+	// file; compared without case as the file system may ignore it
+	map<string, int> uses;
+	vector<string> keys(options.inputs.size());
+	for (size_t i = 0; i < options.inputs.size(); i++)
+	{
+		keys[i] = BaseName(options.inputs[i]);
+		for (size_t j = 0; j < keys[i].size(); j++)
+		{
+			keys[i][j] = (char)tolower(keys[i][j]);
+		}
+		uses[keys[i]]++;
+	}
+
+	outputNames.resize(options.inputs.size());
+	for (size_t i = 0; i < options.inputs.size(); i++)
+	{
+		string name = BaseName(options.inputs[i]);
+		if (uses[keys[i]] > 1)
+		{
+			name += "_" + std::to_string(i);
+		}
+		outputNames[i] = options.outputDirectory + "/" + name + "_edges." + options.outputFormat;
+	}
+}
+
+void BatchProcessor::DecodeWorker()
+{
+	Timer timer;
+
+	for (;;)
+	{
+		size_t index = nextInput++;
+		if (index >= options.inputs.size())
+		{
+			break;
+		}
+
+		TRACE_ZONE("Batch decode");
+		timer.start();
+
+		Job job;
+		job.index = index;
+		job.name = options.inputs[index];
+
+		// PGM is mapped in place, everything else goes through the codecs
+		if (HasExtension(job.name, ".pgm"))
+		{
+			job.mapping = make_shared<MappedImage>();
+			if (job.mapping->OpenPGM(job.name))
+			{
+				job.image = job.mapping->getImage();
+			}
+		}
+		else
+		{
+			job.image = cv::imread(job.name, cv::IMREAD_GRAYSCALE);
+		}
+
+		timer.stop();
+		decodeMicroSec += (long long)timer.getElapsedTimeInMicroSec();
+
+		if (job.image.empty())
+		{
+			cerr << "Error: unable to decode " << job.name << endl;
+			failed++;
+			continue;
+		}
+
+		decodedQueue.push(std::move(job));
+	}
+
+	// the last decoder out tells the engine no more frames are coming
+	if (--activeDecoders == 0)
+	{
+		decodedQueue.close();
+	}
+}
+
+void BatchProcessor::CannyWorker()
+{
+	Timer timer;
+
+	// one engine is reused for every frame so an OpenCL context and its
+	// kernels (or the auto calibration) are only set up once
+	std::unique_ptr<CannyEngine> engine = CreateCannyEngine(options.backend);
+	if (!engine)
+	{
+		cerr << "Error: unknown backend " << options.backend << endl;
+		engine = CreateCannyEngine("cpu");
+	}
+
+	// a device whose kernels did not build would write garbage edge maps
+	OCLCanny *ocl = dynamic_cast<OCLCanny *>(engine.get());
+	if (ocl != NULL && !ocl->isInitialized())
+	{
+		cerr << "Error: OpenCL did not initialize on " << ocl->getDeviceName() << ", using the CPU" << endl;
+		engine = CreateCannyEngine("cpu");
+	}
+	engineName = engine->getName();
+
+	Job job;
+	while (decodedQueue.pop(job))
+	{
+		TRACE_ZONE("Batch canny");
+		timer.start();
+
+		// a fresh image per job, the previous one is still being encoded
+		job.edges = Mat(job.image.rows, job.image.cols, CV_8UC1);
+		engine->Process(job.image, job.edges);
+
+		timer.stop();
+		cannyMicroSec += (long long)timer.getElapsedTimeInMicroSec();
+
+		// release the input (and its mapping) before queueing
+		job.image.release();
+		job.mapping.reset();
+
+		edgeQueue.push(std::move(job));
+	}
+
+	edgeQueue.close();
+}
+
+void BatchProcessor::EncodeWorker()
+{
+	Timer timer;
+
+	Job job;
+	while (edgeQueue.pop(job))
+	{
+		TRACE_ZONE("Batch encode");
+		timer.start();
+
+		const string &outputName = outputNames[job.index];
+		bool written = false;
+
+		if (options.outputFormat == "pgm")
+		{
+			MappedImage output;
+			if (output.CreatePGM(outputName, job.edges.rows, job.edges.cols))
+			{
+				memcpy(output.getImage().data, job.edges.data, job.edges.rows * job.edges.cols);
+				written = true;
+			}
+		}
+		else
+		{
+			written = cv::imwrite(outputName, job.edges);
+		}
+
+		timer.stop();
+		encodeMicroSec += (long long)timer.getElapsedTimeInMicroSec();
+
+		if (written)
+		{
+			processed++;
+		}
+		else
+		{
+			cerr << "Error: unable to write " << outputName << endl;
+			failed++;
+		}
+	}
+}
+
+void BatchProcessor::Run()
+{
+	Timer timer;
+	timer.start();
+
+	NameOutputs();
+
+	activeDecoders = options.decoderThreads;
+
+	vector<thread> workers;
+	for (int i = 0; i < activeDecoders; i++)
+	{
+		workers.push_back(thread(&BatchProcessor::DecodeWorker, this));
+	}
+
+	workers.push_back(thread(&BatchProcessor::CannyWorker, this));
+
+	for (int i = 0; i < options.encoderThreads; i++)
+	{
+		workers.push_back(thread(&BatchProcessor::EncodeWorker, this));
+	}
+
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
+
+	timer.stop();
+	elapsedSec = timer.getElapsedTimeInSec();
+}
+
+void BatchProcessor::PrintReport(ostream &out)
+{
+	size_t frames = processed;
+
+	out << std::fixed << std::setprecision(2);
+	out << "Processed: " << frames << " Failed: " << failed << endl;
+	out << "Elapsed: " << elapsedSec << "s ("
+		<< (elapsedSec > 0 ? frames / elapsedSec : 0.0) << " files/s)" << endl;
+
+	// busy time per stage, summed over the threads of that stage
+	out << "Decode: " << decodeMicroSec / 1000.0 << "ms over "
+		<< options.decoderThreads << " threads" << endl;
+	out << "Canny: " << cannyMicroSec / 1000.0 << "ms ("
+		<< engineName << ")" << endl;
+	out << "Encode: " << encodeMicroSec / 1000.0 << "ms over "
+		<< options.encoderThreads << " threads" << endl;
+
+	// a queue that is usually full means the stage after it is the bottleneck
+	out << "Decode->Canny queue: avg " << decodedQueue.getAverageOccupancy()
+		<< " max " << decodedQueue.getMaxOccupancy()
+		<< "/" << decodedQueue.getCapacity()
+		<< " blocked " << decodedQueue.getBlockedPushes() << endl;
+	out << "Canny->Encode queue: avg " << edgeQueue.getAverageOccupancy()
+		<< " max " << edgeQueue.getMaxOccupancy()
+		<< "/" << edgeQueue.getCapacity()
+		<< " blocked " << edgeQueue.getBlockedPushes() << endl;
+}
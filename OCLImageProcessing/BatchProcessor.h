@@ -0,0 +1,78 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <iostream>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "BoundedQueue.h"
+#include "MappedImage.h"
+
+struct BatchOptions
+{
+	std::vector<std::string> inputs;
+	std::string outputDirectory = ".";
+	std::string outputFormat = "png";
+
+	// cpu, ocl or auto, see CreateCannyEngine
+	std::string backend = "cpu";
+	int decoderThreads = 2;
+	int encoderThreads = 2;
+	size_t queueDepth = 8;
+};
+
+// Headless three stage pipeline: a pool of decoders feeds a single
+// Canny engine thread which feeds a pool of encoders. The stages are
+// linked by bounded queues, so a slow stage throttles the others
+// instead of letting decoded frames pile up in memory.
+class BatchProcessor
+{
+private:
+	struct Job
+	{
+		size_t index;
+		std::string name;
+		cv::Mat image;
+		cv::Mat edges;
+
+		// keeps a mapped PGM alive until the engine is done with it
+		std::shared_ptr<MappedImage> mapping;
+	};
+
+	// thread counts and queue depth clamped to at least 1
+	BatchOptions options;
+
+	// one per input, with the input's index added where base names clash
+	std::vector<std::string> outputNames;
+
+	BoundedQueue<Job> decodedQueue;
+	BoundedQueue<Job> edgeQueue;
+
+	std::atomic<size_t> nextInput;
+	std::atomic<int> activeDecoders;
+
+	// statistics
+	std::atomic<size_t> processed;
+	std::atomic<size_t> failed;
+	std::atomic<long long> decodeMicroSec;
+	std::atomic<long long> cannyMicroSec;
+	std::atomic<long long> encodeMicroSec;
+	double elapsedSec = 0.0;
+	std::string engineName;
+
+	void DecodeWorker();
+	void CannyWorker();
+	void EncodeWorker();
+
+	void NameOutputs();
+
+public:
+	BatchProcessor(const BatchOptions &options);
+
+	// expand a directory, or a text file with one path per line
+	static std::vector<std::string> ListInputs(const std::string &path);
+
+	void Run();
+	void PrintReport(std::ostream &out);
+};
@@ -0,0 +1,108 @@
+#pragma once
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+// Blocking FIFO with a fixed capacity. push() waits while the queue is
+// full, which is what throttles a fast producer stage to the speed of a
+// slow consumer. Occupancy is sampled on every push for reporting.
+template <typename T>
+class BoundedQueue
+{
+private:
+	std::deque<T> items;
+	size_t capacity;
+	bool closed = false;
+
+	std::mutex lock;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+
+	// statistics
+	size_t pushes = 0;
+	size_t blockedPushes = 0;
+	size_t occupancySum = 0;
+	size_t occupancyMax = 0;
+
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(capacity, 1))
+	{
+	}
+
+	// returns false if the queue was closed before the item could be queued
+	bool push(T item)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		if (items.size() >= capacity && !closed)
+		{
+			blockedPushes++;
+			notFull.wait(guard, [this] { return items.size() < capacity || closed; });
+		}
+
+		if (closed)
+		{
+			return false;
+		}
+
+		items.push_back(std::move(item));
+
+		pushes++;
+		occupancySum += items.size();
+		occupancyMax = std::max(occupancyMax, items.size());
+
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// returns false once the queue is closed and drained
+	bool pop(T &item)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		notEmpty.wait(guard, [this] { return !items.empty() || closed; });
+
+		if (items.empty())
+		{
+			return false;
+		}
+
+		item = std::move(items.front());
+		items.pop_front();
+
+		notFull.notify_one();
+		return true;
+	}
+
+	// wake every waiter; remaining items can still be popped
+	void close()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+
+	size_t getCapacity() const
+	{
+		return capacity;
+	}
+
+	double getAverageOccupancy()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return pushes ? (double)occupancySum / pushes : 0.0;
+	}
+
+	size_t getMaxOccupancy()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return occupancyMax;
+	}
+
+	size_t getBlockedPushes()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return blockedPushes;
+	}
+};
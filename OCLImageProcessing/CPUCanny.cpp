@@ -1,8 +1,16 @@
 #include "CPUCanny.h"
+#include "CannyStages.h"
+#include "PaddedImage.h"
+#include "CPUDispatch.h"
+#include "EdgeLinker.h"
+#include "Hough.h"
+#include "Trace.h"
 #include <iostream>
+#include <cassert>
 #include <algorithm>
 #include <stack>
 #include <tuple>
+#include <cstring>
 
 using std::min;
 using std::max;
@@ -21,246 +29,296 @@ CPUCanny::CPUCanny()
 
 CPUCanny::~CPUCanny()
 {
-	free(gaussian);
-	free(sobel);
 	free(nonmaxima);
 	free(hysteresis);
 	free(theta);
 }
 
+std::string CPUCanny::getName() const
+{
+	return "CPU";
+}
+
+void CPUCanny::setPerfCounters(PerfCounters *counters)
+{
+	this->counters = counters;
+}
+
+void CPUCanny::Process(const cv::Mat & input, cv::Mat & edges)
+{
+	TRACE_ZONE("CPU Process");
+
+	AttachOCVImage(input.isContinuous() ? input : input.clone());
+	Gaussian();
+	Sobel();
+	NonMaximaSuppression();
+
+	edges.create(input.rows, input.cols, CV_8UC1);
+	HysteresisThresholding(edges);
+}
+
+void CPUCanny::ProcessPacked(const cv::Mat & input, PackedEdgeMap & edges)
+{
+	TRACE_ZONE("CPU ProcessPacked");
+
+	AttachOCVImage(input.isContinuous() ? input : input.clone());
+	Gaussian();
+	Sobel();
+	NonMaximaSuppression();
+	HysteresisThresholding(edges);
+}
+
+void CPUCanny::Suppress(const cv::Mat & input, cv::Mat & suppressed)
+{
+	TRACE_ZONE("CPU Suppress");
+
+	AttachOCVImage(input.isContinuous() ? input : input.clone());
+	Gaussian();
+	Sobel();
+
+	// copy out, the stage buffers belong to the next frame
+	NonMaximaSuppression().copyTo(suppressed);
+}
+
 void CPUCanny::LoadOCVImage(cv::Mat & rawImage)
 {
 	inputBuffer = rawImage.clone();
+	validStage = CannyStage::Input;
 }
 
-Mat CPUCanny::Gaussian()
+void CPUCanny::AttachOCVImage(const cv::Mat & rawImage)
 {
-	const float gaussian_kernel[5][5] = {
-		{ 0.00224214, 0.0165673, 0.0165673, 0.0165673, 0.00224214 },
-		{ 0.0165673, 0.0450347, 0.122417, 0.0450347, 0.0165673 },
-		{ 0.0165673, 0.122417, 0.122417, 0.122417, 0.0165673 },
-		{ 0.0165673, 0.0450347, 0.122417, 0.0450347, 0.0165673 },
-		{ 0.00224214, 0.0165673, 0.0165673, 0.0165673, 0.00224214 }
-	};
-
-	gaussian = (unsigned char *)malloc(inputBuffer.rows * inputBuffer.cols * inputBuffer.elemSize());
+	// stages index rows as row * cols, so the pixels must be contiguous
+	assert(rawImage.isContinuous());
+	inputBuffer = rawImage;
+	validStage = CannyStage::Input;
+}
 
-	// image
-	for (int row = 3; row < inputBuffer.rows - 3; row++)
+// stencils on padded images run over every pixel, the apron stands in
+// for the missing neighbours at the border; the row loops are those of
+// the instruction set level picked at startup, see CPUDispatch.h
+static void GaussianPadded(const PaddedImage &in, PaddedImage &out, int rows, int cols, const CPUStageLoops &loops)
+{
+	for (int row = 0; row < rows; row++)
 	{
-		for (int col = 3; col < inputBuffer.cols - 3; col++)
+		const unsigned char *taps[5];
+		for (int i = 0; i < 5; i++)
 		{
-			int pos = row * inputBuffer.cols + col;
-			int sum = 0;
-
-			// kernel
-			for (int i = 0; i < 5; i++)
-			{
-				for (int j = 0; j < 5; j++)
-				{
-					int idx = (i + row - 1)*inputBuffer.cols + (j + col - 1);
-					sum += gaussian_kernel[i][j] * inputBuffer.data[idx];
-				}
-			}
-
-			gaussian[pos] = min(255, max(0, sum));
+			taps[i] = in.ptr(row + i - 1) - 1;
 		}
+
+		loops.gaussianRow(taps, out.ptr(row), cols, gaussian_kernel);
 	}
-	return Mat(inputBuffer.rows, inputBuffer.cols, CV_8UC1, gaussian);
+
+	out.ReplicateBorder();
 }
 
-cv::Mat CPUCanny::Sobel()
+// with histograms, each gradient is also added to its cell's bin; that
+// stays a scalar loop, the plain stage takes the level's row loop
+static void SobelPadded(const PaddedImage &in, PaddedImage &magnitude, unsigned char *theta, int rows, int cols,
+	unsigned int *histograms, int cellSize, int bins, const CPUStageLoops &loops)
 {
-	const float MPI = 3.14159265f;
-	const int sobel_gx_kernel[3][3] = {
-		{ -1, 0, 1 },
-		{ -2, 0, 2 },
-		{ -1, 0, 1 }
-	};
+	if (histograms == NULL)
+	{
+		for (int row = 0; row < rows; row++)
+		{
+			const unsigned char *taps[3] = { in.ptr(row - 1) - 1, in.ptr(row) - 1, in.ptr(row + 1) - 1 };
+			loops.sobelRow(taps, magnitude.ptr(row), theta + row * cols, cols);
+		}
 
-	const int sobel_gy_kernel[3][3] = {
-		{ -1,-2,-1 },
-		{ 0, 0, 0 },
-		{ 1, 2, 1 }
-	};
+		magnitude.ReplicateBorder();
+		return;
+	}
 
-	sobel = (unsigned char *)malloc(inputBuffer.rows * inputBuffer.cols * inputBuffer.elemSize());
-	theta = (unsigned char *)malloc(inputBuffer.rows * inputBuffer.cols * inputBuffer.elemSize());
+	const int cellRows = cellSize ? rows / cellSize : 0;
+	const int cellCols = cellSize ? cols / cellSize : 0;
 
-	// image
-	for (int row = 1; row < inputBuffer.rows - 1; row++)
+	for (int row = 0; row < rows; row++)
 	{
-		for (int col = 1; col < inputBuffer.cols - 1; col++)
+		const unsigned char *taps[3] = { in.ptr(row - 1) - 1, in.ptr(row) - 1, in.ptr(row + 1) - 1 };
+		unsigned char *line = magnitude.ptr(row);
+		unsigned char *direction = theta + row * cols;
+
+		for (int col = 0; col < cols; col++)
 		{
-			float sumx = 0, sumy = 0, angle = 0;
-			int pos = row * inputBuffer.cols + col;
-			int sum = 0;
+			float sumx = 0, sumy = 0;
 
-			// kernel
 			for (int i = 0; i < 3; i++)
 			{
 				for (int j = 0; j < 3; j++)
 				{
-					int idx = (i + row - 1)*inputBuffer.cols + (j + col - 1);
-					sumx += sobel_gx_kernel[i][j] * gaussian[idx];
-					sumy += sobel_gy_kernel[i][j] * gaussian[idx];
+					sumx += sobel_gx_kernel[i][j] * taps[i][col + j];
+					sumy += sobel_gy_kernel[i][j] * taps[i][col + j];
 				}
 			}
 
-			sobel[pos] = min(255, max(0, (int)hypot(sumx, sumy)));
-
-			// get direction
-			angle = atan2(sumy, sumx);
+			line[col] = (unsigned char)min(255, max(0, (int)hypot(sumx, sumy)));
+			direction[col] = QuantizeGradient((int)sumx, (int)sumy);
 
-			// if angle is negative, then shift by 2PI
-			if (angle < 0.0f)
+			if (row / cellSize < cellRows && col / cellSize < cellCols)
 			{
-				angle = fmod((angle + 2 * MPI), (2 * MPI));
+				unsigned int *cell = histograms + ((row / cellSize) * cellCols + col / cellSize) * bins;
+				cell[HistogramBin(sumx, sumy, bins)] += HistogramWeight(sumx, sumy);
 			}
+		}
+	}
+
+	magnitude.ReplicateBorder();
+}
 
-			// round angles to 0, 45, 90 and 135 degs
-			// angles are equally likely to distribute between 
-			// 0~PI and PI~2PI
-			if (angle <= MPI)
+static void NonMaximaPadded(const PaddedImage &magnitude, const unsigned char *theta, unsigned char *out, int rows, int cols, const CPUStageLoops &loops)
+{
+	for (int row = 0; row < rows; row++)
+	{
+		loops.nonMaximaRow(magnitude.ptr(row), magnitude.getStride(), theta + row * cols, out + row * cols, cols);
+	}
+}
+
+// HysteresisRows over the whole frame, with the seeds of each row found
+// by the level's loop and skipped over eight pixels at a time
+static void HysteresisSeeded(const unsigned char *in, unsigned char *out, int rows, int cols, int tLow, int tHigh, const CPUStageLoops &loops)
+{
+	std::vector<unsigned char> seeds(cols + 8, 0);
+
+	for (int row = 1; row < rows - 1; row++)
+	{
+		loops.seedRow(in + row * cols, seeds.data(), cols, (unsigned char)tHigh);
+
+		for (int col = 1; col < cols - 1; col++)
+		{
+			if ((col & 7) == 0)
 			{
-				if (angle <= MPI / 8)
+				unsigned long long word;
+				memcpy(&word, &seeds[col], sizeof(word));
+				if (word == 0)
 				{
-					theta[pos] = 0;
-				}
-				else if (angle <= 3 * MPI / 8)
-				{
-					theta[pos] = 45;
-				}
-				else if (angle <= 5 * MPI / 8)
-				{
-					theta[pos] = 90;
-				}
-				else if (angle <= 7 * MPI / 8)
-				{
-					theta[pos] = 135;
-				}
-				else
-				{
-					theta[pos] = 0;
+					col += 7;
+					continue;
 				}
 			}
-			else
+
+			const int pos = row * cols + col;
+			if (seeds[col] && out[pos] != 255)
 			{
-				if (angle <= 9 * MPI / 8)
-				{
-					theta[pos] = 0;
-				}
-				else if (angle <= 11 * MPI / 8)
-				{
-					theta[pos] = 45;
-				}
-				else if (angle <= 13 * MPI / 8)
-				{
-					theta[pos] = 90;
-				}
-				else if (angle <= 15 * MPI / 8)
-				{
-					theta[pos] = 135;
-				}
-				else
-				{
-					theta[pos] = 0;
-				}
+				out[pos] = 255;
+				traceStack(in, out, row, col, rows, cols, (float)tLow);
 			}
 		}
 	}
-	return Mat(inputBuffer.rows, inputBuffer.cols, CV_8UC1, sobel);
 }
 
-cv::Mat CPUCanny::NonMaximaSuppression()
+Mat CPUCanny::Gaussian()
 {
-	nonmaxima = (unsigned char *)malloc(inputBuffer.rows * inputBuffer.cols * inputBuffer.elemSize());
+	TRACE_ZONE("CPU Gaussian");
+	PerfScope counted(counters, "Gaussian", inputBuffer.total());
+
+	// BGR is converted to luma on the way into the padded input
+	input.Load(inputBuffer);
+	gaussian.create(inputBuffer.rows, inputBuffer.cols);
+	GaussianPadded(input, gaussian, inputBuffer.rows, inputBuffer.cols, GetCPUStageLoops());
+	validStage = CannyStage::Gaussian;
+
+	return gaussian.getMat();
+}
 
-	for (int row = 1; row < inputBuffer.rows - 1; row++)
+void GaussianRows(const unsigned char *in, unsigned char *out, int rows, int cols, int rowBegin, int rowEnd)
+{
+	GaussianRows<unsigned char>(in, out, rows, cols, rowBegin, rowEnd);
+}
+
+void GaussianBGRRows(const unsigned char *bgr, unsigned char *out, int rows, int cols, int rowBegin, int rowEnd)
+{
+	rowBegin = max(3, rowBegin);
+	rowEnd = min(rows - 3, rowEnd);
+	if (rowBegin >= rowEnd)
 	{
-		for (int col = 1; col < inputBuffer.cols - 1; col++)
-		{
-			// define directions
-			const int pos = row * inputBuffer.cols + col;
-			const int N = (row - 1) * inputBuffer.cols + col;
-			const int NE = (row - 1) * inputBuffer.cols + (col + 1);
-			const int E = row * inputBuffer.cols + (col + 1);
-			const int SE = (row + 1) * inputBuffer.cols + (col + 1);
-			const int S = (row + 1) * inputBuffer.cols + col;
-			const int SW = (row + 1) * inputBuffer.cols + (col - 1);
-			const int W = row * inputBuffer.cols + (col - 1);
-			const int NW = (row - 1) * inputBuffer.cols + (col - 1);
-
-			
-			switch (theta[pos])
-			{
-				case 0:
-				{
-					// supress current pixel if neighbour has larger magnitude
-					if (sobel[pos] < sobel[E] || sobel[pos] < sobel[W])
-					{
-						nonmaxima[pos] = 0;
-					}
+		return;
+	}
 
-					// otherwise use current value
-					else
-					{
-						nonmaxima[pos] = sobel[pos];
-					}
-					break;
-				}
+	// the taps of output row r cover grey rows r - 1 .. r + 3; those are
+	// kept in a ring of five rows, so each input pixel is converted once
+	// and the grey image is never written out
+	std::vector<unsigned char> ring(5 * cols);
 
-				case 45:
-				{
-					if (sobel[pos] < sobel[NE] || sobel[pos] < sobel[SW])
-					{
-						nonmaxima[pos] = 0;
-					}
-					else
-					{
-						nonmaxima[pos] = sobel[pos];
-					}
-					break;
-				}
+	for (int greyRow = rowBegin - 1; greyRow < rowEnd + 3; greyRow++)
+	{
+		unsigned char *grey = &ring[(greyRow % 5) * cols];
+		const unsigned char *pixel = bgr + greyRow * cols * 3;
 
-				case 90:
-				{
-					if (sobel[pos] < sobel[N] || sobel[pos] < sobel[S])
-					{
-						nonmaxima[pos] = 0;
-					}
-					else
-					{
-						nonmaxima[pos] = sobel[pos];
-					}
-					break;
-				}
+		for (int col = 0; col < cols; col++)
+		{
+			grey[col] = BGRLuma(pixel + col * 3);
+		}
 
-				case 135:
-				{
-					if (sobel[pos] < sobel[NW] || sobel[pos] < sobel[SE])
-					{
-						nonmaxima[pos] = 0;
-					}
-					else
-					{
-						nonmaxima[pos] = sobel[pos];
-					}
-					break;
-				}
+		int row = greyRow - 3;
+		if (row < rowBegin)
+		{
+			continue;
+		}
 
-				default:
+		for (int col = 3; col < cols - 3; col++)
+		{
+			int sum = 0;
+
+			// kernel
+			for (int i = 0; i < 5; i++)
+			{
+				const unsigned char *tapRow = &ring[((row - 1 + i) % 5) * cols];
+				for (int j = 0; j < 5; j++)
 				{
-					nonmaxima[pos] = sobel[pos];
-					break;
+					sum += gaussian_kernel[i][j] * tapRow[j + col - 1];
 				}
 			}
+
+			out[row * cols + col] = min(255, max(0, sum));
 		}
 	}
+}
+
+cv::Mat CPUCanny::Sobel()
+{
+	TRACE_ZONE("CPU Sobel");
+	PerfScope counted(counters, "Sobel", inputBuffer.total());
+
+	sobel.create(inputBuffer.rows, inputBuffer.cols);
+	theta = (unsigned char *)realloc(theta, inputBuffer.rows * inputBuffer.cols);
+
+	unsigned int *cells = NULL;
+	if (histogramCellSize > 0)
+	{
+		histograms.assign((inputBuffer.rows / histogramCellSize) * (inputBuffer.cols / histogramCellSize) * histogramBins, 0);
+		cells = histograms.data();
+	}
+
+	SobelPadded(gaussian, sobel, theta, inputBuffer.rows, inputBuffer.cols, cells, histogramCellSize, histogramBins, GetCPUStageLoops());
+	validStage = CannyStage::Sobel;
+
+	return sobel.getMat();
+}
+
+void SobelRows(const unsigned char *in, unsigned char *magnitude, unsigned char *theta, int rows, int cols, int rowBegin, int rowEnd)
+{
+	SobelRows<unsigned char>(in, magnitude, theta, rows, cols, rowBegin, rowEnd);
+}
+
+cv::Mat CPUCanny::NonMaximaSuppression()
+{
+	TRACE_ZONE("CPU NonMaximaSuppression");
+	PerfScope counted(counters, "NonMaximaSuppression", inputBuffer.total());
+
+	nonmaxima = (unsigned char *)realloc(nonmaxima, inputBuffer.rows * inputBuffer.cols);
+
+	NonMaximaPadded(sobel, theta, nonmaxima, inputBuffer.rows, inputBuffer.cols, GetCPUStageLoops());
+	validStage = CannyStage::NonMaxima;
 
 	return Mat(inputBuffer.rows, inputBuffer.cols, CV_8UC1, nonmaxima);
 }
 
+void NonMaximaRows(const unsigned char *magnitude, const unsigned char *theta, unsigned char *out, int rows, int cols, int rowBegin, int rowEnd)
+{
+	NonMaximaRows<unsigned char>(magnitude, theta, out, rows, cols, rowBegin, rowEnd);
+}
+
 
 void print_data(int rows, int cols, unsigned char *in)
 {
@@ -275,12 +333,6 @@ void print_data(int rows, int cols, unsigned char *in)
 	printf("\n");
 }
 
-const int move_dir[2][8] = {
-	{ -1, -1, -1, 0, 0, 1, 1, 1 },
-	{ -1, 0, 1, -1, 1, -1, 0, 1 }
-};
-
-
 void traceRecursive(unsigned char *in, unsigned char *out, int row, int col, int rows, int cols, int tLow)
 {
 	// in[row][col] is edge, then find adjacent pixels
@@ -305,84 +357,311 @@ void traceRecursive(unsigned char *in, unsigned char *out, int row, int col, int
 	}
 }
 
-void traceStack(unsigned char *in, unsigned char *out, int row, int col, int rows, int cols, int tLow)
+
+cv::Mat CPUCanny::HysteresisThresholding()
+{
+	hysteresis = (unsigned char *)realloc(hysteresis, inputBuffer.rows * inputBuffer.cols);
+	
+	Mat output(inputBuffer.rows, inputBuffer.cols, CV_8UC1, hysteresis);
+	return HysteresisThresholding(output);
+}
+
+cv::Mat CPUCanny::HysteresisThresholding(cv::Mat & output)
 {
-	stack<tuple<int, int>> edges;
+	TRACE_ZONE("CPU HysteresisThresholding");
+	PerfScope counted(counters, "HysteresisThresholding", inputBuffer.total());
 
-	for (int i = 0; i < 8; i++)
+	assert(output.rows == inputBuffer.rows && output.cols == inputBuffer.cols);
+	assert(output.type() == CV_8UC1 && output.isContinuous());
+
+	// reset all output to low
+	memset(output.data, 0x00, inputBuffer.rows * inputBuffer.cols);
+
+	// seeds are found a byte at a time, other thresholds take the plain loop
+	if (tHigh >= 0 && tHigh < 255)
 	{
-		int x = col + move_dir[0][i];
-		int y = row + move_dir[1][i];
+		HysteresisSeeded(nonmaxima, output.data, inputBuffer.rows, inputBuffer.cols, tLow, tHigh, GetCPUStageLoops());
+	}
+	else
+	{
+		HysteresisRows(nonmaxima, output.data, inputBuffer.rows, inputBuffer.cols, 0, inputBuffer.rows, tLow, tHigh);
+	}
 
-		if (x >= 0 && x < cols && y >= 0 && y < rows)
-		{
-			int pos = y * cols + x;
+	edgeMap = output;
+	validStage = CannyStage::Hysteresis;
+	return output;
+}
 
-			// adjacent pixels
-			if (in[pos] >= tLow && out[pos] != 255)
+cv::Mat CPUCanny::HysteresisThresholding(cv::Mat & output, EdgeChains & chains)
+{
+	TRACE_ZONE("CPU HysteresisThresholding + chains");
+	PerfScope counted(counters, "HysteresisThresholding + chains", inputBuffer.total());
+
+	assert(output.rows == inputBuffer.rows && output.cols == inputBuffer.cols);
+	assert(output.type() == CV_8UC1 && output.isContinuous());
+
+	// reset all output to low
+	memset(output.data, 0x00, inputBuffer.rows * inputBuffer.cols);
+	chains.clear();
+
+	unsigned char *in = nonmaxima;
+	unsigned char *out = output.data;
+	int rows = inputBuffer.rows;
+	int cols = inputBuffer.cols;
+
+	// pixels of the component being traced
+	std::vector<int> component;
+
+	for (int row = 1; row < rows - 1; row++)
+	{
+		for (int col = 1; col < cols - 1; col++)
+		{
+			const int pos = row * cols + col;
+			if (in[pos] > tHigh && out[pos] != 255)
 			{
 				out[pos] = 255;
-				edges.push(make_tuple(x, y));
+				component.assign(1, pos);
+				traceStack<unsigned char>(in, out, row, col, rows, cols, tLow, &component);
+
+				ImageEdgeGraph graph(out, rows, cols, component);
+				LinkEdges(graph, chains);
 			}
 		}
 	}
 
-	while (!edges.empty())
+	edgeMap = output;
+	validStage = CannyStage::Hysteresis;
+	return output;
+}
+
+void CPUCanny::HysteresisThresholding(PackedEdgeMap & output)
+{
+	// tracing marks visited pixels in the byte map, it cannot go straight to bits
+	Mat edges = HysteresisThresholding();
+
+	TRACE_ZONE("CPU pack edges");
+	output.Pack(edges);
+}
+
+void CPUCanny::setThresholds(int low, int high)
+{
+	low = ClampThreshold(low);
+	high = ClampThreshold(high);
+	if (low == tLow && high == tHigh)
+	{
+		return;
+	}
+
+	tLow = low;
+	tHigh = high;
+
+	// the suppressed magnitude does not depend on the thresholds
+	validStage = min(validStage, CannyStage::NonMaxima);
+}
+
+bool CPUCanny::EvaluateSuppression()
+{
+	if (validStage == CannyStage::None)
+	{
+		std::cerr << "Error: no frame loaded to evaluate" << std::endl;
+		return false;
+	}
+
+	if (validStage < CannyStage::Gaussian)
+	{
+		Gaussian();
+	}
+	if (validStage < CannyStage::Sobel)
+	{
+		Sobel();
+	}
+	if (validStage < CannyStage::NonMaxima)
+	{
+		NonMaximaSuppression();
+	}
+	return true;
+}
+
+Mat CPUCanny::Evaluate()
+{
+	TRACE_ZONE("CPU Evaluate");
+
+	if (!EvaluateSuppression())
+	{
+		return Mat();
+	}
+
+	// an edge map that went to a caller's image may have been changed since
+	if (validStage < CannyStage::Hysteresis || edgeMap.data != hysteresis)
 	{
-		tuple<int, int> pair = edges.top();
-		edges.pop();
+		HysteresisThresholding();
+	}
 
-		for (int i = 0; i < 8; i++)
+	return edgeMap;
+}
+
+// Trace every pair at once: a pixel carries one bit per pair it is an
+// edge for, and passes on the bits its neighbour's magnitude allows.
+// Where thresholds nest, their bits travel together, so a component is
+// walked once for all of them rather than once per pair; a pixel is only
+// revisited when it gains bits, at most once per pair.
+template <typename Mask>
+static void SweepTrace(const unsigned char *in, Mask *out, int rows, int cols, const Mask *seeds, const Mask *allowed)
+{
+	std::vector<int> stack;
+
+	for (int row = 1; row < rows - 1; row++)
+	{
+		for (int col = 1; col < cols - 1; col++)
 		{
-			int x = get<0>(pair) + move_dir[0][i];
-			int y = get<1>(pair) + move_dir[1][i];
+			const int pos = row * cols + col;
+			Mask added = seeds[in[pos]] & ~out[pos];
+			if (!added)
+			{
+				continue;
+			}
 
-			if (x >= 0 && x < cols && y >= 0 && y < rows)
+			out[pos] |= added;
+			stack.push_back(pos);
+
+			while (!stack.empty())
 			{
-				int pos = y * cols + x;
+				int current = stack.back();
+				stack.pop_back();
+
+				int y = current / cols;
+				int x = current % cols;
+				Mask bits = out[current];
 
-				// adjacent pixels
-				if (in[pos] >= tLow && out[pos] != 255)
+				for (int i = 0; i < 8; i++)
 				{
-					out[pos] = 255;
-					edges.push(make_tuple(x, y));
+					int nx = x + move_dir[0][i];
+					int ny = y + move_dir[1][i];
+
+					if (nx >= 0 && nx < cols && ny >= 0 && ny < rows)
+					{
+						int next = ny * cols + nx;
+						Mask spread = bits & allowed[in[next]] & ~out[next];
+						if (spread)
+						{
+							out[next] |= spread;
+							stack.push_back(next);
+						}
+					}
 				}
 			}
 		}
 	}
 }
 
-cv::Mat CPUCanny::HysteresisThresholding()
+template <typename Mask>
+static void SweepTrace(const unsigned char *in, Mat &sweep, const std::vector<HysteresisThresholds> &thresholds)
 {
-	hysteresis = (unsigned char *)malloc(inputBuffer.rows * inputBuffer.cols * inputBuffer.elemSize());
-	
-	// reset all output to low
-	memset(hysteresis, 0x00, inputBuffer.rows * inputBuffer.cols * inputBuffer.elemSize());
-
-	unsigned char *in = nonmaxima;
-	unsigned char *out = hysteresis;
-	int rows = inputBuffer.rows;
-	int cols = inputBuffer.cols;
-	
-	const unsigned char tHigh = 80;
-	const unsigned char tLow = 50;
-	
-	for (int row = 1; row < rows - 1; row++)
+	// which pairs a magnitude starts an edge for, and which it continues
+	Mask seeds[256] = {};
+	Mask allowed[256] = {};
+	for (int magnitude = 0; magnitude < 256; magnitude++)
 	{
-		for (int col = 1; col < cols - 1; col++)
+		for (size_t k = 0; k < thresholds.size(); k++)
 		{
-			const int pos = row * inputBuffer.cols + col;
-			if (in[pos] > tHigh && out[pos] != 255)
+			if (magnitude > thresholds[k].high)
 			{
-				out[pos] = 255;
-				traceStack(in, out, row, col, rows, cols, tLow);
+				seeds[magnitude] |= (Mask)(1u << k);
+			}
+			if (magnitude >= thresholds[k].low)
+			{
+				allowed[magnitude] |= (Mask)(1u << k);
 			}
-
 		}
 	}
 
+	SweepTrace<Mask>(in, (Mask *)sweep.data, sweep.rows, sweep.cols, seeds, allowed);
+}
+
+Mat CPUCanny::HysteresisSweep(const std::vector<HysteresisThresholds> &thresholds)
+{
+	TRACE_ZONE("CPU HysteresisSweep");
+
+	if (thresholds.empty() || thresholds.size() > 16)
+	{
+		std::cerr << "Error: a sweep takes 1 to 16 threshold pairs" << std::endl;
+		return Mat();
+	}
+
+	if (!EvaluateSuppression())
+	{
+		return Mat();
+	}
+
+	PerfScope counted(counters, "HysteresisSweep", inputBuffer.total());
 
-	return Mat(inputBuffer.rows, inputBuffer.cols, CV_8UC1, out);
+	// clamped as setThresholds and the device do
+	std::vector<HysteresisThresholds> clamped(thresholds);
+	for (size_t k = 0; k < clamped.size(); k++)
+	{
+		clamped[k].low = ClampThreshold(clamped[k].low);
+		clamped[k].high = ClampThreshold(clamped[k].high);
+	}
+
+	bool wide = thresholds.size() > 8;
+	Mat sweep = Mat::zeros(inputBuffer.rows, inputBuffer.cols, wide ? CV_16UC1 : CV_8UC1);
+
+	if (wide)
+	{
+		SweepTrace<unsigned short>(nonmaxima, sweep, clamped);
+	}
+	else
+	{
+		SweepTrace<unsigned char>(nonmaxima, sweep, clamped);
+	}
+	return sweep;
+}
+
+bool CPUCanny::setOrientationHistograms(int cellSize, int bins)
+{
+	if (cellSize < 0 || (cellSize > 0 && (bins < 8 || bins > 18)))
+	{
+		std::cerr << "Error: orientation histograms take 8 to 18 bins and a positive cell size" << std::endl;
+		return false;
+	}
+
+	if (cellSize != histogramCellSize || (cellSize > 0 && bins != histogramBins))
+	{
+		histogramCellSize = cellSize;
+		histogramBins = cellSize > 0 ? bins : 0;
+		histograms.clear();
+
+		// the next Evaluate runs Sobel again to fill them
+		validStage = min(validStage, CannyStage::Gaussian);
+	}
+	return true;
+}
+
+Mat CPUCanny::getOrientationHistograms() const
+{
+	if (histogramCellSize == 0 || histograms.empty())
+	{
+		return Mat();
+	}
+
+	int cellRows = inputBuffer.rows / histogramCellSize;
+	Mat result(cellRows, (int)histograms.size() / cellRows, CV_32FC1);
+	float *out = (float *)result.data;
+	for (size_t i = 0; i < histograms.size(); i++)
+	{
+		out[i] = histograms[i] / HISTOGRAM_SCALE;
+	}
+	return result;
+}
+
+void HysteresisRows(unsigned char *in, unsigned char *out, int rows, int cols, int rowBegin, int rowEnd, int tLow, int tHigh)
+{
+	HysteresisRows<unsigned char>(in, out, rows, cols, rowBegin, rowEnd, (float)tLow, (float)tHigh);
+}
+
+void HysteresisSeam(unsigned char *in, unsigned char *out, int rows, int cols, int seam, int tLow)
+{
+	HysteresisSeam<unsigned char>(in, out, rows, cols, seam, (float)tLow);
 }
 
 Mat CPUCanny::getTheta()
@@ -432,3 +711,58 @@ Mat CPUCanny::getTheta()
 	return RGBTheta;
 }
 
+std::vector<EdgePoint> CPUCanny::getEdgeList(bool withAttributes)
+{
+	TRACE_ZONE("CPU getEdgeList");
+
+	std::vector<EdgePoint> edges;
+
+	// the edge map is stale after setThresholds, Suppress or a new frame,
+	// it would belong to the last one
+	if (validStage != CannyStage::None && validStage < CannyStage::Hysteresis)
+	{
+		Evaluate();
+	}
+
+	if (edgeMap.empty())
+	{
+		return edges;
+	}
+
+	for (int row = 0; row < edgeMap.rows; row++)
+	{
+		const unsigned char *line = edgeMap.ptr(row);
+
+		for (int col = 0; col < edgeMap.cols; col++)
+		{
+			if (line[col] != 255)
+			{
+				continue;
+			}
+
+			const int pos = row * edgeMap.cols + col;
+			EdgePoint edge;
+			edge.x = col;
+			edge.y = row;
+			edge.magnitude = withAttributes ? nonmaxima[pos] : 0;
+			edge.direction = withAttributes ? theta[pos] : 0;
+			edges.push_back(edge);
+		}
+	}
+
+	return edges;
+}
+
+std::vector<HoughLine> CPUCanny::HoughLines(unsigned int threshold, size_t maxLines, int thetaBins, int angleWindow)
+{
+	TRACE_ZONE("CPU HoughLines");
+
+	HoughSpace space(inputBuffer.rows, inputBuffer.cols, thetaBins, angleWindow);
+	std::vector<unsigned int> accumulator;
+
+	HoughVote(space, getEdgeList(true), accumulator);
+
+	std::vector<HoughLine> lines = HoughPeaks(space, accumulator, threshold);
+	SortHoughLines(lines, maxLines);
+	return lines;
+}
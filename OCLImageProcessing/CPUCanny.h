@@ -1,30 +1,136 @@
 #pragma once
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <vector>
 
-class CPUCanny
+#include "CannyTypes.h"
+#include "CannyEngine.h"
+#include "PerfCounters.h"
+#include "PaddedImage.h"
+
+class CPUCanny : public CannyEngine
 {
 private:
-	unsigned char *gaussian;
-	unsigned char *sobel;
-	unsigned char *nonmaxima;
-	unsigned char *hysteresis;
-	unsigned char *theta;
+	// stencil inputs, padded with a replicated border
+	PaddedImage input;
+	PaddedImage gaussian;
+	PaddedImage sobel;
+
+	unsigned char *nonmaxima = NULL;
+	unsigned char *hysteresis = NULL;
+	unsigned char *theta = NULL;
 
 	int buffer_idx;
 
 	cv::Mat inputBuffer;
 
+	// where the last HysteresisThresholding wrote its edge map
+	cv::Mat edgeMap;
+
+	// hysteresis thresholds on the suppressed magnitude
+	int tLow = 50;
+	int tHigh = 80;
+
+	// dirty tracking for Evaluate
+	CannyStage validStage = CannyStage::None;
+
+	// orientation histograms of the Sobel stage, off while the cell size is 0
+	int histogramCellSize = 0;
+	int histogramBins = 0;
+	std::vector<unsigned int> histograms;
+
+	// run the stages up to non-maxima suppression that are out of date,
+	// false without a frame
+	bool EvaluateSuppression();
+
+	// per stage hardware counters, NULL unless instrumented
+	PerfCounters *counters = NULL;
+
 public:
 	CPUCanny();
 	~CPUCanny();
 
+	std::string getName() const;
+
+	// count every stage with these counters from now on, NULL to stop;
+	// the stages must then run on the thread that created them
+	void setPerfCounters(PerfCounters *counters);
+
+	// the stages are reused frame after frame, their buffers only grow
+	void Process(const cv::Mat &input, cv::Mat &edges);
+	void ProcessPacked(const cv::Mat &input, PackedEdgeMap &edges);
+	void Suppress(const cv::Mat &input, cv::Mat &suppressed);
+
 	void LoadOCVImage(cv::Mat & rawImage);
+
+	// use the caller's pixels in place (e.g. a MappedImage), they are
+	// only read once by Gaussian to fill its padded input; like
+	// LoadOCVImage it takes grey or 3 channel BGR images
+	void AttachOCVImage(const cv::Mat & rawImage);
 	cv::Mat Gaussian();
 	cv::Mat Sobel();
 	cv::Mat NonMaximaSuppression();
 	cv::Mat HysteresisThresholding();
 
+	// write the edge map straight into a caller-provided CV_8UC1 image
+	cv::Mat HysteresisThresholding(cv::Mat & output);
+
+	// also link the edges of every traced component into chains while
+	// they are still hot, instead of running findContours afterwards
+	cv::Mat HysteresisThresholding(cv::Mat & output, EdgeChains & chains);
+
+	// traced into the stage's own byte map, then packed for storing at
+	// one bit per pixel; getEdgeList still sees the byte map
+	void HysteresisThresholding(PackedEdgeMap & output);
+
 	cv::Mat getTheta();
+
+	// takes effect on the next HysteresisThresholding; only that stage
+	// is stale afterwards
+	void setThresholds(int low, int high);
+
+	// edge map of the loaded frame with the current thresholds, running
+	// only the stages that are out of date: after setThresholds on the
+	// same frame that is hysteresis alone. The result is the stage's own
+	// buffer, valid until the next frame.
+	cv::Mat Evaluate();
+
+	// Hysteresis for up to 16 threshold pairs in one pass over the
+	// suppressed magnitude (stale stages run first, as for Evaluate).
+	// Bit k of each pixel is the edge map of thresholds[k], see
+	// SweepEdges; CV_8UC1 for up to 8 pairs, CV_16UC1 above.
+	cv::Mat HysteresisSweep(const std::vector<HysteresisThresholds> &thresholds);
+
+	// Accumulate orientation histograms in the Sobel pass from now on:
+	// cells of cellSize x cellSize pixels, 8 to 18 bins over 0 ~ PI
+	// weighted by the gradient magnitude. Only whole cells are counted;
+	// cellSize 0 turns them off. False for unsupported values.
+	bool setOrientationHistograms(int cellSize, int bins);
+
+	// histograms of the last Sobel, CV_32FC1 with a row per row of cells
+	// and the bins of each cell side by side
+	cv::Mat getOrientationHistograms() const;
+
+	// edge pixels of the last HysteresisThresholding in row order,
+	// optionally with their magnitude and direction
+	std::vector<EdgePoint> getEdgeList(bool withAttributes = false);
+
+	// lines through the last edge map, voting only within angleWindow
+	// degrees of each edge's gradient direction
+	std::vector<HoughLine> HoughLines(unsigned int threshold, size_t maxLines = 64, int thetaBins = 180, int angleWindow = 25);
 };
 
+// stage loops over output rows [rowBegin, rowEnd) of a full frame,
+// rows and columns too close to the border are skipped
+void GaussianRows(const unsigned char *in, unsigned char *out, int rows, int cols, int rowBegin, int rowEnd);
+
+// Gaussian of the luma of an interleaved BGR frame, converted on the fly
+void GaussianBGRRows(const unsigned char *bgr, unsigned char *out, int rows, int cols, int rowBegin, int rowEnd);
+void SobelRows(const unsigned char *in, unsigned char *magnitude, unsigned char *theta, int rows, int cols, int rowBegin, int rowEnd);
+void NonMaximaRows(const unsigned char *magnitude, const unsigned char *theta, unsigned char *out, int rows, int cols, int rowBegin, int rowEnd);
+
+// hysteresis over rows [rowBegin, rowEnd) of a full frame, tracing stays inside the rows
+void HysteresisRows(unsigned char *in, unsigned char *out, int rows, int cols, int rowBegin, int rowEnd, int tLow, int tHigh);
+
+// continue tracing edges across the boundary between rows seam - 1 and seam
+void HysteresisSeam(unsigned char *in, unsigned char *out, int rows, int cols, int seam, int tLow);
@@ -0,0 +1,205 @@
+#include "CPUDispatch.h"
+#include <iostream>
+#include <atomic>
+#include <cstdlib>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#elif CPU_DISPATCH_X86
+#include <cpuid.h>
+#endif
+
+using std::string;
+using std::cerr;
+using std::endl;
+
+
+// built in CPUStages*.cpp, each for its own level
+extern const CPUStageLoops baselineStageLoops;
+extern const CPUStageLoops sse42StageLoops;
+extern const CPUStageLoops avx2StageLoops;
+extern const CPUStageLoops avx512StageLoops;
+
+#if CPU_DISPATCH_X86
+static void CPUID(unsigned int leaf, unsigned int subleaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuidex(info, (int)leaf, (int)subleaf);
+	for (int i = 0; i < 4; i++)
+	{
+		regs[i] = (unsigned int)info[i];
+	}
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// register state the OS saves on a context switch
+static unsigned long long EnabledXState()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned int eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+#endif
+
+InstructionSet DetectInstructionSet()
+{
+	InstructionSet level = InstructionSet::Baseline;
+
+#if CPU_DISPATCH_X86
+	unsigned int regs[4];
+	CPUID(0, 0, regs);
+	unsigned int maxLeaf = regs[0];
+
+	CPUID(1, 0, regs);
+	const unsigned int features = regs[2];
+	if (features & (1u << 20))
+	{
+		level = InstructionSet::SSE42;
+	}
+
+	// AVX needs the OS to save the ymm (and for AVX-512 the zmm and
+	// mask) registers, not just the CPU to have them
+	bool osxsave = (features & (1u << 27)) != 0;
+	bool avx = (features & (1u << 28)) != 0;
+	if (maxLeaf < 7 || !osxsave || !avx)
+	{
+		return level;
+	}
+
+	unsigned long long xstate = EnabledXState();
+	CPUID(7, 0, regs);
+	const unsigned int extended = regs[1];
+
+	if ((xstate & 0x6) == 0x6 && (extended & (1u << 5)))
+	{
+		level = InstructionSet::AVX2;
+	}
+	if ((xstate & 0xe6) == 0xe6 && (extended & (1u << 16)) && (extended & (1u << 30)) && level == InstructionSet::AVX2)
+	{
+		level = InstructionSet::AVX512;
+	}
+#endif
+
+	return level;
+}
+
+static InstructionSet DetectedInstructionSet()
+{
+	static const InstructionSet detected = DetectInstructionSet();
+	return detected;
+}
+
+static InstructionSet InitialInstructionSet()
+{
+	InstructionSet detected = DetectedInstructionSet();
+
+	const char *name = std::getenv("CANNY_ISA");
+	if (name == NULL || *name == '\0')
+	{
+		return detected;
+	}
+
+	InstructionSet requested;
+	if (!ParseInstructionSet(name, requested))
+	{
+		cerr << "Error: unknown CANNY_ISA " << name << ", using " << InstructionSetName(detected) << endl;
+		return detected;
+	}
+	if (requested > detected)
+	{
+		cerr << "Error: CANNY_ISA " << name << " is not supported here, using " << InstructionSetName(detected) << endl;
+		return detected;
+	}
+	return requested;
+}
+
+static std::atomic<int> &SelectedInstructionSet()
+{
+	static std::atomic<int> selected((int)InitialInstructionSet());
+	return selected;
+}
+
+InstructionSet getInstructionSet()
+{
+	return (InstructionSet)SelectedInstructionSet().load();
+}
+
+bool setInstructionSet(InstructionSet level)
+{
+	if (level > DetectedInstructionSet())
+	{
+		cerr << "Error: " << InstructionSetName(level) << " is not supported here" << endl;
+		return false;
+	}
+
+	SelectedInstructionSet() = (int)level;
+	return true;
+}
+
+const char *InstructionSetName(InstructionSet level)
+{
+	switch (level)
+	{
+		case InstructionSet::SSE42:
+		{
+			return "sse4.2";
+		}
+		case InstructionSet::AVX2:
+		{
+			return "avx2";
+		}
+		case InstructionSet::AVX512:
+		{
+			return "avx512";
+		}
+		default:
+		{
+			return "baseline";
+		}
+	}
+}
+
+bool ParseInstructionSet(const string &name, InstructionSet &level)
+{
+	const InstructionSet all[] = { InstructionSet::Baseline, InstructionSet::SSE42, InstructionSet::AVX2, InstructionSet::AVX512 };
+	for (InstructionSet candidate : all)
+	{
+		if (name == InstructionSetName(candidate))
+		{
+			level = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+const CPUStageLoops &GetCPUStageLoops()
+{
+	switch (getInstructionSet())
+	{
+		case InstructionSet::SSE42:
+		{
+			return sse42StageLoops;
+		}
+		case InstructionSet::AVX2:
+		{
+			return avx2StageLoops;
+		}
+		case InstructionSet::AVX512:
+		{
+			return avx512StageLoops;
+		}
+		default:
+		{
+			return baselineStageLoops;
+		}
+	}
+}
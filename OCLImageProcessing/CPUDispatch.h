@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CPU_DISPATCH_X86 1
+#else
+#define CPU_DISPATCH_X86 0
+#endif
+
+// Instruction set levels the CPU stage loops are built for, lowest
+// first. Baseline is whatever the rest of the build targets; the others
+// need cpuid and, for the AVX levels, OS support for the wider registers.
+enum class InstructionSet
+{
+	Baseline,
+	SSE42,
+	AVX2,
+	AVX512		// AVX-512 F and BW
+};
+
+// the row loops of CPUCanny's stages, one table per level, see
+// CPUStageLoops.h; taps point one column left of their row
+struct CPUStageLoops
+{
+	void (*gaussianRow)(const unsigned char *const *taps, unsigned char *out, int cols, const float (*weights)[5]);
+	void (*sobelRow)(const unsigned char *const *taps, unsigned char *magnitude, unsigned char *theta, int cols);
+	void (*nonMaximaRow)(const unsigned char *magnitude, ptrdiff_t stride, const unsigned char *theta, unsigned char *out, int cols);
+	void (*seedRow)(const unsigned char *in, unsigned char *seeds, int cols, unsigned char tHigh);
+};
+
+// highest level this CPU and OS support
+InstructionSet DetectInstructionSet();
+
+// The level the loops run at. It is picked once, on first use: the
+// detected level, or the one named by CANNY_ISA (baseline, sse4.2, avx2,
+// avx512) if that is set and supported.
+InstructionSet getInstructionSet();
+
+// run at a lower level from now on, e.g. to compare them; false if the
+// CPU does not have it
+bool setInstructionSet(InstructionSet level);
+
+const char *InstructionSetName(InstructionSet level);
+
+// the inverse of InstructionSetName, false for an unknown name
+bool ParseInstructionSet(const std::string &name, InstructionSet &level);
+
+// loops of the current level
+const CPUStageLoops &GetCPUStageLoops();
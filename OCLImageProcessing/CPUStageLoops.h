@@ -0,0 +1,237 @@
+// Row loops of the CPU stages, built once per instruction set level.
+//
+// No include guard and no includes on purpose: each CPUStages*.cpp sets
+// its target and then includes this file inside a namespace of its own,
+// so every level gets private copies of these functions. Nothing in here
+// may call an inline function of another header, the linker could keep
+// the copy built for a level the CPU does not have.
+//
+// Rows go in blocks of BLOCK columns, the last block ending at the last
+// column and overlapping the one before; every loop in a block runs
+// along the columns innermost with a fixed count, which is what the
+// vectorizers take. Rows narrower than a block go a column at a time.
+// Results are the same at every level.
+
+// AVX-512 has fused multiply-adds even without FMA, they would round
+// the Gaussian differently
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#elif defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+
+const int BLOCK = 64;
+
+static inline unsigned char Saturate(int value)
+{
+	return (unsigned char)(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+static inline unsigned char Larger(unsigned char a, unsigned char b)
+{
+	return a > b ? a : b;
+}
+
+// QuantizeGradient of CannyStages.h, repeated here for the reason above
+static inline unsigned char Direction(int gx, int gy)
+{
+	int ax = gx < 0 ? -gx : gx;
+	int ay = gy < 0 ? -gy : gy;
+	int twiceX2 = 2 * ax * ax;
+
+	unsigned char direction = (gx ^ gy) >= 0 ? 45 : 135;
+	direction = ay > ax && (ay - ax) * (ay - ax) > twiceX2 ? 90 : direction;
+	direction = (ax + ay) * (ax + ay) <= twiceX2 ? 0 : direction;
+	return direction;
+}
+
+template <int Count>
+static void GaussianColumns(const unsigned char *const *taps, unsigned char *__restrict out, int col, const float (*weights)[5])
+{
+	int sum[Count];
+	for (int c = 0; c < Count; c++)
+	{
+		sum[c] = 0;
+	}
+
+	// tap by tap; each sum is still truncated after every add
+	for (int i = 0; i < 5; i++)
+	{
+		for (int j = 0; j < 5; j++)
+		{
+			const float weight = weights[i][j];
+			const unsigned char *tap = taps[i] + col + j;
+			for (int c = 0; c < Count; c++)
+			{
+				sum[c] += weight * tap[c];
+			}
+		}
+	}
+
+	for (int c = 0; c < Count; c++)
+	{
+		out[col + c] = Saturate(sum[c]);
+	}
+}
+
+// taps[i] points one column left of row i - 1, as in GaussianPadded
+static void GaussianRow(const unsigned char *const *taps, unsigned char *out, int cols, const float (*weights)[5])
+{
+	// local copies, out could alias the weights otherwise
+	float w[5][5];
+	const unsigned char *t[5];
+	for (int i = 0; i < 5; i++)
+	{
+		t[i] = taps[i];
+		for (int j = 0; j < 5; j++)
+		{
+			w[i][j] = weights[i][j];
+		}
+	}
+
+	if (cols < BLOCK)
+	{
+		for (int col = 0; col < cols; col++)
+		{
+			GaussianColumns<1>(t, out, col, w);
+		}
+		return;
+	}
+
+	for (int col = 0; col < cols - BLOCK; col += BLOCK)
+	{
+		GaussianColumns<BLOCK>(t, out, col, w);
+	}
+	GaussianColumns<BLOCK>(t, out, cols - BLOCK, w);
+}
+
+template <int Count>
+static void SobelColumns(const unsigned char *const *taps, unsigned char *__restrict magnitude, unsigned char *__restrict theta, int col)
+{
+	const unsigned char *above = taps[0] + col;
+	const unsigned char *centre = taps[1] + col;
+	const unsigned char *below = taps[2] + col;
+
+	int squared[Count];
+	int root[Count];
+	for (int c = 0; c < Count; c++)
+	{
+		int gx = (above[c + 2] - above[c]) + 2 * (centre[c + 2] - centre[c]) + (below[c + 2] - below[c]);
+		int gy = (below[c] + 2 * below[c + 1] + below[c + 2]) - (above[c] + 2 * above[c + 1] + above[c + 2]);
+
+		squared[c] = gx * gx + gy * gy;
+		root[c] = 0;
+		theta[col + c] = Direction(gx, gy);
+	}
+
+	// floor(sqrt()) a bit at a time: exact, and no libm call that the
+	// vectorizer would have to keep for errno
+	for (int bit = 128; bit > 0; bit >>= 1)
+	{
+		for (int c = 0; c < Count; c++)
+		{
+			int next = root[c] | bit;
+			root[c] = next * next <= squared[c] ? next : root[c];
+		}
+	}
+
+	for (int c = 0; c < Count; c++)
+	{
+		magnitude[col + c] = (unsigned char)(squared[c] >= 255 * 255 ? 255 : root[c]);
+	}
+}
+
+// taps[i] points one column left of row i - 1, as in SobelPadded
+static void SobelRow(const unsigned char *const *taps, unsigned char *magnitude, unsigned char *theta, int cols)
+{
+	const unsigned char *t[3] = { taps[0], taps[1], taps[2] };
+
+	if (cols < BLOCK)
+	{
+		for (int col = 0; col < cols; col++)
+		{
+			SobelColumns<1>(t, magnitude, theta, col);
+		}
+		return;
+	}
+
+	for (int col = 0; col < cols - BLOCK; col += BLOCK)
+	{
+		SobelColumns<BLOCK>(t, magnitude, theta, col);
+	}
+	SobelColumns<BLOCK>(t, magnitude, theta, cols - BLOCK);
+}
+
+template <int Count>
+static void NonMaximaColumns(const unsigned char *magnitude, ptrdiff_t stride, const unsigned char *theta, unsigned char *__restrict out, int col)
+{
+	const unsigned char *line = magnitude + col;
+	const unsigned char *above = line - stride;
+	const unsigned char *below = line + stride;
+
+	for (int c = 0; c < Count; c++)
+	{
+		// the larger neighbour along each direction, then pick one
+		unsigned char along0 = Larger(line[c - 1], line[c + 1]);
+		unsigned char along45 = Larger(above[c + 1], below[c - 1]);
+		unsigned char along90 = Larger(above[c], below[c]);
+		unsigned char along135 = Larger(above[c - 1], below[c + 1]);
+
+		unsigned char direction = theta[col + c];
+		unsigned char neighbour = direction == 0 ? along0 :
+			direction == 45 ? along45 :
+			direction == 90 ? along90 :
+			direction == 135 ? along135 : 0;
+
+		out[col + c] = line[c] < neighbour ? 0 : line[c];
+	}
+}
+
+// magnitude is a padded row, theta and out are packed
+static void NonMaximaRow(const unsigned char *magnitude, ptrdiff_t stride, const unsigned char *theta, unsigned char *out, int cols)
+{
+	if (cols < BLOCK)
+	{
+		for (int col = 0; col < cols; col++)
+		{
+			NonMaximaColumns<1>(magnitude, stride, theta, out, col);
+		}
+		return;
+	}
+
+	for (int col = 0; col < cols - BLOCK; col += BLOCK)
+	{
+		NonMaximaColumns<BLOCK>(magnitude, stride, theta, out, col);
+	}
+	NonMaximaColumns<BLOCK>(magnitude, stride, theta, out, cols - BLOCK);
+}
+
+template <int Count>
+static void SeedColumns(const unsigned char *in, unsigned char *__restrict seeds, unsigned char tHigh, int col)
+{
+	for (int c = 0; c < Count; c++)
+	{
+		seeds[col + c] = in[col + c] > tHigh ? 1 : 0;
+	}
+}
+
+// 1 where hysteresis starts tracing, 0 elsewhere
+static void SeedRow(const unsigned char *in, unsigned char *seeds, int cols, unsigned char tHigh)
+{
+	if (cols < BLOCK)
+	{
+		for (int col = 0; col < cols; col++)
+		{
+			SeedColumns<1>(in, seeds, tHigh, col);
+		}
+		return;
+	}
+
+	for (int col = 0; col < cols - BLOCK; col += BLOCK)
+	{
+		SeedColumns<BLOCK>(in, seeds, tHigh, col);
+	}
+	SeedColumns<BLOCK>(in, seeds, tHigh, cols - BLOCK);
+}
@@ -0,0 +1,22 @@
+#include <cstddef>
+#include "CPUDispatch.h"
+
+// Built for AVX2, /arch:AVX2 for this file in the Visual Studio project.
+// FMA is left out on purpose, contracting the Gaussian's multiply-adds
+// would round differently from the other levels.
+#if CPU_DISPATCH_X86 && defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#elif CPU_DISPATCH_X86 && defined(__GNUC__)
+#pragma GCC target("avx2")
+#endif
+
+namespace AVX2
+{
+#include "CPUStageLoops.h"
+}
+
+extern const CPUStageLoops avx2StageLoops = { AVX2::GaussianRow, AVX2::SobelRow, AVX2::NonMaximaRow, AVX2::SeedRow };
+
+#if CPU_DISPATCH_X86 && defined(__clang__)
+#pragma clang attribute pop
+#endif
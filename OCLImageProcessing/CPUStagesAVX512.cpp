@@ -0,0 +1,21 @@
+#include <cstddef>
+#include "CPUDispatch.h"
+
+// Built for AVX-512 F and BW. The v140 toolset has no /arch:AVX512, so
+// the Visual Studio project compiles this file with /arch:AVX2.
+#if CPU_DISPATCH_X86 && defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f,avx512bw"))), apply_to = function)
+#elif CPU_DISPATCH_X86 && defined(__GNUC__)
+#pragma GCC target("avx512f,avx512bw")
+#endif
+
+namespace AVX512
+{
+#include "CPUStageLoops.h"
+}
+
+extern const CPUStageLoops avx512StageLoops = { AVX512::GaussianRow, AVX512::SobelRow, AVX512::NonMaximaRow, AVX512::SeedRow };
+
+#if CPU_DISPATCH_X86 && defined(__clang__)
+#pragma clang attribute pop
+#endif
@@ -0,0 +1,10 @@
+#include <cstddef>
+#include "CPUDispatch.h"
+
+// built like the rest of the project, for CPUs without the other levels
+namespace Baseline
+{
+#include "CPUStageLoops.h"
+}
+
+extern const CPUStageLoops baselineStageLoops = { Baseline::GaussianRow, Baseline::SobelRow, Baseline::NonMaximaRow, Baseline::SeedRow };
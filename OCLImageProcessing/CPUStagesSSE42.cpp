@@ -0,0 +1,21 @@
+#include <cstddef>
+#include "CPUDispatch.h"
+
+// Built for SSE4.2. Visual Studio has no /arch for it, so there this
+// file is compiled like the rest of the project.
+#if CPU_DISPATCH_X86 && defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse4.2"))), apply_to = function)
+#elif CPU_DISPATCH_X86 && defined(__GNUC__)
+#pragma GCC target("sse4.2")
+#endif
+
+namespace SSE42
+{
+#include "CPUStageLoops.h"
+}
+
+extern const CPUStageLoops sse42StageLoops = { SSE42::GaussianRow, SSE42::SobelRow, SSE42::NonMaximaRow, SSE42::SeedRow };
+
+#if CPU_DISPATCH_X86 && defined(__clang__)
+#pragma clang attribute pop
+#endif
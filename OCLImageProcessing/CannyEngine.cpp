@@ -0,0 +1,73 @@
+#include "CannyEngine.h"
+#include "CPUCanny.h"
+#include "OCLCanny.h"
+#include "AutoCanny.h"
+#include "WarmupCanny.h"
+#include <random>
+#include <algorithm>
+
+using std::string;
+using std::unique_ptr;
+
+
+void CannyEngine::ProcessPacked(const cv::Mat &input, PackedEdgeMap &edges)
+{
+	cv::Mat bytes;
+	Process(input, bytes);
+	edges.Pack(bytes);
+}
+
+cv::Mat SyntheticFrame(int size, unsigned int seed)
+{
+	std::mt19937 gen(seed);
+	std::normal_distribution<> noise(0, 12);
+
+	cv::Mat frame(size, size, CV_8UC1);
+	for (int row = 0; row < size; row++)
+	{
+		for (int col = 0; col < size; col++)
+		{
+			double value = ((row / 32 + col / 32) % 2 ? 160 : 64) + noise(gen);
+			frame.at<unsigned char>(row, col) = (unsigned char)std::min(255.0, std::max(0.0, value));
+		}
+	}
+	return frame;
+}
+
+cv::Mat SweepEdges(const cv::Mat &sweep, int k)
+{
+	cv::Mat edges(sweep.rows, sweep.cols, CV_8UC1);
+	const unsigned int bit = 1u << k;
+
+	for (int row = 0; row < sweep.rows; row++)
+	{
+		unsigned char *out = edges.ptr<unsigned char>(row);
+		for (int col = 0; col < sweep.cols; col++)
+		{
+			unsigned int bits = sweep.depth() == CV_16U ? sweep.at<unsigned short>(row, col) : sweep.at<unsigned char>(row, col);
+			out[col] = (bits & bit) ? 255 : 0;
+		}
+	}
+	return edges;
+}
+
+unique_ptr<CannyEngine> CreateCannyEngine(const string &backend)
+{
+	if (backend == "cpu")
+	{
+		return unique_ptr<CannyEngine>(new CPUCanny());
+	}
+	if (backend == "ocl")
+	{
+		return unique_ptr<CannyEngine>(new OCLCanny());
+	}
+	if (backend == "auto")
+	{
+		return unique_ptr<CannyEngine>(new AutoCanny());
+	}
+	if (backend == "warmup")
+	{
+		return unique_ptr<CannyEngine>(new WarmupCanny());
+	}
+	return unique_ptr<CannyEngine>();
+}
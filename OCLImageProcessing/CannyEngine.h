@@ -0,0 +1,51 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "CannyTypes.h"
+#include "PackedEdgeMap.h"
+
+// What every Canny backend can do with a whole frame. The stage by stage
+// calls of CPUCanny and OCLCanny stay available for benchmarking.
+class CannyEngine
+{
+public:
+	virtual ~CannyEngine() {}
+
+	virtual std::string getName() const = 0;
+
+	// all stages, edges is (re)allocated as a CV_8UC1 image of the input size
+	virtual void Process(const cv::Mat &input, cv::Mat &edges) = 0;
+
+	// all stages, edges at one bit per pixel; by default Process and pack
+	virtual void ProcessPacked(const cv::Mat &input, PackedEdgeMap &edges);
+
+	// Gaussian, Sobel and non-maxima suppression only, for callers that
+	// threshold the magnitude themselves (e.g. per band)
+	virtual void Suppress(const cv::Mat &input, cv::Mat &suppressed) = 0;
+
+	// hysteresis thresholds of later frames, clamped to 0..255
+	virtual void setThresholds(int low, int high) = 0;
+
+	// edges of the last frame with the current thresholds; hysteresis
+	// runs again first if they changed since, or the frame was only
+	// suppressed
+	virtual std::vector<EdgePoint> getEdgeList(bool withAttributes = false) = 0;
+	virtual std::vector<HoughLine> HoughLines(unsigned int threshold, size_t maxLines = 64, int thetaBins = 180, int angleWindow = 25) = 0;
+};
+
+// size x size frame of 32 pixel blocks and noise, so that every stage has
+// work to do; the same pixels for the same seed, for calibration and
+// warm-up runs
+cv::Mat SyntheticFrame(int size, unsigned int seed = 1);
+
+// edge map k (0 or 255) of a HysteresisSweep bit mask. Both backends
+// trace the sweep from the strong pixels and give the same masks for the
+// same magnitude; OCLCanny's Process thresholds each pixel alone, so its
+// masks match CPUCanny's Process rather than its own.
+cv::Mat SweepEdges(const cv::Mat &sweep, int k);
+
+// "cpu", "ocl", "auto" or "warmup", NULL for anything else
+std::unique_ptr<CannyEngine> CreateCannyEngine(const std::string &backend);
@@ -0,0 +1,453 @@
+#pragma once
+#include <vector>
+#include <stack>
+#include <tuple>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+
+// Stage loops shared by the CPU engines, templated on the pixel type.
+// 8 bit pixels keep the original behaviour (integer blur, magnitude
+// saturated to 255); 16 bit and float pixels blur and keep gradients in
+// float, so their full range goes through without a conversion pass.
+template <typename Pixel>
+struct PixelTraits;
+
+template <>
+struct PixelTraits<unsigned char>
+{
+	typedef int Sum;
+	typedef unsigned char Gradient;
+	static const int cvType = CV_8UC1;
+	static const int gradientCvType = CV_8UC1;
+
+	// full scale value, thresholds scale with it
+	static float Range()
+	{
+		return 255.0f;
+	}
+
+	static unsigned char Blurred(Sum sum)
+	{
+		return (unsigned char)std::min(255, std::max(0, sum));
+	}
+
+	static Gradient Magnitude(double magnitude)
+	{
+		return (Gradient)std::min(255, std::max(0, (int)magnitude));
+	}
+};
+
+template <>
+struct PixelTraits<unsigned short>
+{
+	typedef float Sum;
+	typedef float Gradient;
+	static const int cvType = CV_16UC1;
+	static const int gradientCvType = CV_32FC1;
+
+	static float Range()
+	{
+		return 65535.0f;
+	}
+
+	static unsigned short Blurred(Sum sum)
+	{
+		return (unsigned short)std::min(65535.0f, std::max(0.0f, sum + 0.5f));
+	}
+
+	static Gradient Magnitude(double magnitude)
+	{
+		return (Gradient)magnitude;
+	}
+};
+
+template <>
+struct PixelTraits<float>
+{
+	typedef float Sum;
+	typedef float Gradient;
+	static const int cvType = CV_32FC1;
+	static const int gradientCvType = CV_32FC1;
+
+	static float Range()
+	{
+		return 1.0f;
+	}
+
+	static float Blurred(Sum sum)
+	{
+		return sum;
+	}
+
+	static Gradient Magnitude(double magnitude)
+	{
+		return (Gradient)magnitude;
+	}
+};
+
+const float gaussian_kernel[5][5] = {
+	{ 0.00224214f, 0.0165673f, 0.0165673f, 0.0165673f, 0.00224214f },
+	{ 0.0165673f, 0.0450347f, 0.122417f, 0.0450347f, 0.0165673f },
+	{ 0.0165673f, 0.122417f, 0.122417f, 0.122417f, 0.0165673f },
+	{ 0.0165673f, 0.0450347f, 0.122417f, 0.0450347f, 0.0165673f },
+	{ 0.00224214f, 0.0165673f, 0.0165673f, 0.0165673f, 0.00224214f }
+};
+
+const int sobel_gx_kernel[3][3] = {
+	{ -1, 0, 1 },
+	{ -2, 0, 2 },
+	{ -1, 0, 1 }
+};
+
+const int sobel_gy_kernel[3][3] = {
+	{ -1,-2,-1 },
+	{ 0, 0, 0 },
+	{ 1, 2, 1 }
+};
+
+const int move_dir[2][8] = {
+	{ -1, -1, -1, 0, 0, 1, 1, 1 },
+	{ -1, 0, 1, -1, 1, -1, 0, 1 }
+};
+
+// luma as in cv::cvtColor(COLOR_BGR2GRAY), 14 bit fixed point
+inline unsigned char BGRLuma(const unsigned char *bgr)
+{
+	return (unsigned char)((bgr[0] * 1868 + bgr[1] * 9617 + bgr[2] * 4899 + 8192) >> 14);
+}
+
+// gradient direction rounded to 0, 45, 90 or 135 degrees
+inline unsigned char QuantizeAngle(float sumx, float sumy)
+{
+	const float MPI = 3.14159265f;
+
+	// get direction
+	float angle = atan2(sumy, sumx);
+
+	// if angle is negative, then shift by 2PI
+	if (angle < 0.0f)
+	{
+		angle = fmod((angle + 2 * MPI), (2 * MPI));
+	}
+
+	// round angles to 0, 45, 90 and 135 degs
+	// angles are equally likely to distribute between 
+	// 0~PI and PI~2PI
+	if (angle <= MPI)
+	{
+		if (angle <= MPI / 8)
+		{
+			return 0;
+		}
+		else if (angle <= 3 * MPI / 8)
+		{
+			return 45;
+		}
+		else if (angle <= 5 * MPI / 8)
+		{
+			return 90;
+		}
+		else if (angle <= 7 * MPI / 8)
+		{
+			return 135;
+		}
+		else
+		{
+			return 0;
+		}
+	}
+	else
+	{
+		if (angle <= 9 * MPI / 8)
+		{
+			return 0;
+		}
+		else if (angle <= 11 * MPI / 8)
+		{
+			return 45;
+		}
+		else if (angle <= 13 * MPI / 8)
+		{
+			return 90;
+		}
+		else if (angle <= 15 * MPI / 8)
+		{
+			return 135;
+		}
+		else
+		{
+			return 0;
+		}
+	}
+}
+
+// the same on whole gradients, exactly: tan(PI / 8) = sqrt(2) - 1 and
+// tan(3 PI / 8) = sqrt(2) + 1 compared in integers; QuantizeAngle can
+// round across a boundary (e.g. at -408, -985)
+inline unsigned char QuantizeGradient(int gx, int gy)
+{
+	int ax = std::abs(gx);
+	int ay = std::abs(gy);
+
+	if ((ax + ay) * (ax + ay) <= 2 * ax * ax)
+	{
+		return 0;
+	}
+	if (ay > ax && (ay - ax) * (ay - ax) > 2 * ax * ax)
+	{
+		return 90;
+	}
+	return (gx ^ gy) >= 0 ? 45 : 135;
+}
+
+// Direction of a Sobel sum as SobelRows stores it. 8 bit pixels give
+// whole gradients, which take the exact test as in CPUCanny and canny.cl;
+// 16 bit and float gradients are not whole and keep QuantizeAngle, as
+// canny_typed.cl does.
+template <typename Pixel>
+inline unsigned char SobelDirection(float sumx, float sumy)
+{
+	return QuantizeAngle(sumx, sumy);
+}
+
+template <>
+inline unsigned char SobelDirection<unsigned char>(float sumx, float sumy)
+{
+	return QuantizeGradient((int)sumx, (int)sumy);
+}
+
+// Orientation histograms of the Sobel stage, as in canny.cl: unsigned
+// orientation (0 ~ PI) in equal bins, weighted by the magnitude in
+// 1/HISTOGRAM_SCALE fixed point, since the device has no float atomics
+const float HISTOGRAM_SCALE = 16.0f;
+
+inline unsigned int HistogramBin(float sumx, float sumy, int bins)
+{
+	const float MPI = 3.14159265f;
+
+	float angle = atan2f(sumy, sumx);
+	if (angle < 0.0f)
+	{
+		angle += MPI;
+	}
+	return std::min((unsigned int)(angle * bins / MPI), (unsigned int)bins - 1);
+}
+
+inline unsigned int HistogramWeight(float sumx, float sumy)
+{
+	return (unsigned int)(hypotf(sumx, sumy) * HISTOGRAM_SCALE + 0.5f);
+}
+
+// stage loops over output rows [rowBegin, rowEnd) of a full frame,
+// rows and columns too close to the border are skipped
+template <typename Pixel>
+void GaussianRows(const Pixel *in, Pixel *out, int rows, int cols, int rowBegin, int rowEnd)
+{
+	// image
+	for (int row = std::max(3, rowBegin); row < std::min(rows - 3, rowEnd); row++)
+	{
+		for (int col = 3; col < cols - 3; col++)
+		{
+			int pos = row * cols + col;
+			typename PixelTraits<Pixel>::Sum sum = 0;
+
+			// kernel
+			for (int i = 0; i < 5; i++)
+			{
+				for (int j = 0; j < 5; j++)
+				{
+					int idx = (i + row - 1)*cols + (j + col - 1);
+					sum += gaussian_kernel[i][j] * in[idx];
+				}
+			}
+
+			out[pos] = PixelTraits<Pixel>::Blurred(sum);
+		}
+	}
+}
+
+template <typename Pixel>
+void SobelRows(const Pixel *in, typename PixelTraits<Pixel>::Gradient *magnitude, unsigned char *theta, int rows, int cols, int rowBegin, int rowEnd)
+{
+	// image
+	for (int row = std::max(1, rowBegin); row < std::min(rows - 1, rowEnd); row++)
+	{
+		for (int col = 1; col < cols - 1; col++)
+		{
+			float sumx = 0, sumy = 0;
+			int pos = row * cols + col;
+
+			// kernel
+			for (int i = 0; i < 3; i++)
+			{
+				for (int j = 0; j < 3; j++)
+				{
+					int idx = (i + row - 1)*cols + (j + col - 1);
+					sumx += sobel_gx_kernel[i][j] * in[idx];
+					sumy += sobel_gy_kernel[i][j] * in[idx];
+				}
+			}
+
+			magnitude[pos] = PixelTraits<Pixel>::Magnitude(hypot(sumx, sumy));
+			theta[pos] = SobelDirection<Pixel>(sumx, sumy);
+		}
+	}
+}
+
+// the magnitude at *magnitude, or 0 if a neighbour along the gradient
+// direction is larger; stride is the distance between rows
+template <typename Gradient>
+inline Gradient NonMaximum(const Gradient *magnitude, ptrdiff_t stride, unsigned char direction)
+{
+	ptrdiff_t offset;
+
+	switch (direction)
+	{
+		case 0:
+		{
+			offset = 1;
+			break;
+		}
+		case 45:
+		{
+			offset = 1 - stride;
+			break;
+		}
+		case 90:
+		{
+			offset = stride;
+			break;
+		}
+		case 135:
+		{
+			offset = stride + 1;
+			break;
+		}
+		default:
+		{
+			return magnitude[0];
+		}
+	}
+
+	// supress current pixel if neighbour has larger magnitude
+	if (magnitude[0] < magnitude[offset] || magnitude[0] < magnitude[-offset])
+	{
+		return 0;
+	}
+	return magnitude[0];
+}
+
+template <typename Gradient>
+void NonMaximaRows(const Gradient *magnitude, const unsigned char *theta, Gradient *out, int rows, int cols, int rowBegin, int rowEnd)
+{
+	for (int row = std::max(1, rowBegin); row < std::min(rows - 1, rowEnd); row++)
+	{
+		for (int col = 1; col < cols - 1; col++)
+		{
+			const int pos = row * cols + col;
+			out[pos] = NonMaximum(magnitude + pos, cols, theta[pos]);
+		}
+	}
+}
+
+// mark everything connected to (row, col) with magnitude >= tLow
+template <typename Gradient>
+void traceStack(const Gradient *in, unsigned char *out, int row, int col, int rows, int cols, float tLow, std::vector<int> *marked = NULL)
+{
+	std::stack<std::tuple<int, int>> edges;
+
+	for (int i = 0; i < 8; i++)
+	{
+		int x = col + move_dir[0][i];
+		int y = row + move_dir[1][i];
+
+		if (x >= 0 && x < cols && y >= 0 && y < rows)
+		{
+			int pos = y * cols + x;
+
+			// adjacent pixels
+			if (in[pos] >= tLow && out[pos] != 255)
+			{
+				out[pos] = 255;
+				edges.push(std::make_tuple(x, y));
+
+				if (marked)
+				{
+					marked->push_back(pos);
+				}
+			}
+		}
+	}
+
+	while (!edges.empty())
+	{
+		std::tuple<int, int> pair = edges.top();
+		edges.pop();
+
+		for (int i = 0; i < 8; i++)
+		{
+			int x = std::get<0>(pair) + move_dir[0][i];
+			int y = std::get<1>(pair) + move_dir[1][i];
+
+			if (x >= 0 && x < cols && y >= 0 && y < rows)
+			{
+				int pos = y * cols + x;
+
+				// adjacent pixels
+				if (in[pos] >= tLow && out[pos] != 255)
+				{
+					out[pos] = 255;
+					edges.push(std::make_tuple(x, y));
+
+					if (marked)
+					{
+						marked->push_back(pos);
+					}
+				}
+			}
+		}
+	}
+}
+
+// hysteresis over rows [rowBegin, rowEnd) of a full frame, tracing stays inside the rows
+template <typename Gradient>
+void HysteresisRows(const Gradient *in, unsigned char *out, int rows, int cols, int rowBegin, int rowEnd, float tLow, float tHigh)
+{
+	// tracing only sees the rows of the band, so bands can run in parallel
+	const Gradient *bandIn = in + rowBegin * cols;
+	unsigned char *bandOut = out + rowBegin * cols;
+	int bandRows = rowEnd - rowBegin;
+
+	for (int row = std::max(1, rowBegin); row < std::min(rows - 1, rowEnd); row++)
+	{
+		for (int col = 1; col < cols - 1; col++)
+		{
+			const int pos = row * cols + col;
+			if (in[pos] > tHigh && out[pos] != 255)
+			{
+				out[pos] = 255;
+				traceStack(bandIn, bandOut, row - rowBegin, col, bandRows, cols, tLow);
+			}
+
+		}
+	}
+}
+
+// continue tracing edges across the boundary between rows seam - 1 and seam
+template <typename Gradient>
+void HysteresisSeam(const Gradient *in, unsigned char *out, int rows, int cols, int seam, float tLow)
+{
+	// an edge on either side of the seam may continue into the other band
+	for (int row = std::max(0, seam - 1); row < std::min(rows, seam + 1); row++)
+	{
+		for (int col = 0; col < cols; col++)
+		{
+			if (out[row * cols + col] == 255)
+			{
+				traceStack(in, out, row, col, rows, cols, tLow);
+			}
+		}
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+// one edge pixel of a sparse edge list
+struct EdgePoint
+{
+	int x;
+	int y;
+
+	// only filled in when attributes are requested
+	unsigned char magnitude;	// non-maxima suppressed gradient magnitude
+	unsigned char direction;	// quantized gradient direction: 0, 45, 90 or 135
+};
+
+// one ordered polyline of connected edge pixels
+struct EdgeChain
+{
+	int offset;		// first point in EdgeChains::points
+	int length;
+	bool closed;	// last point touches the first one
+};
+
+// all chains of a frame, the points of every chain are stored back to
+// back in a single arena instead of one vector per chain
+struct EdgeChains
+{
+	std::vector<cv::Point> points;
+	std::vector<EdgeChain> chains;
+
+	void clear()
+	{
+		points.clear();
+		chains.clear();
+	}
+
+	const cv::Point &front(size_t chain) const
+	{
+		return points[chains[chain].offset];
+	}
+
+	const cv::Point &back(size_t chain) const
+	{
+		return points[chains[chain].offset + chains[chain].length - 1];
+	}
+};
+
+// a line in normal form: x cos(theta) + y sin(theta) = rho
+struct HoughLine
+{
+	float rho;		// pixels, may be negative
+	float theta;	// radians in [0, PI)
+	int votes;
+};
+
+// the last stage of the current frame that is up to date; every stage
+// before it is too, so Evaluate only runs the ones after it
+enum class CannyStage
+{
+	None,			// no frame loaded
+	Input,
+	Gaussian,
+	Sobel,
+	NonMaxima,
+	Hysteresis
+};
+
+// one (low, high) pair of a hysteresis sweep
+struct HysteresisThresholds
+{
+	int low;
+	int high;
+};
+
+// the suppressed magnitude is 8 bit, a threshold outside 0..255 acts as
+// the nearest end; the kernels take them as uchar
+inline int ClampThreshold(int threshold)
+{
+	return threshold < 0 ? 0 : threshold > 255 ? 255 : threshold;
+}
@@ -0,0 +1,291 @@
+#include "EdgeClient.h"
+#include <iostream>
+#include <cstring>
+#include <atomic>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+using std::string;
+using std::cerr;
+using std::endl;
+using cv::Mat;
+using EdgeProtocol::Request;
+using EdgeProtocol::Reply;
+
+
+EdgeClient::EdgeClient()
+{
+	memset(&lastReply, 0, sizeof(lastReply));
+}
+
+EdgeClient::~EdgeClient()
+{
+	Close();
+}
+
+bool EdgeClient::Connect(const string &socketPath)
+{
+	Close();
+
+#ifdef _WIN32
+	cerr << "Error: the edge client needs POSIX sockets and shared memory" << endl;
+	return false;
+#else
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if (socketPath.size() >= sizeof(address.sun_path))
+	{
+		cerr << "Error: socket path " << socketPath << " is too long" << endl;
+		return false;
+	}
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+	socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socket < 0 || connect(socket, (sockaddr *)&address, sizeof(address)) != 0)
+	{
+		cerr << "Error: no edge server on " << socketPath << endl;
+		Close();
+		return false;
+	}
+
+	return true;
+#endif
+}
+
+void EdgeClient::Close()
+{
+#ifndef _WIN32
+	if (socket >= 0)
+	{
+		close(socket);
+		socket = -1;
+	}
+#endif
+
+	ReleaseSegment();
+}
+
+bool EdgeClient::CreateSegment(size_t size)
+{
+	ReleaseSegment();
+
+#ifdef _WIN32
+	return false;
+#else
+	// a grown frame gets a new segment, so the server never sees one
+	// change size under its mapping
+#ifdef MFD_ALLOW_SEALING
+	// sealed below, the server only maps segments that cannot shrink
+	string segment = "memfd";
+	int descriptor = memfd_create("canny-edge", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+	// unique per process and client
+	static std::atomic<unsigned int> counter(0);
+	string segment = "/canny-" + std::to_string((long long)getpid()) + "-" + std::to_string(counter++);
+
+	int descriptor = shm_open(segment.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (descriptor >= 0)
+	{
+		// only the descriptor reaches the server, the name can go right away
+		shm_unlink(segment.c_str());
+	}
+#endif
+
+	if (descriptor < 0)
+	{
+		cerr << "Error: unable to create shared memory " << segment << endl;
+		return false;
+	}
+
+	bool sized = ftruncate(descriptor, (off_t)size) == 0;
+#ifdef MFD_ALLOW_SEALING
+	sized = sized && fcntl(descriptor, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0;
+#endif
+
+	void *mapping = MAP_FAILED;
+	if (sized)
+	{
+		mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+	}
+
+	if (mapping == MAP_FAILED)
+	{
+		cerr << "Error: unable to map shared memory " << segment << endl;
+		close(descriptor);
+		return false;
+	}
+
+	segmentDescriptor = descriptor;
+	base = (unsigned char *)mapping;
+	segmentSize = size;
+	return true;
+#endif
+}
+
+void EdgeClient::ReleaseSegment()
+{
+#ifndef _WIN32
+	// the server's mapping, if any, stays valid until it drops it
+	if (base != NULL)
+	{
+		munmap(base, segmentSize);
+		base = NULL;
+	}
+
+	if (segmentDescriptor >= 0)
+	{
+		close(segmentDescriptor);
+		segmentDescriptor = -1;
+	}
+#endif
+
+	segmentSize = 0;
+	rows = 0;
+	cols = 0;
+	type = 0;
+}
+
+Mat EdgeClient::getInputFrame(int rows, int cols, int type)
+{
+	if (type != CV_8UC1 && type != CV_8UC3)
+	{
+		cerr << "Error: the edge server takes grey or BGR frames only" << endl;
+		return Mat();
+	}
+
+	if (rows != this->rows || cols != this->cols || type != this->type)
+	{
+		// input first, the edge map on the next cache line
+		size_t inputSize = (size_t)rows * cols * (type == CV_8UC3 ? 3 : 1);
+		size_t offset = (inputSize + 63) / 64 * 64;
+		size_t size = offset + (size_t)rows * cols;
+
+		if (size > segmentSize && !CreateSegment(size))
+		{
+			return Mat();
+		}
+
+		this->rows = rows;
+		this->cols = cols;
+		this->type = type;
+		outputOffset = offset;
+	}
+
+	return Mat(rows, cols, type, base);
+}
+
+bool EdgeClient::Detect(Mat &edges)
+{
+#ifdef _WIN32
+	return false;
+#else
+	if (socket < 0 || base == NULL)
+	{
+		cerr << "Error: connect and fill getInputFrame before Detect" << endl;
+		return false;
+	}
+
+	Request request;
+	memset(&request, 0, sizeof(request));
+	request.magic = EdgeProtocol::MAGIC;
+	request.sequence = ++sequence;
+	request.inputOffset = 0;
+	request.outputOffset = outputOffset;
+	request.rows = rows;
+	request.cols = cols;
+	request.type = type;
+
+	iovec data;
+	data.iov_base = &request;
+	data.iov_len = sizeof(request);
+
+	msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+
+	// a new segment goes along with the request that first uses it
+	union
+	{
+		cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int))];
+	} control;
+	if (segmentDescriptor >= 0)
+	{
+		memset(&control, 0, sizeof(control));
+		message.msg_control = control.space;
+		message.msg_controllen = sizeof(control.space);
+
+		cmsghdr *rights = CMSG_FIRSTHDR(&message);
+		rights->cmsg_level = SOL_SOCKET;
+		rights->cmsg_type = SCM_RIGHTS;
+		rights->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(rights), &segmentDescriptor, sizeof(int));
+	}
+
+	if (sendmsg(socket, &message, MSG_NOSIGNAL) != (ssize_t)sizeof(request))
+	{
+		cerr << "Error: lost the edge server" << endl;
+		Close();
+		return false;
+	}
+
+	// the server holds the segment now
+	if (segmentDescriptor >= 0)
+	{
+		close(segmentDescriptor);
+		segmentDescriptor = -1;
+	}
+
+	if (recv(socket, &lastReply, sizeof(lastReply), MSG_WAITALL) != (ssize_t)sizeof(lastReply))
+	{
+		cerr << "Error: lost the edge server" << endl;
+		Close();
+		return false;
+	}
+
+	if (lastReply.status != EdgeProtocol::Ok || lastReply.sequence != request.sequence)
+	{
+		cerr << "Error: edge server rejected the frame, status " << lastReply.status << endl;
+		return false;
+	}
+
+	edges = Mat(rows, cols, CV_8UC1, base + outputOffset);
+	return true;
+#endif
+}
+
+bool EdgeClient::Process(const Mat &input, Mat &edges)
+{
+	Mat frame = getInputFrame(input.rows, input.cols, input.type());
+	if (frame.empty())
+	{
+		return false;
+	}
+
+	input.copyTo(frame);
+	return Detect(edges);
+}
+
+double EdgeClient::getServiceMicroSec() const
+{
+	return lastReply.serviceMicroSec;
+}
+
+unsigned int EdgeClient::getPassSize() const
+{
+	return lastReply.passSize;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <string>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "EdgeProtocol.h"
+
+// Client side of EdgeServer. The frame is written straight into a
+// shared memory segment the server maps too, and the edge map comes
+// back in the same segment, so neither image is copied on the way:
+//
+//   EdgeClient client;
+//   client.Connect();
+//   cv::Mat frame = client.getInputFrame(rows, cols);
+//   ... decode or render into frame ...
+//   cv::Mat edges;
+//   client.Detect(edges);
+//
+// One request is outstanding at a time; use a client per thread. POSIX only.
+class EdgeClient
+{
+private:
+	int socket = -1;
+
+	// the segment has no name (a sealed memfd on Linux, elsewhere it is
+	// unlinked as soon as it is created); its descriptor is kept until
+	// the next request hands it to the server
+	int segmentDescriptor = -1;
+	unsigned char *base = NULL;
+	size_t segmentSize = 0;
+
+	// layout of the current frame in the segment
+	int rows = 0;
+	int cols = 0;
+	int type = 0;
+	size_t outputOffset = 0;
+
+	uint32_t sequence = 0;
+	EdgeProtocol::Reply lastReply;
+
+	bool CreateSegment(size_t size);
+	void ReleaseSegment();
+
+public:
+	EdgeClient();
+	~EdgeClient();
+
+	EdgeClient(const EdgeClient &) = delete;
+	EdgeClient &operator=(const EdgeClient &) = delete;
+
+	bool Connect(const std::string &socketPath = EdgeProtocol::DEFAULT_SOCKET);
+	void Close();
+
+	bool isConnected() const
+	{
+		return socket >= 0;
+	}
+
+	// CV_8UC1 or CV_8UC3 frame in shared memory to fill before Detect;
+	// stays valid until a frame of another size or type is requested
+	cv::Mat getInputFrame(int rows, int cols, int type = CV_8UC1);
+
+	// edges of the frame from getInputFrame, a header into shared memory
+	// that the next Detect overwrites
+	bool Detect(cv::Mat &edges);
+
+	// copy input into the shared frame first, for images that already
+	// live somewhere else
+	bool Process(const cv::Mat &input, cv::Mat &edges);
+
+	// engine time and pass size the server reported for the last frame
+	double getServiceMicroSec() const;
+	unsigned int getPassSize() const;
+};
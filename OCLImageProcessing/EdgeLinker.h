@@ -0,0 +1,219 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "CannyTypes.h"
+
+// neighbour offsets, 4-connected first so chains prefer straight steps;
+// bit i of an edge neighbour mask refers to entry i (same order in canny.cl)
+const int link_dir[2][8] = {
+	{ 1, 0, -1, 0, 1, -1, -1, 1 },
+	{ 0, -1, 0, 1, -1, -1, 1, 1 }
+};
+
+// Walks the pixels of connected edges into ordered chains. The graph
+// supplies the nodes to link, their coordinates and edge neighbours,
+// and keeps the linked flags:
+//   const std::vector<int> &nodes() const;
+//   cv::Point point(int node) const;
+//   int neighbours(int node, int adjacent[8]) const;
+//   bool linked(int node) const;
+//   void link(int node);
+// Chains start at endpoints (at most one neighbour) first, whatever is
+// left afterwards is a loop or a junction remainder.
+template <typename Graph>
+void LinkEdges(Graph &graph, EdgeChains &chains)
+{
+	const std::vector<int> &nodes = graph.nodes();
+	int adjacent[8];
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			int node = nodes[i];
+
+			if (graph.linked(node))
+			{
+				continue;
+			}
+
+			if (pass == 0 && graph.neighbours(node, adjacent) > 1)
+			{
+				continue;
+			}
+
+			EdgeChain chain;
+			chain.offset = (int)chains.points.size();
+			chain.length = 0;
+			chain.closed = false;
+
+			// follow the first unlinked neighbour until there is none
+			while (node >= 0)
+			{
+				graph.link(node);
+				chains.points.push_back(graph.point(node));
+				chain.length++;
+
+				int count = graph.neighbours(node, adjacent);
+				node = -1;
+
+				for (int n = 0; n < count; n++)
+				{
+					if (!graph.linked(adjacent[n]))
+					{
+						node = adjacent[n];
+						break;
+					}
+				}
+			}
+
+			if (pass == 1 && chain.length > 2)
+			{
+				const cv::Point &first = chains.points[chain.offset];
+				const cv::Point &last = chains.points[chain.offset + chain.length - 1];
+				chain.closed = abs(first.x - last.x) <= 1 && abs(first.y - last.y) <= 1;
+			}
+
+			chains.chains.push_back(chain);
+		}
+	}
+}
+
+// Edge pixels of one connected component in a 0/255 edge map. Linked
+// pixels are tagged in the map itself and restored by the destructor.
+class ImageEdgeGraph
+{
+private:
+	unsigned char *edges;
+	int rows;
+	int cols;
+	const std::vector<int> &component;
+
+	static const unsigned char EDGE = 255;
+	static const unsigned char LINKED = 254;
+
+public:
+	ImageEdgeGraph(unsigned char *edges, int rows, int cols, const std::vector<int> &component)
+		: edges(edges), rows(rows), cols(cols), component(component)
+	{
+	}
+
+	~ImageEdgeGraph()
+	{
+		for (size_t i = 0; i < component.size(); i++)
+		{
+			edges[component[i]] = EDGE;
+		}
+	}
+
+	const std::vector<int> &nodes() const
+	{
+		return component;
+	}
+
+	cv::Point point(int pos) const
+	{
+		return cv::Point(pos % cols, pos / cols);
+	}
+
+	int neighbours(int pos, int adjacent[8]) const
+	{
+		int row = pos / cols;
+		int col = pos % cols;
+		int count = 0;
+
+		for (int i = 0; i < 8; i++)
+		{
+			int x = col + link_dir[0][i];
+			int y = row + link_dir[1][i];
+
+			if (x >= 0 && x < cols && y >= 0 && y < rows && edges[y * cols + x] >= LINKED)
+			{
+				adjacent[count++] = y * cols + x;
+			}
+		}
+		return count;
+	}
+
+	bool linked(int pos) const
+	{
+		return edges[pos] == LINKED;
+	}
+
+	void link(int pos)
+	{
+		edges[pos] = LINKED;
+	}
+};
+
+// Compacted edge list with one neighbour mask per edge, as produced on
+// the device. Neighbours are found by coordinate lookup, the full edge
+// map is never needed on the host.
+class ListEdgeGraph
+{
+private:
+	const std::vector<cv::Point> &coords;
+	const std::vector<unsigned char> &masks;
+	int cols;
+
+	std::vector<int> indices;
+	std::vector<bool> linkedFlags;
+	std::unordered_map<int, int> lookup;
+
+public:
+	ListEdgeGraph(const std::vector<cv::Point> &coords, const std::vector<unsigned char> &masks, int cols)
+		: coords(coords), masks(masks), cols(cols), indices(coords.size()), linkedFlags(coords.size(), false)
+	{
+		lookup.reserve(coords.size());
+		for (size_t i = 0; i < coords.size(); i++)
+		{
+			indices[i] = (int)i;
+			lookup[coords[i].y * cols + coords[i].x] = (int)i;
+		}
+	}
+
+	const std::vector<int> &nodes() const
+	{
+		return indices;
+	}
+
+	cv::Point point(int node) const
+	{
+		return coords[node];
+	}
+
+	int neighbours(int node, int adjacent[8]) const
+	{
+		int count = 0;
+
+		for (int i = 0; i < 8; i++)
+		{
+			if (!(masks[node] & (1 << i)))
+			{
+				continue;
+			}
+
+			int x = coords[node].x + link_dir[0][i];
+			int y = coords[node].y + link_dir[1][i];
+
+			std::unordered_map<int, int>::const_iterator found = lookup.find(y * cols + x);
+			if (found != lookup.end())
+			{
+				adjacent[count++] = found->second;
+			}
+		}
+		return count;
+	}
+
+	bool linked(int node) const
+	{
+		return linkedFlags[node];
+	}
+
+	void link(int node)
+	{
+		linkedFlags[node] = true;
+	}
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+
+// Messages between EdgeServer and EdgeClient over a Unix domain socket.
+// Pixels never go through the socket: every client owns a shared memory
+// segment with its input frame and its edge map, a request only
+// says where both images are in it. The server writes the edges straight
+// into the segment and replies once they are there.
+//
+// The segment is never named to the server. Its descriptor rides along
+// as SCM_RIGHTS with the first request after the client created it, so
+// the server can only map memory the client could open itself. On Linux
+// it is a memfd sealed with F_SEAL_SHRINK, the server refuses others.
+namespace EdgeProtocol
+{
+	const uint32_t MAGIC = 0x43414e59;
+
+	const char *const DEFAULT_SOCKET = "/tmp/canny_edge.sock";
+
+	enum Status
+	{
+		Ok = 0,
+		BadRequest,		// wrong magic, size or type
+		NoSegment,		// no segment was passed, or it is unsealed, cannot be mapped or is too small
+		NoEngine,		// the server has no engine for its backend
+		EngineFailed	// the engine did not produce an edge map for the frame
+	};
+
+	struct Request
+	{
+		uint32_t magic;
+		uint32_t sequence;
+
+		uint64_t inputOffset;
+		uint64_t outputOffset;
+		int32_t rows;
+		int32_t cols;
+
+		// CV_8UC1 or CV_8UC3 (BGR)
+		int32_t type;
+		int32_t reserved;
+	};
+
+	struct Reply
+	{
+		uint32_t sequence;
+		int32_t status;
+
+		// requests that were ready in the same poll pass, including this
+		// one; the server works through them one at a time
+		uint32_t passSize;
+		uint32_t reserved;
+
+		// engine time of this frame
+		double serviceMicroSec;
+	};
+}
@@ -0,0 +1,501 @@
+#include "EdgeServer.h"
+#include "Timer.h"
+#include "Trace.h"
+#include "OCLCanny.h"
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+using cv::Mat;
+using EdgeProtocol::Request;
+using EdgeProtocol::Reply;
+
+
+EdgeServer::EdgeServer(const string &backend, const string &socketPath)
+	: socketPath(socketPath), stopping(false), served(0), passes(0), largestPass(0)
+{
+	engine = CreateCannyEngine(backend);
+	if (!engine)
+	{
+		cerr << "Error: unknown backend " << backend << endl;
+		return;
+	}
+
+	// a device whose kernels did not build would answer Ok with edge maps
+	// it never computed
+	OCLCanny *ocl = dynamic_cast<OCLCanny *>(engine.get());
+	if (ocl != NULL && !ocl->isInitialized())
+	{
+		cerr << "Error: OpenCL did not initialize on " << ocl->getDeviceName() << ", serving on the CPU" << endl;
+		engine = CreateCannyEngine("cpu");
+	}
+}
+
+EdgeServer::~EdgeServer()
+{
+#ifndef _WIN32
+	for (size_t i = 0; i < clients.size(); i++)
+	{
+		CloseClient(clients[i]);
+	}
+
+	if (listenSocket >= 0)
+	{
+		close(listenSocket);
+		unlink(socketPath.c_str());
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		if (wakePipe[i] >= 0)
+		{
+			close(wakePipe[i]);
+		}
+	}
+#endif
+}
+
+bool EdgeServer::Start()
+{
+#ifdef _WIN32
+	cerr << "Error: the edge server needs POSIX sockets and shared memory" << endl;
+	return false;
+#else
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if (socketPath.size() >= sizeof(address.sun_path))
+	{
+		cerr << "Error: socket path " << socketPath << " is too long" << endl;
+		return false;
+	}
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+	if (pipe(wakePipe) != 0)
+	{
+		cerr << "Error: unable to create the wake pipe" << endl;
+		return false;
+	}
+
+	listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenSocket < 0)
+	{
+		cerr << "Error: unable to create a socket" << endl;
+		return false;
+	}
+
+	// a previous server that did not shut down leaves its file behind
+	unlink(socketPath.c_str());
+
+	// other users must not reach the engine; nobody can connect before
+	// listen, so there is no window between bind and chmod
+	if (bind(listenSocket, (sockaddr *)&address, sizeof(address)) != 0 ||
+		chmod(socketPath.c_str(), 0600) != 0 || listen(listenSocket, 16) != 0)
+	{
+		cerr << "Error: unable to listen on " << socketPath << endl;
+		close(listenSocket);
+		listenSocket = -1;
+		return false;
+	}
+
+	// Accept takes connections until none are left
+	fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL) | O_NONBLOCK);
+	return true;
+#endif
+}
+
+void EdgeServer::Stop()
+{
+	stopping = true;
+
+#ifndef _WIN32
+	if (wakePipe[1] >= 0)
+	{
+		char wake = 0;
+		ssize_t written = write(wakePipe[1], &wake, 1);
+		(void)written;
+	}
+#endif
+}
+
+void EdgeServer::Run()
+{
+#ifndef _WIN32
+	if (listenSocket < 0)
+	{
+		cerr << "Error: edge server not started" << endl;
+		return;
+	}
+
+	vector<pollfd> descriptors;
+	vector<size_t> ready;
+
+	while (!stopping)
+	{
+		// wake pipe, listening socket, then one entry per client; a client
+		// with a reply still to send is not read until it takes it
+		descriptors.clear();
+		descriptors.push_back({ wakePipe[0], POLLIN, 0 });
+		descriptors.push_back({ listenSocket, POLLIN, 0 });
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+			short events = clients[i].replyBytes > 0 ? POLLOUT : POLLIN;
+			descriptors.push_back({ clients[i].socket, events, 0 });
+		}
+
+		// a signal ends the poll early, stopping tells whether to go on
+		if (poll(descriptors.data(), descriptors.size(), -1) < 0)
+		{
+			continue;
+		}
+
+		if (descriptors[0].revents)
+		{
+			break;
+		}
+
+		// read what each client has sent, whole requests are ready
+		ready.clear();
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+			Client &client = clients[i];
+			short events = descriptors[i + 2].revents;
+			if (!events)
+			{
+				continue;
+			}
+
+			if (client.replyBytes > 0)
+			{
+				SendReply(client);
+			}
+			else if (ReadRequest(client))
+			{
+				ready.push_back(i);
+			}
+		}
+
+		{
+			TRACE_ZONE("Edge server pass");
+
+			// one engine, so the ready requests are served one at a time
+			for (size_t i = 0; i < ready.size(); i++)
+			{
+				Client &client = clients[ready[i]];
+				if (client.descriptor >= 0)
+				{
+					MapSegment(client, client.descriptor);
+					client.descriptor = -1;
+				}
+
+				Reply reply = Serve(client, client.request);
+				reply.passSize = (uint32_t)ready.size();
+
+				// reply right away, the client does not wait for the rest
+				memcpy(client.reply, &reply, sizeof(reply));
+				client.replyBytes = sizeof(reply);
+				SendReply(client);
+			}
+		}
+
+		if (!ready.empty())
+		{
+			served += ready.size();
+			passes++;
+			if (ready.size() > largestPass)
+			{
+				largestPass = ready.size();
+			}
+		}
+
+		clients.erase(std::remove_if(clients.begin(), clients.end(),
+			[](const Client &client) { return client.socket < 0; }), clients.end());
+
+		// new clients join the next pass
+		if (descriptors[1].revents & POLLIN)
+		{
+			Accept();
+		}
+	}
+#endif
+}
+
+void EdgeServer::Accept()
+{
+#ifndef _WIN32
+	while (true)
+	{
+		Client client;
+		client.socket = accept(listenSocket, NULL, NULL);
+		if (client.socket < 0)
+		{
+			return;
+		}
+
+		// a slow client must not hold up the loop
+		fcntl(client.socket, F_SETFL, fcntl(client.socket, F_GETFL) | O_NONBLOCK);
+		clients.push_back(client);
+	}
+#endif
+}
+
+bool EdgeServer::ReadRequest(Client &client)
+{
+#ifdef _WIN32
+	return false;
+#else
+	iovec data;
+	data.iov_base = (char *)&client.request + client.requestBytes;
+	data.iov_len = sizeof(Request) - client.requestBytes;
+
+	union
+	{
+		cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control.space;
+	message.msg_controllen = sizeof(control.space);
+
+	ssize_t received = recvmsg(client.socket, &message, MSG_DONTWAIT);
+
+	// a segment descriptor arrives with the first byte of its request;
+	// anything but a single descriptor is dropped
+	for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+	{
+		if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+		{
+			continue;
+		}
+
+		size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < count; i++)
+		{
+			int passed;
+			memcpy(&passed, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+			if (count == 1)
+			{
+				if (client.descriptor >= 0)
+				{
+					close(client.descriptor);
+				}
+				client.descriptor = passed;
+			}
+			else
+			{
+				close(passed);
+			}
+		}
+	}
+
+	if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	{
+		return false;
+	}
+	if (received <= 0)
+	{
+		// disconnected
+		CloseClient(client);
+		return false;
+	}
+
+	client.requestBytes += (size_t)received;
+	if (client.requestBytes < sizeof(Request))
+	{
+		return false;
+	}
+
+	client.requestBytes = 0;
+	return true;
+#endif
+}
+
+void EdgeServer::SendReply(Client &client)
+{
+#ifndef _WIN32
+	ssize_t sent = send(client.socket, client.reply + sizeof(Reply) - client.replyBytes, client.replyBytes, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	{
+		// the rest goes once poll says the socket takes more
+		return;
+	}
+	if (sent <= 0)
+	{
+		CloseClient(client);
+		return;
+	}
+
+	client.replyBytes -= (size_t)sent;
+#endif
+}
+
+bool EdgeServer::MapSegment(Client &client, int descriptor)
+{
+#ifdef _WIN32
+	return false;
+#else
+	// a grown frame comes in a new segment, drop the old mapping
+	if (client.base != NULL)
+	{
+		munmap(client.base, client.mappedSize);
+		client.base = NULL;
+		client.mappedSize = 0;
+	}
+
+	// a client that truncated its segment later would fault the server
+	// with SIGBUS on its next frame, so it has to be sealed against that.
+	// Elsewhere there are no seals; the socket is private to the user, so
+	// a client could only bring down a server of its own.
+	bool sealed = true;
+#ifdef F_SEAL_SHRINK
+	int seals = fcntl(descriptor, F_GET_SEALS);
+	sealed = seals >= 0 && (seals & F_SEAL_SHRINK) != 0;
+#endif
+
+	struct stat info;
+	void *mapping = MAP_FAILED;
+	if (sealed && fstat(descriptor, &info) == 0 && info.st_size > 0)
+	{
+		mapping = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+	}
+
+	// the mapping keeps the segment alive
+	close(descriptor);
+
+	if (mapping == MAP_FAILED)
+	{
+		return false;
+	}
+
+	client.base = (unsigned char *)mapping;
+	client.mappedSize = (size_t)info.st_size;
+	return true;
+#endif
+}
+
+void EdgeServer::CloseClient(Client &client)
+{
+#ifndef _WIN32
+	if (client.base != NULL)
+	{
+		munmap(client.base, client.mappedSize);
+		client.base = NULL;
+	}
+
+	if (client.descriptor >= 0)
+	{
+		close(client.descriptor);
+		client.descriptor = -1;
+	}
+
+	if (client.socket >= 0)
+	{
+		close(client.socket);
+		client.socket = -1;
+	}
+#endif
+}
+
+Reply EdgeServer::Serve(Client &client, const Request &request)
+{
+	Reply reply;
+	memset(&reply, 0, sizeof(reply));
+	reply.sequence = request.sequence;
+
+	if (!engine)
+	{
+		reply.status = EdgeProtocol::NoEngine;
+		return reply;
+	}
+
+	if (request.magic != EdgeProtocol::MAGIC || request.rows <= 0 || request.cols <= 0 ||
+		(request.type != CV_8UC1 && request.type != CV_8UC3))
+	{
+		reply.status = EdgeProtocol::BadRequest;
+		return reply;
+	}
+
+	// the segment came with this or an earlier request
+	if (client.base == NULL)
+	{
+		reply.status = EdgeProtocol::NoSegment;
+		return reply;
+	}
+
+	// both images must lie inside the segment
+	size_t pixels = (size_t)request.rows * request.cols;
+	size_t inputSize = pixels * (request.type == CV_8UC3 ? 3 : 1);
+	if (request.inputOffset > client.mappedSize || inputSize > client.mappedSize - request.inputOffset ||
+		request.outputOffset > client.mappedSize || pixels > client.mappedSize - request.outputOffset)
+	{
+		reply.status = EdgeProtocol::NoSegment;
+		return reply;
+	}
+
+	Mat input(request.rows, request.cols, request.type, client.base + request.inputOffset);
+	Mat edges(request.rows, request.cols, CV_8UC1, client.base + request.outputOffset);
+	unsigned char *target = edges.data;
+
+	Timer timer;
+	timer.start();
+	try
+	{
+		engine->Process(input, edges);
+	}
+	catch (const std::exception &e)
+	{
+		cerr << "Error: " << e.what() << endl;
+		edges.release();
+	}
+	timer.stop();
+
+	if (edges.rows != request.rows || edges.cols != request.cols || edges.type() != CV_8UC1)
+	{
+		reply.status = EdgeProtocol::EngineFailed;
+		return reply;
+	}
+
+	// engines fill a matching image in place, but do not rely on it
+	if (edges.data != target)
+	{
+		memcpy(target, edges.data, pixels);
+	}
+
+	reply.status = EdgeProtocol::Ok;
+	reply.serviceMicroSec = timer.getElapsedTimeInMicroSec();
+	return reply;
+}
+
+void EdgeServer::PrintStats(std::ostream &out) const
+{
+	size_t frames = served;
+	size_t pollPasses = passes;
+
+	// frames of a pass are served one after another, not batched
+	out << "Edge server (" << (engine ? engine->getName() : string("no engine")) << "): "
+		<< frames << " frames in " << pollPasses << " poll passes, avg "
+		<< (pollPasses ? (double)frames / pollPasses : 0.0) << " max " << largestPass << " ready per pass" << endl;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <iostream>
+
+#include "CannyEngine.h"
+#include "EdgeProtocol.h"
+
+// Resident edge detection service. Short lived processes that would each
+// discover platforms, create a context and build canny.cl share one warm
+// engine instead, talking to it through EdgeClient.
+//
+// A single thread polls the listening socket and every client. Sockets
+// are non-blocking and every client has its own partial request and
+// reply, so a client that sends or reads slowly holds up nobody else.
+// The requests complete in one pass are served one after another, then
+// the loop polls again; there is no batching inside the engine, which is
+// only ever used from that thread. Frames stay in the clients' shared
+// memory: the engine reads the input and writes the edge map in place.
+// The server maps only segments whose descriptor a client passed it, and
+// on Linux only sealed ones that cannot shrink under its mapping; its
+// socket is private to the user that started it. POSIX only.
+class EdgeServer
+{
+private:
+	struct Client
+	{
+		int socket = -1;
+
+		// the segment the client passed last, mapped when it arrives
+		unsigned char *base = NULL;
+		size_t mappedSize = 0;
+
+		// request read so far, and a segment that came with it
+		EdgeProtocol::Request request;
+		size_t requestBytes = 0;
+		int descriptor = -1;
+
+		// reply bytes not yet sent, the tail of reply
+		char reply[sizeof(EdgeProtocol::Reply)];
+		size_t replyBytes = 0;
+	};
+
+	std::unique_ptr<CannyEngine> engine;
+	std::string socketPath;
+	int listenSocket = -1;
+
+	// Stop writes to it to end a blocking poll
+	int wakePipe[2] = { -1, -1 };
+	std::atomic<bool> stopping;
+
+	std::vector<Client> clients;
+
+	// frames served, poll passes that served any, most ready in one pass
+	std::atomic<size_t> served;
+	std::atomic<size_t> passes;
+	std::atomic<size_t> largestPass;
+
+	void Accept();
+
+	// true once a whole request is in client.request
+	bool ReadRequest(Client &client);
+	void SendReply(Client &client);
+
+	// take over a segment descriptor from the client, closing it
+	bool MapSegment(Client &client, int descriptor);
+	void CloseClient(Client &client);
+	EdgeProtocol::Reply Serve(Client &client, const EdgeProtocol::Request &request);
+
+public:
+	// backend as for CreateCannyEngine, created once for the server's lifetime
+	EdgeServer(const std::string &backend = "ocl", const std::string &socketPath = EdgeProtocol::DEFAULT_SOCKET);
+	~EdgeServer();
+
+	EdgeServer(const EdgeServer &) = delete;
+	EdgeServer &operator=(const EdgeServer &) = delete;
+
+	// bind and listen, replacing a stale socket file; the socket is made
+	// accessible to the current user only
+	bool Start();
+
+	// serve until Stop
+	void Run();
+
+	// safe from any thread and from a signal handler
+	void Stop();
+
+	void PrintStats(std::ostream &out) const;
+};
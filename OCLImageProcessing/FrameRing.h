@@ -0,0 +1,228 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+
+// Lock-free single producer / single consumer ring of preallocated
+// frames for live capture, where a late frame is worth less than a
+// dropped one. The producer decodes straight into a slot and publishes
+// it, the consumer borrows the oldest published slot and hands it back;
+// pixels are never copied and, once the frame size settles, never
+// reallocated.
+//
+// The queue holds slot numbers, not frames. Besides the queued slots
+// the producer always owns the slot it writes into and the consumer the
+// one it reads, so both can work on their frame while the other side
+// moves on. Slots the consumer is done with come back through a second
+// ring. When the queue is full the producer either drops its own new
+// frame or takes the oldest queued slot back; the latter races with the
+// consumer for the same head position, which a compare-and-swap settles.
+class FrameRing
+{
+public:
+	enum class DropPolicy
+	{
+		DropOldest,		// keep the newest frames, lowest latency
+		DropNewest		// keep what is queued, drop incoming frames
+	};
+
+	struct Slot
+	{
+		cv::Mat frame;
+
+		// stamped when the producer starts writing the frame
+		std::chrono::steady_clock::time_point captured;
+		unsigned long long sequence = 0;
+	};
+
+private:
+	std::vector<Slot> slots;
+
+	// published slot numbers, [head, tail); the consumer may read an entry
+	// the producer is replacing, its compare-and-swap then fails
+	std::vector<std::atomic<int> > queue;
+	std::atomic<unsigned long long> head;
+	std::atomic<unsigned long long> tail;
+
+	// released slot numbers on their way back to the producer
+	std::vector<int> freeQueue;
+	std::atomic<unsigned long long> freeHead;
+	std::atomic<unsigned long long> freeTail;
+
+	DropPolicy policy;
+
+	// owned by the producer and the consumer side respectively, -1 for none
+	int writing = -1;
+	int reading = -1;
+
+	unsigned long long published = 0;
+
+	std::atomic<unsigned long long> dropped;
+	std::atomic<unsigned long long> consumed;
+	std::atomic<long long> latencySumMicroSec;
+	std::atomic<long long> latencyMaxMicroSec;
+
+	void PushFree(int slot)
+	{
+		unsigned long long position = freeTail.load(std::memory_order_relaxed);
+		freeQueue[position % freeQueue.size()] = slot;
+		freeTail.store(position + 1, std::memory_order_release);
+	}
+
+	int PopFree()
+	{
+		unsigned long long position = freeHead.load(std::memory_order_relaxed);
+		if (position == freeTail.load(std::memory_order_acquire))
+		{
+			return -1;
+		}
+
+		int slot = freeQueue[position % freeQueue.size()];
+		freeHead.store(position + 1, std::memory_order_release);
+		return slot;
+	}
+
+	// take the oldest queued slot, -1 if the queue is empty
+	int TakeHead()
+	{
+		unsigned long long position = head.load(std::memory_order_acquire);
+		while (position != tail.load(std::memory_order_acquire))
+		{
+			int slot = queue[position % queue.size()].load(std::memory_order_relaxed);
+			if (head.compare_exchange_weak(position, position + 1, std::memory_order_acq_rel))
+			{
+				return slot;
+			}
+		}
+		return -1;
+	}
+
+public:
+	// capacity frames can be queued, two more slots are in use by the
+	// producer and the consumer
+	FrameRing(size_t capacity, DropPolicy policy = DropPolicy::DropOldest)
+		: slots(std::max<size_t>(capacity, 1) + 2), queue(std::max<size_t>(capacity, 1)), head(0), tail(0),
+		freeQueue(slots.size()), freeHead(0), freeTail(0), policy(policy),
+		dropped(0), consumed(0), latencySumMicroSec(0), latencyMaxMicroSec(0)
+	{
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			PushFree((int)i);
+		}
+	}
+
+	FrameRing(const FrameRing &) = delete;
+	FrameRing &operator=(const FrameRing &) = delete;
+
+	// producer: the frame to decode the next capture into
+	cv::Mat &acquireWrite()
+	{
+		if (writing < 0)
+		{
+			writing = PopFree();
+		}
+		slots[writing].captured = std::chrono::steady_clock::now();
+		return slots[writing].frame;
+	}
+
+	// producer: queue the frame written since acquireWrite, dropping a
+	// frame by the policy if the queue is full
+	void publish()
+	{
+		slots[writing].sequence = published++;
+
+		unsigned long long position = tail.load(std::memory_order_relaxed);
+		int spare = -1;
+
+		if (position - head.load(std::memory_order_acquire) >= queue.size())
+		{
+			if (policy == DropPolicy::DropNewest)
+			{
+				// keep the slot, the next capture overwrites it
+				dropped++;
+				return;
+			}
+
+			// the consumer may take it first, then there is room anyway
+			spare = TakeHead();
+			if (spare >= 0)
+			{
+				dropped++;
+			}
+		}
+
+		queue[position % queue.size()].store(writing, std::memory_order_relaxed);
+		tail.store(position + 1, std::memory_order_release);
+
+		writing = spare;
+	}
+
+	// consumer: the oldest queued frame, NULL if there is none; stays
+	// valid until release()
+	Slot *acquireRead()
+	{
+		if (reading < 0)
+		{
+			reading = TakeHead();
+		}
+		return reading >= 0 ? &slots[reading] : NULL;
+	}
+
+	// consumer: done with the frame from acquireRead
+	void release()
+	{
+		if (reading < 0)
+		{
+			return;
+		}
+
+		long long latency = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - slots[reading].captured).count();
+		latencySumMicroSec += latency;
+		if (latency > latencyMaxMicroSec.load(std::memory_order_relaxed))
+		{
+			latencyMaxMicroSec.store(latency, std::memory_order_relaxed);
+		}
+		consumed++;
+
+		PushFree(reading);
+		reading = -1;
+	}
+
+	size_t getCapacity() const
+	{
+		return queue.size();
+	}
+
+	// frames queued right now
+	size_t getDepth() const
+	{
+		unsigned long long first = head.load(std::memory_order_acquire);
+		unsigned long long last = tail.load(std::memory_order_acquire);
+		return last > first ? (size_t)(last - first) : 0;
+	}
+
+	unsigned long long getDropped() const
+	{
+		return dropped;
+	}
+
+	unsigned long long getConsumed() const
+	{
+		return consumed;
+	}
+
+	// acquireWrite to release, per consumed frame
+	double getAverageLatencyMicroSec() const
+	{
+		unsigned long long count = consumed;
+		return count ? (double)latencySumMicroSec / count : 0.0;
+	}
+
+	long long getMaxLatencyMicroSec() const
+	{
+		return latencyMaxMicroSec;
+	}
+};
@@ -0,0 +1,116 @@
+#include "Hough.h"
+#include <cmath>
+#include <algorithm>
+
+using std::vector;
+using std::min;
+using std::max;
+
+
+HoughSpace::HoughSpace(int rows, int cols, int thetaBins, int angleWindow)
+	: thetaBins(thetaBins)
+{
+	const float MPI = 3.14159265f;
+	int diagonal = (int)std::ceil(std::sqrt((double)rows * rows + (double)cols * cols));
+
+	rhoOffset = diagonal;
+	rhoBins = 2 * diagonal + 1;
+	// a wider window would wrap around onto bins it already voted for
+	window = max(0, min(angleWindow * thetaBins / 180, (thetaBins - 1) / 2));
+
+	cosTable.resize(thetaBins);
+	sinTable.resize(thetaBins);
+	for (int theta = 0; theta < thetaBins; theta++)
+	{
+		cosTable[theta] = std::cos(theta * MPI / thetaBins);
+		sinTable[theta] = std::sin(theta * MPI / thetaBins);
+	}
+}
+
+int HoughSpace::CentreBin(int direction) const
+{
+	return direction * thetaBins / 180;
+}
+
+void HoughVote(const HoughSpace &space, const vector<EdgePoint> &edges, vector<unsigned int> &accumulator)
+{
+	accumulator.assign((size_t)space.thetaBins * space.rhoBins, 0);
+
+	for (size_t i = 0; i < edges.size(); i++)
+	{
+		const EdgePoint &edge = edges[i];
+		int centre = space.CentreBin(edge.direction);
+
+		for (int step = -space.window; step <= space.window; step++)
+		{
+			int theta = (centre + step + space.thetaBins) % space.thetaBins;
+			float rho = edge.x * space.cosTable[theta] + edge.y * space.sinTable[theta];
+
+			accumulator[theta * space.rhoBins + (int)std::floor(rho + 0.5f) + space.rhoOffset]++;
+		}
+	}
+}
+
+vector<HoughLine> HoughPeaks(const HoughSpace &space, const vector<unsigned int> &accumulator, unsigned int threshold)
+{
+	const float MPI = 3.14159265f;
+	vector<HoughLine> lines;
+
+	for (int theta = 0; theta < space.thetaBins; theta++)
+	{
+		for (int rho = 0; rho < space.rhoBins; rho++)
+		{
+			unsigned int votes = accumulator[theta * space.rhoBins + rho];
+			if (votes < threshold)
+			{
+				continue;
+			}
+
+			// on a plateau the first cell in scan order wins
+			bool peak = true;
+			for (int dt = -1; dt <= 1 && peak; dt++)
+			{
+				for (int dr = -1; dr <= 1 && peak; dr++)
+				{
+					int t = theta + dt;
+					int r = rho + dr;
+					if ((dt == 0 && dr == 0) || t < 0 || t >= space.thetaBins || r < 0 || r >= space.rhoBins)
+					{
+						continue;
+					}
+
+					unsigned int neighbour = accumulator[t * space.rhoBins + r];
+					bool earlier = dt < 0 || (dt == 0 && dr < 0);
+					if (neighbour > votes || (neighbour == votes && earlier))
+					{
+						peak = false;
+					}
+				}
+			}
+
+			if (peak)
+			{
+				HoughLine line;
+				line.rho = (float)(rho - space.rhoOffset);
+				line.theta = theta * MPI / space.thetaBins;
+				line.votes = (int)votes;
+				lines.push_back(line);
+			}
+		}
+	}
+
+	return lines;
+}
+
+void SortHoughLines(vector<HoughLine> &lines, size_t maxLines)
+{
+	std::sort(lines.begin(), lines.end(), [](const HoughLine &a, const HoughLine &b)
+	{
+		return a.votes > b.votes;
+	});
+
+	if (lines.size() > maxLines)
+	{
+		lines.resize(maxLines);
+	}
+}
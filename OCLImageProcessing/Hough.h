@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+
+#include "CannyTypes.h"
+
+// Hough line transform over a sparse edge list. Every edge only votes
+// for the theta bins within window bins of its gradient direction
+// (the line normal), instead of all thetaBins.
+struct HoughSpace
+{
+	int thetaBins;
+	int rhoBins;
+	int rhoOffset;	// rho index = round(rho) + rhoOffset
+	int window;		// half width of the vote window in theta bins,
+					// at most (thetaBins - 1) / 2 so no bin gets two votes
+
+	// cos and sin of every theta bin
+	std::vector<float> cosTable;
+	std::vector<float> sinTable;
+
+	HoughSpace(int rows, int cols, int thetaBins, int angleWindow);
+
+	// theta bin of a quantized direction (0, 45, 90 or 135)
+	int CentreBin(int direction) const;
+};
+
+void HoughVote(const HoughSpace &space, const std::vector<EdgePoint> &edges, std::vector<unsigned int> &accumulator);
+
+// local maxima of at least threshold votes over the 3x3 neighbourhood
+std::vector<HoughLine> HoughPeaks(const HoughSpace &space, const std::vector<unsigned int> &accumulator, unsigned int threshold);
+
+// strongest first, at most maxLines
+void SortHoughLines(std::vector<HoughLine> &lines, size_t maxLines);
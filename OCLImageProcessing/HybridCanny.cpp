@@ -0,0 +1,193 @@
+#include "HybridCanny.h"
+#include "CPUCanny.h"
+#include "Timer.h"
+#include "Trace.h"
+#include <thread>
+#include <algorithm>
+#include <cstring>
+
+using std::vector;
+using std::thread;
+using std::min;
+using std::max;
+using std::endl;
+using std::ostream;
+using cv::Mat;
+
+
+HybridCanny::HybridCanny(int cpuWorkers, int oclWorkers)
+{
+	workers.resize(max(0, cpuWorkers) + max(0, oclWorkers));
+
+	for (int i = 0; i < oclWorkers; i++)
+	{
+		workers[max(0, cpuWorkers) + i].engine.reset(new OCLCanny());
+	}
+
+	AddCPUWorkers();
+}
+
+HybridCanny::HybridCanny(int cpuWorkers, const vector<cl::Device> &devices)
+{
+	workers.resize(max(0, cpuWorkers) + devices.size());
+
+	for (size_t i = 0; i < devices.size(); i++)
+	{
+		workers[max(0, cpuWorkers) + i].engine.reset(new OCLCanny(devices[i]));
+	}
+
+	AddCPUWorkers();
+}
+
+void HybridCanny::AddCPUWorkers()
+{
+	if (workers.empty())
+	{
+		workers.resize(1);
+	}
+
+	// every slot without an OpenCL engine is a CPU worker
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		if (!workers[i].engine)
+		{
+			workers[i].engine.reset(new CPUCanny());
+		}
+	}
+}
+
+HybridCanny::~HybridCanny()
+{
+}
+
+void HybridCanny::SplitRows(int rows)
+{
+	// workers without a measurement yet are assumed to be average
+	double measured = 0.0;
+	int measuredCount = 0;
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		if (workers[i].rowsPerSec > 0.0)
+		{
+			measured += workers[i].rowsPerSec;
+			measuredCount++;
+		}
+	}
+	double fallback = measuredCount ? measured / measuredCount : 1.0;
+
+	vector<double> weights(workers.size());
+	double total = 0.0;
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		weights[i] = workers[i].rowsPerSec > 0.0 ? workers[i].rowsPerSec : fallback;
+		total += weights[i];
+	}
+
+	int minRows = (rows >= minBandRows * (int)workers.size()) ? minBandRows : 0;
+	int spare = rows - minRows * (int)workers.size();
+
+	int row = 0;
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		int bandRows = minRows + (int)(spare * weights[i] / total + 0.5);
+
+		workers[i].rowBegin = min(row, rows);
+		workers[i].rowEnd = (i + 1 == workers.size()) ? rows : min(row + bandRows, rows);
+		row = workers[i].rowEnd;
+	}
+}
+
+void HybridCanny::RunBand(Worker &worker, const Mat &input)
+{
+	if (worker.rowBegin >= worker.rowEnd)
+	{
+		worker.elapsedSec = 0.0;
+		return;
+	}
+
+	TRACE_ZONE("Hybrid band");
+
+	Timer timer;
+	timer.start();
+
+	int rows = input.rows;
+	int cols = input.cols;
+	int top = max(0, worker.rowBegin - HALO);
+	int bottom = min(rows, worker.rowEnd + HALO);
+
+	// a full width row range is still contiguous
+	Mat band = input.rowRange(top, bottom);
+	Mat ownRows = nonmaxima.rowRange(worker.rowBegin, worker.rowEnd);
+
+	worker.engine->Suppress(band, worker.bandNMS);
+	worker.bandNMS.rowRange(worker.rowBegin - top, worker.rowEnd - top).copyTo(ownRows);
+
+	// hysteresis only reads the rows this worker just wrote
+	memset(output.ptr(worker.rowBegin), 0x00, (worker.rowEnd - worker.rowBegin) * cols);
+	HysteresisRows(nonmaxima.data, output.data, rows, cols, worker.rowBegin, worker.rowEnd, tLow, tHigh);
+
+	timer.stop();
+	worker.elapsedSec = timer.getElapsedTimeInSec();
+}
+
+Mat HybridCanny::Process(const Mat &input)
+{
+	nonmaxima.create(input.rows, input.cols, CV_8UC1);
+	output.create(input.rows, input.cols, CV_8UC1);
+
+	SplitRows(input.rows);
+
+	vector<thread> threads;
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		threads.push_back(thread(&HybridCanny::RunBand, this, std::ref(workers[i]), std::cref(input)));
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+
+	// stitch edges that cross from one band into the next
+	TRACE_ZONE("Hybrid seams");
+	for (size_t i = 1; i < workers.size(); i++)
+	{
+		if (workers[i].rowBegin < workers[i].rowEnd)
+		{
+			HysteresisSeam(nonmaxima.data, output.data, input.rows, input.cols, workers[i].rowBegin, tLow);
+		}
+	}
+
+	// feed the measured throughput into the next split
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		Worker &worker = workers[i];
+		if (worker.elapsedSec <= 0.0)
+		{
+			continue;
+		}
+
+		double measured = (worker.rowEnd - worker.rowBegin) / worker.elapsedSec;
+		worker.rowsPerSec = (worker.rowsPerSec > 0.0)
+			? (1.0 - smoothing) * worker.rowsPerSec + smoothing * measured
+			: measured;
+	}
+
+	return output;
+}
+
+void HybridCanny::setThresholds(int low, int high)
+{
+	tLow = low;
+	tHigh = high;
+}
+
+void HybridCanny::PrintSplit(ostream &out) const
+{
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		const Worker &worker = workers[i];
+		out << worker.engine->getName() << " [" << i << "] rows "
+			<< worker.rowBegin << "-" << worker.rowEnd << " "
+			<< (int)worker.rowsPerSec << " rows/s" << endl;
+	}
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "CannyEngine.h"
+#include "OCLCanny.h"
+
+// Runs one frame on CPU threads and OpenCL engines at the same time.
+// The frame is cut into row bands (plus halo rows for the stencils),
+// each worker produces the non-maxima suppressed magnitude for its
+// band, hysteresis runs per band and is then stitched across seams.
+// Band heights follow the rows/s each worker managed on recent frames.
+class HybridCanny
+{
+private:
+	struct Worker
+	{
+		std::unique_ptr<CannyEngine> engine;
+
+		// suppressed magnitude of the band including its halo
+		cv::Mat bandNMS;
+
+		// smoothed throughput, rows per second
+		double rowsPerSec = 0.0;
+
+		// band of the current frame
+		int rowBegin = 0;
+		int rowEnd = 0;
+		double elapsedSec = 0.0;
+	};
+
+	std::vector<Worker> workers;
+
+	// halo rows needed by Gaussian (5x5), Sobel (3x3) and NMS (3x3)
+	static const int HALO = 8;
+
+	// weight of the newest measurement in the throughput average
+	const double smoothing = 0.3;
+
+	// keep every worker measurable even if it is much slower
+	const int minBandRows = 16;
+
+	// hysteresis thresholds, used by every band and seam
+	int tLow = 50;
+	int tHigh = 80;
+
+	cv::Mat nonmaxima;
+	cv::Mat output;
+
+	void AddCPUWorkers();
+	void SplitRows(int rows);
+	void RunBand(Worker &worker, const cv::Mat &input);
+
+public:
+	HybridCanny(int cpuWorkers, int oclWorkers);
+
+	// one OpenCL worker per device, e.g. from OCLCanny::GetDevices()
+	HybridCanny(int cpuWorkers, const std::vector<cl::Device> &devices);
+	~HybridCanny();
+
+	cv::Mat Process(const cv::Mat &input);
+
+	// takes effect on the next Process
+	void setThresholds(int low, int high);
+
+	// rows each worker got on the last frame and its current throughput
+	void PrintSplit(std::ostream &out) const;
+};
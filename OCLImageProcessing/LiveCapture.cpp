@@ -0,0 +1,127 @@
+#include "LiveCapture.h"
+#include "Trace.h"
+#include <chrono>
+
+using std::string;
+using std::ostream;
+using std::endl;
+using cv::Mat;
+
+
+LiveCapture::LiveCapture(int device, size_t capacity, FrameRing::DropPolicy policy)
+	: capture(device), ring(capacity, policy), running(false), sourceEnded(false)
+{
+	if (!capture.isOpened())
+	{
+		std::cerr << "Error: unable to open camera " << device << endl;
+	}
+}
+
+LiveCapture::LiveCapture(const string &source, size_t capacity, FrameRing::DropPolicy policy)
+	: capture(source), ring(capacity, policy), running(false), sourceEnded(false)
+{
+	if (!capture.isOpened())
+	{
+		std::cerr << "Error: unable to open " << source << endl;
+	}
+}
+
+LiveCapture::~LiveCapture()
+{
+	Stop();
+}
+
+bool LiveCapture::isOpened() const
+{
+	return capture.isOpened();
+}
+
+void LiveCapture::ProducerLoop()
+{
+	while (running)
+	{
+		TRACE_ZONE("Capture decode");
+
+		// decoded in place, the slot keeps its allocation between frames
+		Mat &frame = ring.acquireWrite();
+		if (!capture.read(frame) || frame.empty())
+		{
+			break;
+		}
+		ring.publish();
+	}
+
+	sourceEnded = true;
+}
+
+size_t LiveCapture::Run(CannyEngine &engine, EdgeCallback onEdges, size_t maxFrames)
+{
+	if (!capture.isOpened() || running)
+	{
+		return 0;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(producerLock);
+		running = true;
+		sourceEnded = false;
+		producer = std::thread(&LiveCapture::ProducerLoop, this);
+	}
+
+	Mat edges;
+	size_t processed = 0;
+
+	while (running && (maxFrames == 0 || processed < maxFrames))
+	{
+		FrameRing::Slot *slot = ring.acquireRead();
+		if (!slot)
+		{
+			// nothing queued, and nothing more coming once the source ended
+			if (sourceEnded && ring.getDepth() == 0)
+			{
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+			continue;
+		}
+
+		{
+			TRACE_ZONE("Capture canny");
+			engine.Process(slot->frame, edges);
+		}
+
+		if (onEdges)
+		{
+			onEdges(*slot, edges);
+		}
+
+		ring.release();
+		processed++;
+	}
+
+	Stop();
+	return processed;
+}
+
+void LiveCapture::Stop()
+{
+	std::lock_guard<std::mutex> guard(producerLock);
+	running = false;
+	if (producer.joinable())
+	{
+		producer.join();
+	}
+}
+
+const FrameRing &LiveCapture::getRing() const
+{
+	return ring;
+}
+
+void LiveCapture::PrintStats(ostream &out) const
+{
+	out << "Processed " << ring.getConsumed() << " frames, dropped " << ring.getDropped()
+		<< ", queued " << ring.getDepth() << "/" << ring.getCapacity() << endl;
+	out << "Latency avg " << (int)ring.getAverageLatencyMicroSec() << "us max "
+		<< ring.getMaxLatencyMicroSec() << "us" << endl;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "CannyEngine.h"
+#include "FrameRing.h"
+
+// Live capture front end: a thread reads frames from a camera or video
+// file straight into the slots of a FrameRing, the caller's thread runs
+// the engine on whatever the ring hands out. When the engine falls
+// behind, frames are dropped by the ring's policy instead of queueing
+// up, so latency stays bounded.
+class LiveCapture
+{
+public:
+	// called with every processed frame and its edges
+	typedef std::function<void(const FrameRing::Slot &, const cv::Mat &)> EdgeCallback;
+
+private:
+	cv::VideoCapture capture;
+	FrameRing ring;
+
+	// guards starting and joining the producer, Stop may be called from
+	// another thread while Run stops on its own
+	std::mutex producerLock;
+	std::thread producer;
+	std::atomic<bool> running;
+	std::atomic<bool> sourceEnded;
+
+	void ProducerLoop();
+
+public:
+	// camera index
+	LiveCapture(int device, size_t capacity = 2, FrameRing::DropPolicy policy = FrameRing::DropPolicy::DropOldest);
+
+	// video file or stream URL
+	LiveCapture(const std::string &source, size_t capacity = 2, FrameRing::DropPolicy policy = FrameRing::DropPolicy::DropOldest);
+	~LiveCapture();
+
+	bool isOpened() const;
+
+	// start capturing and process frames until the source ends, Stop()
+	// is called or maxFrames (0 for no limit) frames are done; returns
+	// the number of frames processed
+	size_t Run(CannyEngine &engine, EdgeCallback onEdges = EdgeCallback(), size_t maxFrames = 0);
+
+	// stop capturing, Run returns after the current frame
+	void Stop();
+
+	const FrameRing &getRing() const;
+
+	// processed and dropped frames, queue depth and latency
+	void PrintStats(std::ostream &out) const;
+};
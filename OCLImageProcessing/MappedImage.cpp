@@ -0,0 +1,368 @@
+#include "MappedImage.h"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using std::string;
+using std::cerr;
+using std::endl;
+using cv::Mat;
+
+
+// bytes of a header and a rows x cols raster; false for an empty or
+// negative size, or one that size_t cannot hold
+static bool ImageBytes(int rows, int cols, size_t headerLength, size_t &bytes)
+{
+	if (rows <= 0 || cols <= 0)
+	{
+		return false;
+	}
+
+	if ((size_t)rows > (SIZE_MAX - headerLength) / (size_t)cols)
+	{
+		return false;
+	}
+
+	bytes = headerLength + (size_t)rows * cols;
+	return true;
+}
+
+
+MappedImage::MappedImage()
+{
+}
+
+MappedImage::~MappedImage()
+{
+	Close();
+}
+
+bool MappedImage::MapFile(const string &fileName, size_t size, bool create)
+{
+	Close();
+	writable = create;
+
+#ifdef _WIN32
+	fileHandle = CreateFileA(
+		fileName.c_str(),
+		create ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+		FILE_SHARE_READ,
+		NULL,
+		create ? CREATE_ALWAYS : OPEN_EXISTING,
+		create ? FILE_ATTRIBUTE_NORMAL : FILE_FLAG_SEQUENTIAL_SCAN,
+		NULL);
+
+	if (fileHandle == INVALID_HANDLE_VALUE)
+	{
+		cerr << "Error: unable to open " << fileName << endl;
+		return false;
+	}
+
+	if (!create)
+	{
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(fileHandle, &fileSize))
+		{
+			cerr << "Error: unable to read the size of " << fileName << endl;
+			Close();
+			return false;
+		}
+		size = (size_t)fileSize.QuadPart;
+	}
+
+	mappingHandle = CreateFileMappingA(
+		fileHandle, NULL,
+		create ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xFFFFFFFF),
+		NULL);
+
+	if (mappingHandle == NULL)
+	{
+		cerr << "Error: unable to map " << fileName << endl;
+		Close();
+		return false;
+	}
+
+	base = (unsigned char *)MapViewOfFile(
+		mappingHandle,
+		create ? FILE_MAP_WRITE : FILE_MAP_READ,
+		0, 0, size);
+#else
+	fileDescriptor = open(fileName.c_str(), create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+
+	if (fileDescriptor < 0)
+	{
+		cerr << "Error: unable to open " << fileName << endl;
+		return false;
+	}
+
+	if (create)
+	{
+		if (ftruncate(fileDescriptor, (off_t)size) != 0)
+		{
+			cerr << "Error: unable to resize " << fileName << endl;
+			Close();
+			return false;
+		}
+	}
+	else
+	{
+		struct stat info;
+		if (fstat(fileDescriptor, &info) != 0)
+		{
+			cerr << "Error: unable to read the size of " << fileName << endl;
+			Close();
+			return false;
+		}
+		size = (size_t)info.st_size;
+	}
+
+	if (size == 0)
+	{
+		cerr << "Error: " << fileName << " is empty" << endl;
+		Close();
+		return false;
+	}
+
+	void *mapping = mmap(
+		NULL, size,
+		create ? (PROT_READ | PROT_WRITE) : PROT_READ,
+		MAP_SHARED, fileDescriptor, 0);
+
+	base = (mapping == MAP_FAILED) ? NULL : (unsigned char *)mapping;
+
+	// the pipeline walks the image top to bottom
+	if (base != NULL)
+	{
+		madvise(base, size, MADV_SEQUENTIAL);
+	}
+#endif
+
+	if (base == NULL)
+	{
+		cerr << "Error: unable to map " << fileName << endl;
+		Close();
+		return false;
+	}
+
+	mappedSize = size;
+	return true;
+}
+
+bool MappedImage::ParsePGMHeader()
+{
+	// P5 <whitespace> width <whitespace> height <whitespace> maxval <single whitespace>
+	if (mappedSize < 2 || base[0] != 'P' || base[1] != '5')
+	{
+		return false;
+	}
+
+	int fields[3] = { 0, 0, 0 };
+	size_t pos = 2;
+
+	for (int field = 0; field < 3; field++)
+	{
+		// skip whitespace and comments
+		while (pos < mappedSize && (isspace(base[pos]) || base[pos] == '#'))
+		{
+			if (base[pos] == '#')
+			{
+				while (pos < mappedSize && base[pos] != '\n')
+				{
+					pos++;
+				}
+			}
+			pos++;
+		}
+
+		if (pos >= mappedSize || !isdigit(base[pos]))
+		{
+			return false;
+		}
+
+		while (pos < mappedSize && isdigit(base[pos]))
+		{
+			// no field fits a mapping this large
+			if (fields[field] > (INT_MAX - 9) / 10)
+			{
+				return false;
+			}
+
+			fields[field] = fields[field] * 10 + (base[pos] - '0');
+			pos++;
+		}
+	}
+
+	// exactly one whitespace character separates the header from the raster
+	pos++;
+
+	cols = fields[0];
+	rows = fields[1];
+	dataOffset = pos;
+
+	// only 8-bit rasters can be wrapped directly
+	if (fields[2] <= 0 || fields[2] > 255)
+	{
+		return false;
+	}
+
+	size_t bytes;
+	return ImageBytes(rows, cols, dataOffset, bytes) && bytes <= mappedSize;
+}
+
+bool MappedImage::OpenPGM(const string &fileName)
+{
+	if (!MapFile(fileName, 0, false))
+	{
+		return false;
+	}
+
+	if (!ParsePGMHeader())
+	{
+		cerr << "Error: " << fileName << " is not an 8-bit binary PGM" << endl;
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+bool MappedImage::OpenRaw(const string &fileName, int rows, int cols)
+{
+	size_t bytes;
+	if (!ImageBytes(rows, cols, 0, bytes))
+	{
+		cerr << "Error: invalid image size " << cols << "x" << rows << endl;
+		return false;
+	}
+
+	if (!MapFile(fileName, 0, false))
+	{
+		return false;
+	}
+
+	if (mappedSize < bytes)
+	{
+		cerr << "Error: " << fileName << " is smaller than " << cols << "x" << rows << endl;
+		Close();
+		return false;
+	}
+
+	this->rows = rows;
+	this->cols = cols;
+	dataOffset = 0;
+	return true;
+}
+
+bool MappedImage::CreatePGM(const string &fileName, int rows, int cols)
+{
+	char header[64];
+	int headerLength = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", cols, rows);
+
+	size_t bytes;
+	if (!ImageBytes(rows, cols, headerLength, bytes))
+	{
+		cerr << "Error: invalid image size " << cols << "x" << rows << endl;
+		return false;
+	}
+
+	if (!MapFile(fileName, bytes, true))
+	{
+		return false;
+	}
+
+	memcpy(base, header, headerLength);
+	this->rows = rows;
+	this->cols = cols;
+	dataOffset = headerLength;
+	return true;
+}
+
+bool MappedImage::CreateRaw(const string &fileName, int rows, int cols)
+{
+	size_t bytes;
+	if (!ImageBytes(rows, cols, 0, bytes))
+	{
+		cerr << "Error: invalid image size " << cols << "x" << rows << endl;
+		return false;
+	}
+
+	if (!MapFile(fileName, bytes, true))
+	{
+		return false;
+	}
+
+	this->rows = rows;
+	this->cols = cols;
+	dataOffset = 0;
+	return true;
+}
+
+void MappedImage::Flush()
+{
+	if (base == NULL || !writable)
+	{
+		return;
+	}
+
+#ifdef _WIN32
+	FlushViewOfFile(base, mappedSize);
+#else
+	msync(base, mappedSize, MS_ASYNC);
+#endif
+}
+
+void MappedImage::Close()
+{
+#ifdef _WIN32
+	if (base != NULL)
+	{
+		UnmapViewOfFile(base);
+	}
+	if (mappingHandle != NULL)
+	{
+		CloseHandle(mappingHandle);
+	}
+	if (fileHandle != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(fileHandle);
+	}
+	mappingHandle = NULL;
+	fileHandle = INVALID_HANDLE_VALUE;
+#else
+	if (base != NULL)
+	{
+		munmap(base, mappedSize);
+	}
+	if (fileDescriptor >= 0)
+	{
+		close(fileDescriptor);
+	}
+	fileDescriptor = -1;
+#endif
+
+	base = NULL;
+	mappedSize = 0;
+	dataOffset = 0;
+	rows = cols = 0;
+}
+
+Mat MappedImage::getImage()
+{
+	if (base == NULL)
+	{
+		return Mat();
+	}
+
+	return Mat(rows, cols, CV_8UC1, base + dataOffset);
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <string>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// 8-bit grayscale image backed by a memory-mapped file.
+// Supports binary PGM (P5) and headerless raw files. The pixel data is
+// exposed as a cv::Mat header pointing straight into the mapping, so
+// no decode or copy is needed before handing it to the pipeline.
+class MappedImage
+{
+private:
+	unsigned char *base = NULL;
+	size_t mappedSize = 0;
+	size_t dataOffset = 0;
+	int rows = 0;
+	int cols = 0;
+	bool writable = false;
+
+#ifdef _WIN32
+	HANDLE fileHandle = INVALID_HANDLE_VALUE;
+	HANDLE mappingHandle = NULL;
+#else
+	int fileDescriptor = -1;
+#endif
+
+	bool MapFile(const std::string &fileName, size_t size, bool create);
+	bool ParsePGMHeader();
+
+public:
+	MappedImage();
+	~MappedImage();
+
+	MappedImage(const MappedImage &) = delete;
+	MappedImage &operator=(const MappedImage &) = delete;
+
+	// map existing files read-only
+	bool OpenPGM(const std::string &fileName);
+	bool OpenRaw(const std::string &fileName, int rows, int cols);
+
+	// create (or truncate) a file of the right size and map it writable
+	bool CreatePGM(const std::string &fileName, int rows, int cols);
+	bool CreateRaw(const std::string &fileName, int rows, int cols);
+
+	// flush dirty pages of a writable mapping back to the file
+	void Flush();
+	void Close();
+
+	bool isOpen() const { return base != NULL; }
+
+	// header only, no copy; valid until Close()
+	cv::Mat getImage();
+};
@@ -0,0 +1,79 @@
+#include "MultiDeviceCanny.h"
+#include "Timer.h"
+#include <thread>
+
+using std::vector;
+using std::thread;
+using std::endl;
+using std::ostream;
+using cv::Mat;
+
+
+MultiDeviceCanny::MultiDeviceCanny(bool splitNUMA)
+	: MultiDeviceCanny(OCLCanny::GetDevices(CL_DEVICE_TYPE_ALL, splitNUMA))
+{
+}
+
+MultiDeviceCanny::MultiDeviceCanny(const vector<cl::Device> &devices)
+	: nextFrame(0)
+{
+	workers.resize(devices.size());
+
+	for (size_t i = 0; i < devices.size(); i++)
+	{
+		workers[i].engine.reset(new OCLCanny(devices[i]));
+	}
+}
+
+size_t MultiDeviceCanny::getDeviceCount() const
+{
+	return workers.size();
+}
+
+void MultiDeviceCanny::Worker(DeviceWorker &worker, const vector<Mat> &frames, vector<Mat> &edges)
+{
+	Timer timer;
+
+	for (;;)
+	{
+		size_t index = nextFrame++;
+		if (index >= frames.size())
+		{
+			break;
+		}
+
+		timer.start();
+
+		worker.engine->Process(frames[index], edges[index]);
+
+		timer.stop();
+		worker.frames++;
+		worker.busySec += timer.getElapsedTimeInSec();
+	}
+}
+
+void MultiDeviceCanny::Process(const vector<Mat> &frames, vector<Mat> &edges)
+{
+	edges.resize(frames.size());
+	nextFrame = 0;
+
+	vector<thread> threads;
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		threads.push_back(thread(&MultiDeviceCanny::Worker, this, std::ref(workers[i]), std::cref(frames), std::ref(edges)));
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+}
+
+void MultiDeviceCanny::PrintDevices(ostream &out) const
+{
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		const DeviceWorker &worker = workers[i];
+		out << "[" << i << "] " << worker.engine->getDeviceName() << ": "
+			<< worker.frames << " frames, " << worker.busySec * 1000.0 << "ms" << endl;
+	}
+}
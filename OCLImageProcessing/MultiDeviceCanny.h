@@ -0,0 +1,40 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <iostream>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "OCLCanny.h"
+
+// One OCLCanny (context, queue and kernels) per OpenCL device or
+// sub-device. Each device is driven by its own host thread which pulls
+// the next frame as soon as it is done, so faster devices take more.
+class MultiDeviceCanny
+{
+private:
+	struct DeviceWorker
+	{
+		std::unique_ptr<OCLCanny> engine;
+		size_t frames = 0;
+		double busySec = 0.0;
+	};
+
+	std::vector<DeviceWorker> workers;
+	std::atomic<size_t> nextFrame;
+
+	void Worker(DeviceWorker &worker, const std::vector<cv::Mat> &frames, std::vector<cv::Mat> &edges);
+
+public:
+	// every device of every platform, CPU devices split per NUMA node if asked
+	MultiDeviceCanny(bool splitNUMA = false);
+	MultiDeviceCanny(const std::vector<cl::Device> &devices);
+
+	size_t getDeviceCount() const;
+
+	// edges[i] is the edge map of frames[i]
+	void Process(const std::vector<cv::Mat> &frames, std::vector<cv::Mat> &edges);
+
+	// frames and busy time per device since construction
+	void PrintDevices(std::ostream &out) const;
+};
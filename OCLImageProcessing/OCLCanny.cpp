@@ -1,5 +1,11 @@
 #include "OCLCanny.h"
+#include "PaddedImage.h"
+#include "CannyStages.h"
 #include "utils.h"
+#include "EdgeLinker.h"
+#include "Hough.h"
+#include "Trace.h"
+#include "Timer.h"
 #include <cassert>
 #include <iostream>
 #include <fstream>
@@ -18,6 +24,14 @@ using cv::Mat;
 using cv::UMat;
 
 
+static size_t RoundUp(size_t value, size_t multiple)
+{
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+// must match SWEEP_TILE in canny.cl
+static const size_t SWEEP_TILE = 16;
+
 OCLCanny::OCLCanny()
 {
 	// Initialize OCL
@@ -26,22 +40,20 @@ OCLCanny::OCLCanny()
 		// find all available platforms
 		cl::Platform::get(&allPlatforms);
 
-		allPlatforms[0].getDevices(CL_DEVICE_TYPE_GPU, &allDevices);
+		// prefer a GPU, but fall back to any device such as a CPU runtime
+		std::vector<cl::Device> devices = GetDevices(CL_DEVICE_TYPE_GPU);
+		if (devices.empty())
+		{
+			devices = GetDevices(CL_DEVICE_TYPE_ALL);
+		}
 
-		targetDevice = allDevices[0];
-
-		// create OCL context
-		context = cl::Context(allDevices);
-
-		// create OCL command queue
-		queue = cl::CommandQueue(context, targetDevice);
-
-		// create and load kernels
-		gaussianBlurKernel = LoadKernel("canny.cl", "gaussian_blur");
-		sobelOperatorKernel = LoadKernel("canny.cl", "sobel_operation");
-		nonMaximaSuppressionKernel = LoadKernel("canny.cl", "non_maxima_suppression");
-		hysteresisThresholdingKernel = LoadKernel("canny.cl", "hysteresis_thresholding");
+		if (devices.empty())
+		{
+			cerr << "Error: no OpenCL device found" << endl;
+			return;
+		}
 
+		Initialize(devices[0]);
 	}
 	catch (const exception &e)
 	{
@@ -61,78 +73,1262 @@ OCLCanny::OCLCanny()
 #endif
 }
 
+OCLCanny::OCLCanny(const cl::Device &device)
+{
+	try
+	{
+		Initialize(device);
+	}
+	catch (const exception &e)
+	{
+		cerr << "Error: " << e.what() << ": " << endl;
+	}
+}
+
+void OCLCanny::Initialize(const cl::Device &device)
+{
+	targetDevice = device;
+	allDevices.assign(1, device);
+
+	// create OCL context
+	context = cl::Context(allDevices);
+
+	// create OCL command queue
+	queue = cl::CommandQueue(context, targetDevice);
+
+	// canny.cl is built once, every kernel comes from that program; it
+	// is also the one pixel per item build of the stencil kernels
+	cl::Program program;
+	imageSupport = targetDevice.getInfo<CL_DEVICE_IMAGE_SUPPORT>() != 0;
+	if (BuildProgram("canny.cl", "", program))
+	{
+		stencilPrograms[1] = program;
+
+		gaussianBlurKernel = CreateKernel(program, "gaussian_blur");
+		gaussianBlurBGRKernel = CreateKernel(program, "gaussian_blur_bgr");
+		sobelOperatorKernel = CreateKernel(program, "sobel_operation");
+		nonMaximaSuppressionKernel = CreateKernel(program, "non_maxima_suppression");
+		hysteresisThresholdingKernel = CreateKernel(program, "hysteresis_thresholding");
+		hysteresisPackedKernel = CreateKernel(program, "hysteresis_thresholding_packed");
+		hysteresisSweepKernel = CreateKernel(program, "hysteresis_sweep");
+		hysteresisSweep16Kernel = CreateKernel(program, "hysteresis_sweep16");
+		hysteresisSweepGrowKernel = CreateKernel(program, "hysteresis_sweep_grow");
+		hysteresisSweepGrow16Kernel = CreateKernel(program, "hysteresis_sweep_grow16");
+		compactEdgesKernel = CreateKernel(program, "compact_edges");
+		edgeNeighboursKernel = CreateKernel(program, "edge_neighbours");
+		houghVoteKernel = CreateKernel(program, "hough_vote");
+		houghPeaksKernel = CreateKernel(program, "hough_peaks");
+		replicateApronKernel = CreateKernel(program, "replicate_apron");
+
+		// the image kernels are only compiled in when the device has images
+		if (imageSupport)
+		{
+			gaussianBlurImageKernel = CreateKernel(program, "gaussian_blur_image");
+			sobelOperatorImageKernel = CreateKernel(program, "sobel_operation_image");
+		}
+	}
+
+	// a kernel stays empty when the build failed
+	const cl::Kernel *required[] = {
+		&gaussianBlurKernel, &gaussianBlurBGRKernel, &sobelOperatorKernel,
+		&nonMaximaSuppressionKernel, &hysteresisThresholdingKernel, &replicateApronKernel
+	};
+	initialized = context() != NULL && queue() != NULL;
+	for (size_t i = 0; i < sizeof(required) / sizeof(required[0]); i++)
+	{
+		initialized = initialized && (*required[i])() != NULL;
+	}
+}
+
+bool OCLCanny::isInitialized() const
+{
+	return initialized;
+}
+
+std::vector<cl::Device> OCLCanny::GetDevices(cl_device_type type, bool splitNUMA, int unitsPerSubDevice)
+{
+	std::vector<cl::Platform> platforms;
+	std::vector<cl::Device> result;
+
+	cl::Platform::get(&platforms);
+
+	for (size_t p = 0; p < platforms.size(); p++)
+	{
+		std::vector<cl::Device> devices;
+
+		try
+		{
+			if (platforms[p].getDevices(type, &devices) != CL_SUCCESS)
+			{
+				continue;
+			}
+		}
+		catch (const exception &)
+		{
+			// a platform without devices of this type
+			continue;
+		}
+
+		for (size_t d = 0; d < devices.size(); d++)
+		{
+			std::vector<cl::Device> subDevices;
+
+#if defined(CL_VERSION_1_2)
+			// only CPU runtimes are worth partitioning, each part then
+			// gets its own queue and runs close to its own memory
+			if (devices[d].getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU)
+			{
+				try
+				{
+					if (splitNUMA)
+					{
+						const cl_device_partition_property properties[] = {
+							CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+							CL_DEVICE_AFFINITY_DOMAIN_NUMA,
+							0
+						};
+						devices[d].createSubDevices(properties, &subDevices);
+					}
+					else if (unitsPerSubDevice > 0)
+					{
+						const cl_device_partition_property properties[] = {
+							CL_DEVICE_PARTITION_EQUALLY,
+							unitsPerSubDevice,
+							0
+						};
+						devices[d].createSubDevices(properties, &subDevices);
+					}
+				}
+				catch (const exception &)
+				{
+					// partitioning is optional, use the whole device instead
+					subDevices.clear();
+				}
+			}
+#endif
+
+			if (subDevices.size() > 1)
+			{
+				result.insert(result.end(), subDevices.begin(), subDevices.end());
+			}
+			else
+			{
+				result.push_back(devices[d]);
+			}
+		}
+	}
+
+	return result;
+}
+
+std::string OCLCanny::getDeviceName() const
+{
+	return targetDevice.getInfo<CL_DEVICE_NAME>();
+}
+
+std::string OCLCanny::getName() const
+{
+	return "OCL " + getDeviceName();
+}
+
+void OCLCanny::Process(const Mat &input, Mat &edges)
+{
+	TRACE_ZONE("OCL Process");
+
+	Mat image = input;
+	LoadOCVImage(image);
+	Gaussian();
+	Sobel();
+	NonMaximaSuppression();
+	HysteresisThresholding();
+
+	edges.create(input.rows, input.cols, CV_8UC1);
+	getOutputImage(edges);
+}
+
+void OCLCanny::ProcessPacked(const Mat &input, PackedEdgeMap &edges)
+{
+	TRACE_ZONE("OCL ProcessPacked");
+
+	Mat image = input;
+	LoadOCVImage(image);
+	Gaussian();
+	Sobel();
+	NonMaximaSuppression();
+	HysteresisThresholdingPacked();
+
+	getPackedOutput(edges);
+}
+
+void OCLCanny::Suppress(const Mat &input, Mat &suppressed)
+{
+	TRACE_ZONE("OCL Suppress");
+
+	Mat image = input;
+	LoadOCVImage(image);
+	Gaussian();
+	Sobel();
+	NonMaximaSuppression();
+
+	suppressed.create(input.rows, input.cols, CV_8UC1);
+	getOutputImage(suppressed);
+}
+
+bool OCLCanny::LoadTypedKernels(int depth)
+{
+	if (depth == typedDepth)
+	{
+		return true;
+	}
+
+	// the pixel type is fixed when the program is built
+	string options;
+	switch (depth)
+	{
+		case CV_8U:
+			options = "-D PIXEL=uchar -D CONVERT_PIXEL=convert_uchar_sat_rte";
+			break;
+		case CV_16U:
+			options = "-D PIXEL=ushort -D CONVERT_PIXEL=convert_ushort_sat_rte";
+			break;
+		case CV_32F:
+			options = "-D PIXEL=float -D CONVERT_PIXEL=convert_float";
+			break;
+		default:
+			cerr << "Error: typed kernels support 8 bit, 16 bit and float pixels only" << endl;
+			return false;
+	}
+
+	cl::Program program;
+	if (!BuildProgram("canny_typed.cl", options, program))
+	{
+		return false;
+	}
+
+	gaussianBlurTypedKernel = CreateKernel(program, "gaussian_blur_typed");
+	sobelOperatorTypedKernel = CreateKernel(program, "sobel_operation_typed");
+	nonMaximaSuppressionTypedKernel = CreateKernel(program, "non_maxima_suppression_typed");
+	hysteresisThresholdingTypedKernel = CreateKernel(program, "hysteresis_thresholding_typed");
+
+	typedDepth = depth;
+	return true;
+}
+
+void OCLCanny::ProcessTyped(const Mat &input, Mat &edges, float tLow, float tHigh)
+{
+	TRACE_ZONE("OCL ProcessTyped");
+
+	if (input.channels() != 1 || input.rows < 3 || input.cols < 3 || !LoadTypedKernels(input.depth()))
+	{
+		return;
+	}
+
+	Mat image = input.isContinuous() ? input : input.clone();
+	const size_t rows = image.rows;
+	const size_t cols = image.cols;
+	const size_t pixels = rows * cols;
+
+	// the kernels skip the items past the last work-group
+	cl::NDRange offset(1, 1);
+	cl::NDRange global(RoundUp(rows - 2, workgroup_size), RoundUp(cols - 2, workgroup_size));
+	cl::NDRange local(workgroup_size, workgroup_size);
+
+	try
+	{
+		typedPixels[0] = cl::Buffer(
+			context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR | CL_MEM_COPY_HOST_PTR,
+			pixels * image.elemSize(),
+			image.data);
+		typedPixels[1] = cl::Buffer(context, CL_MEM_READ_WRITE, pixels * image.elemSize());
+		typedGradient[0] = cl::Buffer(context, CL_MEM_READ_WRITE, pixels * sizeof(cl_float));
+		typedGradient[1] = cl::Buffer(context, CL_MEM_READ_WRITE, pixels * sizeof(cl_float));
+		typedTheta = cl::Buffer(context, CL_MEM_READ_WRITE, pixels);
+		typedEdges = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, pixels);
+
+		// border pixels are never written
+		queue.enqueueFillBuffer(typedEdges, (cl_uchar)0, 0, pixels);
+
+		gaussianBlurTypedKernel.setArg(0, typedPixels[0]);
+		gaussianBlurTypedKernel.setArg(1, typedPixels[1]);
+		gaussianBlurTypedKernel.setArg(2, rows);
+		gaussianBlurTypedKernel.setArg(3, cols);
+		queue.enqueueNDRangeKernel(gaussianBlurTypedKernel, offset, global, local, NULL);
+
+		sobelOperatorTypedKernel.setArg(0, typedPixels[1]);
+		sobelOperatorTypedKernel.setArg(1, typedGradient[0]);
+		sobelOperatorTypedKernel.setArg(2, typedTheta);
+		sobelOperatorTypedKernel.setArg(3, rows);
+		sobelOperatorTypedKernel.setArg(4, cols);
+		queue.enqueueNDRangeKernel(sobelOperatorTypedKernel, offset, global, local, NULL);
+
+		nonMaximaSuppressionTypedKernel.setArg(0, typedGradient[0]);
+		nonMaximaSuppressionTypedKernel.setArg(1, typedGradient[1]);
+		nonMaximaSuppressionTypedKernel.setArg(2, typedTheta);
+		nonMaximaSuppressionTypedKernel.setArg(3, rows);
+		nonMaximaSuppressionTypedKernel.setArg(4, cols);
+		queue.enqueueNDRangeKernel(nonMaximaSuppressionTypedKernel, offset, global, local, NULL);
+
+		hysteresisThresholdingTypedKernel.setArg(0, typedGradient[1]);
+		hysteresisThresholdingTypedKernel.setArg(1, typedEdges);
+		hysteresisThresholdingTypedKernel.setArg(2, rows);
+		hysteresisThresholdingTypedKernel.setArg(3, cols);
+		hysteresisThresholdingTypedKernel.setArg(4, tLow);
+		hysteresisThresholdingTypedKernel.setArg(5, tHigh);
+		queue.enqueueNDRangeKernel(hysteresisThresholdingTypedKernel, offset, global, local, NULL);
+
+		edges.create(image.rows, image.cols, CV_8UC1);
+		queue.enqueueReadBuffer(typedEdges, CL_TRUE, 0, pixels, edges.data);
+	}
+	catch (const exception &e)
+	{
+		cerr << "Error: " << e.what() << endl;
+	}
+}
+
 void OCLCanny::LoadOCVImage(Mat &rawImage)
 {/*
 	int rows = ((rawImage.rows - 2) / workgroup_size) * workgroup_size + 2;
 	int cols = ((rawImage.cols - 2) / workgroup_size) * workgroup_size + 2;
 	cv::Rect croppedArea(0, 0, cols, rows);
 	*/
-	// read image
-	inputBuffer = rawImage.clone();
+	TRACE_ZONE("OCL upload");
+
+	// the pixels are copied into the device buffer below, so only
+	// non-contiguous images (ROIs) need a packed copy first
+	inputBuffer = rawImage.isContinuous() ? rawImage : rawImage.clone();
 	outputBuffer = Mat(inputBuffer.rows, inputBuffer.cols, CV_8UC1);
+	bgrInput = inputBuffer.channels() == 3;
+	padded = !UseImages() && !bgrInput;
+
+	if (padded)
+	{
+		originRow = PaddedImage::APRON;
+		originCol = PaddedImage::OriginCol(PaddedImage::APRON);
+		paddedRows = originRow + inputBuffer.rows + PaddedImage::APRON;
+		pitch = PaddedImage::Stride(inputBuffer.cols, PaddedImage::APRON);
+	}
+	else
+	{
+		originRow = 0;
+		originCol = 0;
+		paddedRows = inputBuffer.rows;
+		pitch = inputBuffer.cols;
+	}
 
 	// setup buffers
-	NextBuffer() = cl::Buffer(
-		context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR | CL_MEM_COPY_HOST_PTR,
-		inputBuffer.rows * inputBuffer.cols * inputBuffer.elemSize(),
-		inputBuffer.data);
+	if (UseImages())
+	{
+		// the input only lives in the image, Gaussian does not touch the buffers
+		inputImage = cl::Image2D(
+			context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			cl::ImageFormat(CL_R, CL_UNSIGNED_INT8),
+			inputBuffer.cols, inputBuffer.rows, 0,
+			inputBuffer.data);
+
+		gaussianImage = cl::Image2D(
+			context, CL_MEM_READ_WRITE,
+			cl::ImageFormat(CL_R, CL_UNSIGNED_INT8),
+			inputBuffer.cols, inputBuffer.rows);
+
+		NextBuffer() = cl::Buffer(
+			context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+			inputBuffer.rows * inputBuffer.cols);
+	}
+	else if (padded)
+	{
+		NextBuffer() = cl::Buffer(
+			context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+			pitch * paddedRows);
+
+		// rows land at the padded pitch, the apron is filled on the device
+		cl::size_t<3> bufferOrigin;
+		cl::size_t<3> hostOrigin;
+		cl::size_t<3> region;
+		bufferOrigin[0] = originCol;
+		bufferOrigin[1] = originRow;
+		bufferOrigin[2] = 0;
+		hostOrigin[0] = 0;
+		hostOrigin[1] = 0;
+		hostOrigin[2] = 0;
+		region[0] = inputBuffer.cols;
+		region[1] = inputBuffer.rows;
+		region[2] = 1;
+
+		queue.enqueueWriteBufferRect(
+			NextBuffer(), CL_TRUE,
+			bufferOrigin, hostOrigin, region,
+			pitch, 0, inputBuffer.step, 0,
+			inputBuffer.data);
+
+		ReplicateApron(NextBuffer());
+	}
+	else
+	{
+		// three bytes per pixel for BGR, later stages write one into it
+		NextBuffer() = cl::Buffer(
+			context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR | CL_MEM_COPY_HOST_PTR,
+			inputBuffer.rows * inputBuffer.cols * inputBuffer.elemSize(),
+			inputBuffer.data);
+	}
 
 	PrevBuffer() = cl::Buffer(
 		context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-		inputBuffer.rows * inputBuffer.cols * inputBuffer.elemSize());
+		pitch * paddedRows);
 
 	theta = cl::Buffer(
 		context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-		inputBuffer.rows * inputBuffer.cols * inputBuffer.elemSize());
+		pitch * paddedRows);
 
 	SwapBuffer();
+	validStage = CannyStage::Input;
 }
 
 
 cv::Mat OCLCanny::getOutputImage()
 {
-	queue.enqueueReadBuffer(
-		PrevBuffer(),
-		CL_TRUE,
-		0,
-		inputBuffer.rows * inputBuffer.cols * inputBuffer.elemSize(),
-		outputBuffer.data);
+	TRACE_ZONE("OCL readback");
 
-	wait();
+	ReadImage(PrevBuffer(), outputBuffer);
 
 	assert(outputBuffer.rows == inputBuffer.rows && outputBuffer.cols == inputBuffer.cols);
 	return outputBuffer;
 }
 
+void OCLCanny::getOutputImage(Mat &output)
+{
+	TRACE_ZONE("OCL readback");
+
+	assert(output.rows == inputBuffer.rows && output.cols == inputBuffer.cols);
+	assert(output.type() == CV_8UC1 && output.isContinuous());
+
+	ReadImage(PrevBuffer(), output);
+}
+
+void OCLCanny::getPackedOutput(PackedEdgeMap &output)
+{
+	TRACE_ZONE("OCL packed readback");
+
+	output.create(inputBuffer.rows, inputBuffer.cols);
+	if (output.getSizeInBytes() > 0)
+	{
+		queue.enqueueReadBuffer(packedEdges, CL_TRUE, 0, output.getSizeInBytes(), output.data());
+	}
+}
+
+void OCLCanny::ReadImage(cl::Buffer &buffer, Mat &output)
+{
+	if (!padded)
+	{
+		queue.enqueueReadBuffer(buffer, CL_TRUE, 0, inputBuffer.rows * inputBuffer.cols, output.data);
+		return;
+	}
+
+	cl::size_t<3> bufferOrigin;
+	cl::size_t<3> hostOrigin;
+	cl::size_t<3> region;
+	bufferOrigin[0] = originCol;
+	bufferOrigin[1] = originRow;
+	bufferOrigin[2] = 0;
+	hostOrigin[0] = 0;
+	hostOrigin[1] = 0;
+	hostOrigin[2] = 0;
+	region[0] = inputBuffer.cols;
+	region[1] = inputBuffer.rows;
+	region[2] = 1;
+
+	queue.enqueueReadBufferRect(
+		buffer, CL_TRUE,
+		bufferOrigin, hostOrigin, region,
+		pitch, 0, output.step, 0,
+		output.data);
+}
+
+cl_uint OCLCanny::CompactEdges(bool withAttributes)
+{
+	// must match COMPACT_GROUP_SIZE in canny.cl
+	const size_t groupSize = 256;
+	const size_t pixels = inputBuffer.rows * inputBuffer.cols;
+
+	// worst case every pixel is an edge
+	if (edgeCapacity < pixels)
+	{
+		edgeCount = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+		edgeCoords = cl::Buffer(context, CL_MEM_READ_WRITE, pixels * sizeof(cl_uint2));
+		edgeMagnitude = cl::Buffer(context, CL_MEM_WRITE_ONLY, pixels);
+		edgeDirection = cl::Buffer(context, CL_MEM_WRITE_ONLY, pixels);
+		edgeMasks = cl::Buffer(context, CL_MEM_WRITE_ONLY, pixels);
+		edgeCapacity = pixels;
+	}
+
+	// setThresholds, the packed path and Suppress leave the suppressed
+	// magnitude in PrevBuffer, the edge map has to be traced again; a
+	// frame loaded since runs its stale stages first
+	if (!EvaluateSuppression())
+	{
+		return 0;
+	}
+	if (validStage < CannyStage::Hysteresis)
+	{
+		HysteresisThresholding();
+	}
+
+	static const cl_uint zero = 0;
+	queue.enqueueWriteBuffer(edgeCount, CL_FALSE, 0, sizeof(cl_uint), &zero);
+
+	// after hysteresis the edge map is in PrevBuffer and the NMS result in NextBuffer
+	compactEdgesKernel.setArg(0, PrevBuffer());
+	compactEdgesKernel.setArg(1, NextBuffer());
+	compactEdgesKernel.setArg(2, theta);
+	compactEdgesKernel.setArg(3, edgeCount);
+	compactEdgesKernel.setArg(4, edgeCoords);
+	compactEdgesKernel.setArg(5, edgeMagnitude);
+	compactEdgesKernel.setArg(6, edgeDirection);
+	compactEdgesKernel.setArg(7, (cl_uint)(withAttributes ? 1 : 0));
+	compactEdgesKernel.setArg(8, (size_t)inputBuffer.rows);
+	compactEdgesKernel.setArg(9, (size_t)inputBuffer.cols);
+	compactEdgesKernel.setArg(10, pitch);
+	compactEdgesKernel.setArg(11, originRow);
+	compactEdgesKernel.setArg(12, originCol);
+	compactEdgesKernel.setArg(13, (size_t)(padded ? 0 : 1));
+
+	queue.enqueueNDRangeKernel(
+		compactEdgesKernel,
+		cl::NullRange,
+		cl::NDRange((pixels + groupSize - 1) / groupSize * groupSize),
+		cl::NDRange(groupSize),
+		NULL
+	);
+
+	cl_uint count = 0;
+	queue.enqueueReadBuffer(edgeCount, CL_TRUE, 0, sizeof(cl_uint), &count);
+	return count;
+}
+
+std::vector<EdgePoint> OCLCanny::getEdgeList(bool withAttributes)
+{
+	TRACE_ZONE("OCL getEdgeList");
+
+	cl_uint count = CompactEdges(withAttributes);
+
+	std::vector<cl_uint2> coords(count);
+	std::vector<unsigned char> magnitude, direction;
+
+	if (count > 0)
+	{
+		queue.enqueueReadBuffer(edgeCoords, CL_FALSE, 0, count * sizeof(cl_uint2), coords.data());
+
+		if (withAttributes)
+		{
+			magnitude.resize(count);
+			direction.resize(count);
+			queue.enqueueReadBuffer(edgeMagnitude, CL_FALSE, 0, count, magnitude.data());
+			queue.enqueueReadBuffer(edgeDirection, CL_FALSE, 0, count, direction.data());
+		}
+
+		wait();
+	}
+
+	std::vector<EdgePoint> edges(count);
+	for (cl_uint i = 0; i < count; i++)
+	{
+		edges[i].x = coords[i].s[0];
+		edges[i].y = coords[i].s[1];
+		edges[i].magnitude = withAttributes ? magnitude[i] : 0;
+		edges[i].direction = withAttributes ? direction[i] : 0;
+	}
+
+	return edges;
+}
+
+EdgeChains OCLCanny::getEdgeChains()
+{
+	TRACE_ZONE("OCL getEdgeChains");
+
+	EdgeChains chains;
+	cl_uint count = CompactEdges(false);
+
+	if (count == 0)
+	{
+		return chains;
+	}
+
+	edgeNeighboursKernel.setArg(0, PrevBuffer());
+	edgeNeighboursKernel.setArg(1, edgeCoords);
+	edgeNeighboursKernel.setArg(2, edgeMasks);
+	edgeNeighboursKernel.setArg(3, count);
+	edgeNeighboursKernel.setArg(4, (size_t)inputBuffer.rows);
+	edgeNeighboursKernel.setArg(5, (size_t)inputBuffer.cols);
+	edgeNeighboursKernel.setArg(6, pitch);
+	edgeNeighboursKernel.setArg(7, originRow);
+	edgeNeighboursKernel.setArg(8, originCol);
+	edgeNeighboursKernel.setArg(9, (size_t)(padded ? 0 : 1));
+
+	queue.enqueueNDRangeKernel(
+		edgeNeighboursKernel,
+		cl::NullRange,
+		cl::NDRange((count + 63) / 64 * 64),
+		cl::NullRange,
+		NULL
+	);
+
+	std::vector<cl_uint2> rawCoords(count);
+	std::vector<unsigned char> masks(count);
+	queue.enqueueReadBuffer(edgeCoords, CL_FALSE, 0, count * sizeof(cl_uint2), rawCoords.data());
+	queue.enqueueReadBuffer(edgeMasks, CL_FALSE, 0, count, masks.data());
+	wait();
+
+	std::vector<cv::Point> coords(count);
+	for (cl_uint i = 0; i < count; i++)
+	{
+		coords[i] = cv::Point(rawCoords[i].s[0], rawCoords[i].s[1]);
+	}
+
+	ListEdgeGraph graph(coords, masks, inputBuffer.cols);
+	LinkEdges(graph, chains);
+
+	return chains;
+}
+
+std::vector<HoughLine> OCLCanny::HoughLines(unsigned int threshold, size_t maxLines, int thetaBins, int angleWindow)
+{
+	TRACE_ZONE("OCL HoughLines");
+
+	HoughSpace space(inputBuffer.rows, inputBuffer.cols, thetaBins, angleWindow);
+	size_t accumulatorSize = (size_t)space.thetaBins * space.rhoBins;
+
+	// the coordinates and directions stay on the device
+	cl_uint count = CompactEdges(true);
+
+	if (houghAccumulatorSize < accumulatorSize)
+	{
+		houghAccumulator = cl::Buffer(context, CL_MEM_READ_WRITE, accumulatorSize * sizeof(cl_uint));
+		houghAccumulatorSize = accumulatorSize;
+	}
+
+	// peaks are sorted on the host, so keep more candidates than asked for
+	size_t capacity = std::max<size_t>(maxLines * 16, 1024);
+	if (houghLineCapacity < capacity)
+	{
+		houghLineCount = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+		houghLines = cl::Buffer(context, CL_MEM_WRITE_ONLY, capacity * 4 * sizeof(cl_float));
+		houghLineCapacity = capacity;
+	}
+
+	// the table only depends on the bins, not on the frame size
+	if (houghTrigBins != space.thetaBins)
+	{
+		std::vector<cl_float> trig(2 * space.thetaBins);
+		for (int theta = 0; theta < space.thetaBins; theta++)
+		{
+			trig[2 * theta] = space.cosTable[theta];
+			trig[2 * theta + 1] = space.sinTable[theta];
+		}
+		houghTrig = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, trig.size() * sizeof(cl_float), trig.data());
+		houghTrigBins = space.thetaBins;
+	}
+
+	// size the accumulator tile of each work-group to half the local memory
+	size_t groupSize = std::min<size_t>(256, targetDevice.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+	size_t tileCells = (size_t)targetDevice.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / 2 / sizeof(cl_uint);
+	int rhoTile = (int)std::min<size_t>(space.rhoBins, tileCells);
+	int thetaTile = (int)std::max<size_t>(1, tileCells / rhoTile);
+	int rhoTiles = (space.rhoBins + rhoTile - 1) / rhoTile;
+	int thetaTiles = (space.thetaBins + thetaTile - 1) / thetaTile;
+
+	houghVoteKernel.setArg(0, edgeCoords);
+	houghVoteKernel.setArg(1, edgeDirection);
+	houghVoteKernel.setArg(2, count);
+	houghVoteKernel.setArg(3, houghTrig);
+	houghVoteKernel.setArg(4, houghAccumulator);
+	houghVoteKernel.setArg(5, cl::__local(thetaTile * rhoTile * sizeof(cl_uint)));
+	houghVoteKernel.setArg(6, space.thetaBins);
+	houghVoteKernel.setArg(7, space.rhoBins);
+	houghVoteKernel.setArg(8, space.rhoOffset);
+	houghVoteKernel.setArg(9, space.window);
+	houghVoteKernel.setArg(10, thetaTile);
+	houghVoteKernel.setArg(11, rhoTile);
+
+	queue.enqueueNDRangeKernel(
+		houghVoteKernel,
+		cl::NullRange,
+		cl::NDRange(thetaTiles * rhoTiles * groupSize),
+		cl::NDRange(groupSize),
+		NULL
+	);
+
+	static const cl_uint zero = 0;
+	queue.enqueueWriteBuffer(houghLineCount, CL_FALSE, 0, sizeof(cl_uint), &zero);
+
+	houghPeaksKernel.setArg(0, houghAccumulator);
+	houghPeaksKernel.setArg(1, space.thetaBins);
+	houghPeaksKernel.setArg(2, space.rhoBins);
+	houghPeaksKernel.setArg(3, space.rhoOffset);
+	houghPeaksKernel.setArg(4, (cl_uint)threshold);
+	houghPeaksKernel.setArg(5, houghLineCount);
+	houghPeaksKernel.setArg(6, houghLines);
+	houghPeaksKernel.setArg(7, (cl_uint)capacity);
+
+	queue.enqueueNDRangeKernel(
+		houghPeaksKernel,
+		cl::NullRange,
+		cl::NDRange(space.thetaBins, space.rhoBins),
+		cl::NullRange,
+		NULL
+	);
+
+	cl_uint lineCount = 0;
+	queue.enqueueReadBuffer(houghLineCount, CL_TRUE, 0, sizeof(cl_uint), &lineCount);
+	lineCount = std::min<cl_uint>(lineCount, (cl_uint)capacity);
+
+	std::vector<cl_float> raw(4 * lineCount);
+	if (lineCount > 0)
+	{
+		queue.enqueueReadBuffer(houghLines, CL_TRUE, 0, raw.size() * sizeof(cl_float), raw.data());
+	}
+
+	std::vector<HoughLine> lines(lineCount);
+	for (cl_uint i = 0; i < lineCount; i++)
+	{
+		lines[i].rho = raw[4 * i];
+		lines[i].theta = raw[4 * i + 1];
+		lines[i].votes = (int)raw[4 * i + 2];
+	}
+
+	SortHoughLines(lines, maxLines);
+	return lines;
+}
+
 void OCLCanny::wait()
 {
+	TRACE_ZONE("OCL wait");
+
 	queue.finish();
 }
 
 void OCLCanny::setWorkgroupSize(int size)
 {
 	workgroup_size = size;
+
+	// the pixels per item stay, they do not depend on the group shape
+	LaunchConfig *launches[] = { &gaussianLaunch, &gaussianBGRLaunch, &sobelLaunch, &nonMaximaLaunch, &hysteresisLaunch };
+	for (size_t i = 0; i < sizeof(launches) / sizeof(launches[0]); i++)
+	{
+		launches[i]->localRows = size;
+		launches[i]->localCols = size;
+		launches[i]->microSec = 0.0;
+	}
+}
+
+string OCLCanny::TuningKey() const
+{
+	return getDeviceName() + ", driver " + targetDevice.getInfo<CL_DRIVER_VERSION>();
+}
+
+cl::Kernel OCLCanny::LoadStencilKernel(const string &kernelName, int pixelsPerItem)
+{
+	std::map<int, cl::Program>::iterator built = stencilPrograms.find(pixelsPerItem);
+	if (built == stencilPrograms.end())
+	{
+		cl::Program program;
+		if (!BuildProgram("canny.cl", "-D PIXELS_PER_ITEM=" + std::to_string(pixelsPerItem), program))
+		{
+			return cl::Kernel();
+		}
+		built = stencilPrograms.insert(std::make_pair(pixelsPerItem, program)).first;
+	}
+
+	return CreateKernel(built->second, kernelName.c_str());
+}
+
+void OCLCanny::ApplyLaunch(cl::Kernel &kernel, LaunchConfig &launch, const string &kernelName, const LaunchConfig &config)
+{
+	if (config.pixelsPerItem != launch.pixelsPerItem)
+	{
+		kernel = LoadStencilKernel(kernelName, config.pixelsPerItem);
+	}
+	launch = config;
+}
+
+bool OCLCanny::TuneStage(cl::Kernel &kernel, LaunchConfig &launch, const string &kernelName, void (OCLCanny::*stage)())
+{
+	TRACE_ZONE("OCL TuneStage");
+
+	const int pixelCounts[] = { 1, 2, 4 };
+	const size_t variantCount = sizeof(pixelCounts) / sizeof(pixelCounts[0]);
+
+	// one kernel per pixels per item, the work-group limit can differ
+	// between them; the programs are built once for all stages
+	cl::Kernel variants[variantCount];
+	size_t maxGroupSize = targetDevice.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+	for (size_t v = 0; v < variantCount; v++)
+	{
+		variants[v] = LoadStencilKernel(kernelName, pixelCounts[v]);
+		if (variants[v]() == NULL)
+		{
+			cerr << "Error: unable to tune " << kernelName << endl;
+			return false;
+		}
+		maxGroupSize = min(maxGroupSize, variants[v].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(targetDevice));
+	}
+
+	std::vector<size_t> itemSizes = targetDevice.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+	std::vector<LaunchConfig> candidates = TuningCache::Candidates(maxGroupSize, itemSizes[0], itemSizes[1]);
+
+	cl::Kernel original = kernel;
+	LaunchConfig originalLaunch = launch;
+	LaunchConfig best;
+	size_t bestVariant = 0;
+	bool found = false;
+	int start = buffer_idx;
+	CannyStage startStage = validStage;
+	Timer timer;
+
+	for (size_t c = 0; c < candidates.size(); c++)
+	{
+		size_t v = 0;
+		while (pixelCounts[v] != candidates[c].pixelsPerItem)
+		{
+			v++;
+		}
+
+		kernel = variants[v];
+		launch = candidates[c];
+
+		// a warm-up, then the fastest of three; the stages only write
+		// their output, so every run starts again from the same input
+		double fastest = 0.0;
+		bool failed = false;
+		for (int run = 0; run < 4 && !failed; run++)
+		{
+			buffer_idx = start;
+			launchError = CL_SUCCESS;
+
+			// a shape the device rejects fails at the enqueue, and would
+			// time as the fastest otherwise
+			timer.start();
+			(this->*stage)();
+			failed = queue.finish() != CL_SUCCESS || launchError != CL_SUCCESS;
+			timer.stop();
+
+			double elapsed = timer.getElapsedTimeInMicroSec();
+			if (run == 1 || (run > 1 && elapsed < fastest))
+			{
+				fastest = elapsed;
+			}
+		}
+		buffer_idx = start;
+		validStage = startStage;
+
+		if (!failed && (!found || fastest < best.microSec))
+		{
+			best = candidates[c];
+			best.microSec = fastest;
+			bestVariant = v;
+			found = true;
+		}
+	}
+
+	if (!found)
+	{
+		cerr << "Error: no launch shape of " << kernelName << " ran" << endl;
+		kernel = original;
+		launch = originalLaunch;
+		return false;
+	}
+
+	// the kernel is already built, no need for ApplyLaunch
+	kernel = variants[bestVariant];
+	launch = best;
+	return true;
+}
+
+bool OCLCanny::Autotune(const Mat &sample, const string &cacheFile, bool retune)
+{
+	TRACE_ZONE("OCL Autotune");
+
+	if (queue() == NULL)
+	{
+		cerr << "Error: no OpenCL device to tune" << endl;
+		return false;
+	}
+
+	// entries of other devices are kept even when retuning
+	TuningCache cache(cacheFile);
+	cache.Load();
+	string device = TuningKey();
+
+	Mat image = sample;
+	LoadOCVImage(image);
+
+	struct Stage
+	{
+		cl::Kernel *kernel;
+		LaunchConfig *launch;
+		const char *name;
+		void (OCLCanny::*run)();
+		bool buffers;
+	};
+
+	// Gaussian and Sobel read an image object on the image path, which
+	// keeps its square work-groups
+	const Stage stages[] = {
+		{ bgrInput ? &gaussianBlurBGRKernel : &gaussianBlurKernel, bgrInput ? &gaussianBGRLaunch : &gaussianLaunch,
+			bgrInput ? "gaussian_blur_bgr" : "gaussian_blur", &OCLCanny::Gaussian, !UseImages() },
+		{ &sobelOperatorKernel, &sobelLaunch, "sobel_operation", &OCLCanny::Sobel, !UseImages() },
+		{ &nonMaximaSuppressionKernel, &nonMaximaLaunch, "non_maxima_suppression", &OCLCanny::NonMaximaSuppression, true },
+		{ &hysteresisThresholdingKernel, &hysteresisLaunch, "hysteresis_thresholding", &OCLCanny::HysteresisThresholding, true }
+	};
+
+	bool tuned = false;
+	bool result = true;
+	for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++)
+	{
+		const Stage &stage = stages[i];
+		LaunchConfig config;
+
+		if (!stage.buffers)
+		{
+			// nothing to tune
+		}
+		else if (!retune && cache.find(device, stage.name, config))
+		{
+			ApplyLaunch(*stage.kernel, *stage.launch, stage.name, config);
+		}
+		else if (TuneStage(*stage.kernel, *stage.launch, stage.name, stage.run))
+		{
+			cache.store(device, stage.name, *stage.launch);
+			tuned = true;
+		}
+		else
+		{
+			result = false;
+		}
+
+		// the next stage is tuned on realistic input
+		(this->*stage.run)();
+	}
+	queue.finish();
+
+	if (tuned)
+	{
+		result = cache.Save() && result;
+	}
+	return result;
+}
+
+void OCLCanny::PrintLaunchConfig(std::ostream &out) const
+{
+	const LaunchConfig *launches[] = { &gaussianLaunch, &gaussianBGRLaunch, &sobelLaunch, &nonMaximaLaunch, &hysteresisLaunch };
+	const char *names[] = { "gaussian_blur", "gaussian_blur_bgr", "sobel_operation", "non_maxima_suppression", "hysteresis_thresholding" };
+
+	out << "Launch shapes on " << getDeviceName() << ":" << endl;
+	for (size_t i = 0; i < sizeof(launches) / sizeof(launches[0]); i++)
+	{
+		const LaunchConfig &launch = *launches[i];
+		out << names[i] << ": " << launch.localRows << "x" << launch.localCols << ", "
+			<< launch.pixelsPerItem << " px/item";
+		if (launch.microSec > 0.0)
+		{
+			out << ", " << (int)launch.microSec << "us";
+		}
+		out << endl;
+	}
+}
+
+int OCLCanny::getWorkgroupSize() const
+{
+	return workgroup_size;
+}
+
+void OCLCanny::setThresholds(int low, int high)
+{
+	// the kernels take them as uchar
+	low = ClampThreshold(low);
+	high = ClampThreshold(high);
+	if (low == tLow && high == tHigh)
+	{
+		return;
+	}
+
+	tLow = low;
+	tHigh = high;
+
+	// bring the suppressed magnitude back as the input of hysteresis
+	if (validStage == CannyStage::Hysteresis)
+	{
+		SwapBuffer();
+		validStage = CannyStage::NonMaxima;
+	}
+}
+
+bool OCLCanny::EvaluateSuppression()
+{
+	if (validStage == CannyStage::None)
+	{
+		cerr << "Error: no frame loaded to evaluate" << endl;
+		return false;
+	}
+
+	if (validStage < CannyStage::Gaussian)
+	{
+		Gaussian();
+	}
+	if (validStage < CannyStage::Sobel)
+	{
+		Sobel();
+	}
+	if (validStage < CannyStage::NonMaxima)
+	{
+		NonMaximaSuppression();
+	}
+	return true;
+}
+
+Mat OCLCanny::Evaluate()
+{
+	TRACE_ZONE("OCL Evaluate");
+
+	if (!EvaluateSuppression())
+	{
+		return Mat();
+	}
+
+	if (validStage < CannyStage::Hysteresis)
+	{
+		HysteresisThresholding();
+	}
+
+	return getOutputImage();
+}
+
+Mat OCLCanny::HysteresisSweep(const std::vector<HysteresisThresholds> &thresholds)
+{
+	TRACE_ZONE("OCL HysteresisSweep");
+
+	if (thresholds.empty() || thresholds.size() > 16)
+	{
+		cerr << "Error: a sweep takes 1 to 16 threshold pairs" << endl;
+		return Mat();
+	}
+
+	if (!EvaluateSuppression())
+	{
+		return Mat();
+	}
+
+	bool wide = thresholds.size() > 8;
+	Mat sweep(inputBuffer.rows, inputBuffer.cols, wide ? CV_16UC1 : CV_8UC1);
+	const size_t size = sweep.total() * sweep.elemSize();
+	if (size == 0)
+	{
+		return sweep;
+	}
+
+	cl_uchar pairs[16 * 2];
+	for (size_t k = 0; k < thresholds.size(); k++)
+	{
+		pairs[2 * k] = (cl_uchar)ClampThreshold(thresholds[k].low);
+		pairs[2 * k + 1] = (cl_uchar)ClampThreshold(thresholds[k].high);
+	}
+
+	if (sweepCapacity < size)
+	{
+		// room for the most pairs, so it is only made once
+		if (sweepCapacity == 0)
+		{
+			sweepThresholds = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(pairs));
+			sweepChanged = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+		}
+
+		sweepMasks = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size);
+		sweepCapacity = size;
+	}
+	queue.enqueueWriteBuffer(sweepThresholds, CL_FALSE, 0, thresholds.size() * 2, pairs);
+
+	// after hysteresis the suppressed magnitude is the other buffer
+	cl::Buffer &suppressed = validStage == CannyStage::Hysteresis ? NextBuffer() : PrevBuffer();
+
+	// the pairs each pixel starts an edge for
+	cl::Kernel &seed = wide ? hysteresisSweep16Kernel : hysteresisSweepKernel;
+	seed.setArg(0, suppressed);
+	seed.setArg(1, sweepMasks);
+	seed.setArg(2, sweepThresholds);
+	seed.setArg(3, (cl_uint)thresholds.size());
+	seed.setArg(4, (size_t)inputBuffer.rows);
+	seed.setArg(5, (size_t)inputBuffer.cols);
+	seed.setArg(6, pitch);
+	seed.setArg(7, originRow);
+	seed.setArg(8, originCol);
+
+	queue.enqueueNDRangeKernel(
+		seed,
+		cl::NullRange,
+		cl::NDRange(inputBuffer.rows, inputBuffer.cols),
+		cl::NullRange,
+		NULL
+	);
+
+	// then spread them until a pass changes nothing; a pass settles each
+	// tile, so the passes go by the tiles an edge crosses, not its length
+	cl::Kernel &grow = wide ? hysteresisSweepGrow16Kernel : hysteresisSweepGrowKernel;
+	grow.setArg(0, suppressed);
+	grow.setArg(1, sweepMasks);
+	grow.setArg(2, sweepThresholds);
+	grow.setArg(3, (cl_uint)thresholds.size());
+	grow.setArg(4, (size_t)inputBuffer.rows);
+	grow.setArg(5, (size_t)inputBuffer.cols);
+	grow.setArg(6, pitch);
+	grow.setArg(7, originRow);
+	grow.setArg(8, originCol);
+	grow.setArg(9, (size_t)(padded ? 0 : 1));
+	grow.setArg(10, sweepChanged);
+
+	static const cl_uint zero = 0;
+	cl_uint changed = 1;
+	while (changed)
+	{
+		queue.enqueueWriteBuffer(sweepChanged, CL_FALSE, 0, sizeof(cl_uint), &zero);
+
+		cl_int status = queue.enqueueNDRangeKernel(
+			grow,
+			cl::NullRange,
+			cl::NDRange(RoundUp(inputBuffer.rows, SWEEP_TILE), RoundUp(inputBuffer.cols, SWEEP_TILE)),
+			cl::NDRange(SWEEP_TILE, SWEEP_TILE),
+			NULL
+		);
+		if (status == CL_SUCCESS)
+		{
+			status = queue.enqueueReadBuffer(sweepChanged, CL_TRUE, 0, sizeof(cl_uint), &changed);
+		}
+
+		if (status != CL_SUCCESS)
+		{
+			cerr << "Error: hysteresis sweep failed (" << status << ")" << endl;
+			return Mat();
+		}
+	}
+
+	// in-order queue, the write of the pairs is done before this returns
+	queue.enqueueReadBuffer(sweepMasks, CL_TRUE, 0, size, sweep.data);
+	return sweep;
+}
+
+void OCLCanny::setMemoryPath(MemoryPath path)
+{
+	if (path == MemoryPath::Image && !imageSupport)
+	{
+		cerr << "Error: device has no image support, using buffers" << endl;
+		path = MemoryPath::Buffer;
+	}
+
+	memoryPath = path;
+}
+
+void OCLCanny::LaunchImage(cl::Kernel &kernel)
+{
+	queue.enqueueNDRangeKernel(
+		kernel,
+		cl::NullRange,
+		cl::NDRange(RoundUp(inputBuffer.rows, workgroup_size), RoundUp(inputBuffer.cols, workgroup_size)),
+		cl::NDRange(workgroup_size, workgroup_size),
+		NULL
+	);
+}
+
+void OCLCanny::LaunchStencil(cl::Kernel &kernel, const LaunchConfig &config)
+{
+	// the padded layout has an apron to read, packed rows lose their border
+	int border = padded ? 0 : 1;
+	int rowCount = inputBuffer.rows - 2 * border;
+	int colCount = inputBuffer.cols - 2 * border;
+	if (rowCount <= 0 || colCount <= 0)
+	{
+		return;
+	}
+
+	size_t firstRow = padded ? originRow : 1;
+	size_t firstCol = padded ? originCol : 1;
+	size_t items = (colCount + config.pixelsPerItem - 1) / config.pixelsPerItem;
+
+	// every stencil kernel takes the end of its rows and columns last
+	cl_uint args = kernel.getInfo<CL_KERNEL_NUM_ARGS>();
+	kernel.setArg(args - 2, firstRow + rowCount);
+	kernel.setArg(args - 1, firstCol + colCount);
+
+	cl_int status = queue.enqueueNDRangeKernel(
+		kernel,
+		cl::NDRange(firstRow, firstCol),
+		cl::NDRange(RoundUp(rowCount, config.localRows), RoundUp(items, config.localCols)),
+		cl::NDRange(config.localRows, config.localCols),
+		NULL
+	);
+
+	if (status != CL_SUCCESS && launchError == CL_SUCCESS)
+	{
+		launchError = status;
+	}
+}
+
+void OCLCanny::ReplicateApron(cl::Buffer &buffer)
+{
+	const size_t apron = PaddedImage::APRON;
+
+	// one work item per apron pixel: the rows above and below, then the
+	// columns left and right of every image row
+	size_t count = 2 * apron * (inputBuffer.cols + 2 * apron) + 2 * apron * inputBuffer.rows;
+
+	replicateApronKernel.setArg(0, buffer);
+	replicateApronKernel.setArg(1, (size_t)inputBuffer.rows);
+	replicateApronKernel.setArg(2, (size_t)inputBuffer.cols);
+	replicateApronKernel.setArg(3, pitch);
+	replicateApronKernel.setArg(4, originRow);
+	replicateApronKernel.setArg(5, originCol);
+	replicateApronKernel.setArg(6, apron);
+
+	cl_int status = queue.enqueueNDRangeKernel(
+		replicateApronKernel,
+		cl::NullRange,
+		cl::NDRange(count),
+		cl::NullRange,
+		NULL
+	);
+
+	if (status != CL_SUCCESS && launchError == CL_SUCCESS)
+	{
+		launchError = status;
+	}
 }
 
 void OCLCanny::Gaussian()
 {
+	TRACE_ZONE("OCL Gaussian launch");
+
+	if (UseImages())
+	{
+		gaussianBlurImageKernel.setArg(0, inputImage);
+		gaussianBlurImageKernel.setArg(1, gaussianImage);
+		gaussianBlurImageKernel.setArg(2, (size_t)inputBuffer.rows);
+		gaussianBlurImageKernel.setArg(3, (size_t)inputBuffer.cols);
+
+		LaunchImage(gaussianBlurImageKernel);
+		validStage = CannyStage::Gaussian;
+
+		// the result stays in gaussianImage, buffers are untouched
+		return;
+	}
+
 	try
 	{
+		cl::Kernel &kernel = bgrInput ? gaussianBlurBGRKernel : gaussianBlurKernel;
+
 		// set arguments
-		gaussianBlurKernel.setArg(0, PrevBuffer());
-		gaussianBlurKernel.setArg(1, NextBuffer());
-		gaussianBlurKernel.setArg(2, (size_t)inputBuffer.rows);
-		gaussianBlurKernel.setArg(3, (size_t)inputBuffer.cols);
+		kernel.setArg(0, PrevBuffer());
+		kernel.setArg(1, NextBuffer());
+		kernel.setArg(2, paddedRows);
+		kernel.setArg(3, pitch);
 
 		// enqueue
-		queue.enqueueNDRangeKernel(
-			gaussianBlurKernel,
-			cl::NDRange(1, 1),
-			cl::NDRange(inputBuffer.rows - 2, inputBuffer.cols - 2),
-			cl::NDRange(workgroup_size, workgroup_size),
-			NULL
-		);
-		
+		LaunchStencil(kernel, bgrInput ? gaussianBGRLaunch : gaussianLaunch);
 	}
 	catch (const exception &e)
 	{
@@ -141,81 +1337,264 @@ void OCLCanny::Gaussian()
 
 	// swap the input and ouput
 	SwapBuffer();
+	validStage = CannyStage::Gaussian;
+
+	// Sobel reads one pixel around the blurred image
+	if (padded)
+	{
+		ReplicateApron(PrevBuffer());
+	}
 }
 
 void OCLCanny::Sobel()
 {
-	sobelOperatorKernel.setArg(0, PrevBuffer());
-	sobelOperatorKernel.setArg(1, NextBuffer());
-	sobelOperatorKernel.setArg(2, theta);
-	sobelOperatorKernel.setArg(3, (size_t)inputBuffer.rows);
-	sobelOperatorKernel.setArg(4, (size_t)inputBuffer.cols);
+	TRACE_ZONE("OCL Sobel launch");
 
-	queue.enqueueNDRangeKernel(
-		sobelOperatorKernel,
-		cl::NDRange(1, 1),
-		cl::NDRange(inputBuffer.rows - 2, inputBuffer.cols - 2),
-		cl::NDRange(workgroup_size, workgroup_size),
-		NULL
-	);
+	if (UseImages())
+	{
+		sobelOperatorImageKernel.setArg(0, gaussianImage);
+		sobelOperatorImageKernel.setArg(1, NextBuffer());
+		sobelOperatorImageKernel.setArg(2, theta);
+		sobelOperatorImageKernel.setArg(3, (size_t)inputBuffer.rows);
+		sobelOperatorImageKernel.setArg(4, (size_t)inputBuffer.cols);
+
+		LaunchImage(sobelOperatorImageKernel);
+		histogramCount = 0;
+
+		SwapBuffer();
+		validStage = CannyStage::Sobel;
+		return;
+	}
+
+	if (padded && histogramCellSize > 0)
+	{
+		SobelHistograms();
+	}
+	else
+	{
+		sobelOperatorKernel.setArg(0, PrevBuffer());
+		sobelOperatorKernel.setArg(1, NextBuffer());
+		sobelOperatorKernel.setArg(2, theta);
+		sobelOperatorKernel.setArg(3, paddedRows);
+		sobelOperatorKernel.setArg(4, pitch);
+
+		LaunchStencil(sobelOperatorKernel, sobelLaunch);
+		histogramCount = 0;
+	}
 
 	SwapBuffer();
+	validStage = CannyStage::Sobel;
+
+	// non-maxima suppression compares with the neighbouring magnitudes
+	if (padded)
+	{
+		ReplicateApron(PrevBuffer());
+	}
+}
+
+void OCLCanny::SobelHistograms()
+{
+	size_t cellRows = inputBuffer.rows / histogramCellSize;
+	size_t cellCols = inputBuffer.cols / histogramCellSize;
+	size_t count = cellRows * cellCols * histogramBins;
+
+	// the kernel follows the tuned pixels per item of the plain Sobel
+	if (histogramPixelsPerItem != sobelLaunch.pixelsPerItem)
+	{
+		sobelHistogramKernel = LoadStencilKernel("sobel_operation_histogram", sobelLaunch.pixelsPerItem);
+		histogramPixelsPerItem = sobelLaunch.pixelsPerItem;
+	}
+
+	// a frame smaller than a cell still needs a buffer to pass
+	if (histogramCapacity < max(count, (size_t)1))
+	{
+		histograms = cl::Buffer(context, CL_MEM_READ_WRITE, max(count, (size_t)1) * sizeof(cl_uint));
+		histogramCapacity = max(count, (size_t)1);
+	}
+	if (count > 0)
+	{
+		queue.enqueueFillBuffer(histograms, (cl_uint)0, 0, count * sizeof(cl_uint));
+	}
+
+	sobelHistogramKernel.setArg(0, PrevBuffer());
+	sobelHistogramKernel.setArg(1, NextBuffer());
+	sobelHistogramKernel.setArg(2, theta);
+	sobelHistogramKernel.setArg(3, histograms);
+	sobelHistogramKernel.setArg(4, originRow);
+	sobelHistogramKernel.setArg(5, originCol);
+	sobelHistogramKernel.setArg(6, (cl_uint)histogramCellSize);
+	sobelHistogramKernel.setArg(7, (cl_uint)histogramBins);
+	sobelHistogramKernel.setArg(8, (cl_uint)cellRows);
+	sobelHistogramKernel.setArg(9, (cl_uint)cellCols);
+	sobelHistogramKernel.setArg(10, paddedRows);
+	sobelHistogramKernel.setArg(11, pitch);
+
+	LaunchStencil(sobelHistogramKernel, sobelLaunch);
+	histogramCount = count;
+}
+
+bool OCLCanny::setOrientationHistograms(int cellSize, int bins)
+{
+	if (cellSize < 0 || (cellSize > 0 && (bins < 8 || bins > 18)))
+	{
+		cerr << "Error: orientation histograms take 8 to 18 bins and a positive cell size" << endl;
+		return false;
+	}
+
+	if (cellSize != histogramCellSize || (cellSize > 0 && bins != histogramBins))
+	{
+		histogramCellSize = cellSize;
+		histogramBins = cellSize > 0 ? bins : 0;
+		histogramCount = 0;
+
+		// the next Evaluate runs Sobel again to fill them; only the image
+		// path keeps the blurred frame, the buffers hold later stages by
+		// now and the frame has to go up again
+		if (UseImages())
+		{
+			validStage = min(validStage, CannyStage::Gaussian);
+		}
+		else if (validStage > CannyStage::Input)
+		{
+			Mat frame = inputBuffer;
+			LoadOCVImage(frame);
+		}
+	}
+	return true;
+}
+
+Mat OCLCanny::getOrientationHistograms()
+{
+	if (histogramCount == 0)
+	{
+		return Mat();
+	}
+
+	std::vector<cl_uint> bins(histogramCount);
+	queue.enqueueReadBuffer(histograms, CL_TRUE, 0, histogramCount * sizeof(cl_uint), bins.data());
+
+	int cellRows = inputBuffer.rows / histogramCellSize;
+	Mat result(cellRows, (int)histogramCount / cellRows, CV_32FC1);
+	float *out = (float *)result.data;
+	for (size_t i = 0; i < histogramCount; i++)
+	{
+		out[i] = bins[i] / HISTOGRAM_SCALE;
+	}
+	return result;
 }
 
 void OCLCanny::NonMaximaSuppression()
 {
+	TRACE_ZONE("OCL NonMaximaSuppression launch");
+
 	nonMaximaSuppressionKernel.setArg(0, PrevBuffer());
 	nonMaximaSuppressionKernel.setArg(1, NextBuffer());
 	nonMaximaSuppressionKernel.setArg(2, theta);
-	nonMaximaSuppressionKernel.setArg(3, (size_t)inputBuffer.rows);
-	nonMaximaSuppressionKernel.setArg(4, (size_t)inputBuffer.cols);
+	nonMaximaSuppressionKernel.setArg(3, paddedRows);
+	nonMaximaSuppressionKernel.setArg(4, pitch);
 
-	queue.enqueueNDRangeKernel(
-		nonMaximaSuppressionKernel,
-		cl::NDRange(1, 1),
-		cl::NDRange(inputBuffer.rows - 2, inputBuffer.cols - 2),
-		cl::NDRange(workgroup_size, workgroup_size),
-		NULL
-	);
+	LaunchStencil(nonMaximaSuppressionKernel, nonMaximaLaunch);
 
 	SwapBuffer();
+	validStage = CannyStage::NonMaxima;
 }
 
 void OCLCanny::HysteresisThresholding()
 {
+	TRACE_ZONE("OCL HysteresisThresholding launch");
+
 	hysteresisThresholdingKernel.setArg(0, PrevBuffer());
 	hysteresisThresholdingKernel.setArg(1, NextBuffer());
-	hysteresisThresholdingKernel.setArg(2, (size_t)inputBuffer.rows);
-	hysteresisThresholdingKernel.setArg(3, (size_t)inputBuffer.cols);
+	hysteresisThresholdingKernel.setArg(2, (cl_uchar)tLow);
+	hysteresisThresholdingKernel.setArg(3, (cl_uchar)tHigh);
+	hysteresisThresholdingKernel.setArg(4, paddedRows);
+	hysteresisThresholdingKernel.setArg(5, pitch);
+
+	LaunchStencil(hysteresisThresholdingKernel, hysteresisLaunch);
+
+	// the suppressed magnitude is now NextBuffer, left for re-thresholding
+	SwapBuffer();
+	validStage = CannyStage::Hysteresis;
+}
+
+void OCLCanny::HysteresisThresholdingPacked()
+{
+	TRACE_ZONE("OCL HysteresisThresholdingPacked launch");
+
+	// must match PACK_GROUP_SIZE in canny.cl
+	const size_t groupSize = 256;
+	const size_t wordsPerRow = PackedEdgeMap::WordsPerRow(inputBuffer.cols);
+	const size_t size = inputBuffer.rows * wordsPerRow * sizeof(cl_uint);
+
+	if (size == 0)
+	{
+		return;
+	}
+
+	if (packedCapacity < size)
+	{
+		packedEdges = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, size);
+		packedCapacity = size;
+	}
+
+	// the stencils skip the outermost pixels of packed rows
+	hysteresisPackedKernel.setArg(0, PrevBuffer());
+	hysteresisPackedKernel.setArg(1, packedEdges);
+	hysteresisPackedKernel.setArg(2, (size_t)inputBuffer.rows);
+	hysteresisPackedKernel.setArg(3, (size_t)inputBuffer.cols);
+	hysteresisPackedKernel.setArg(4, pitch);
+	hysteresisPackedKernel.setArg(5, originRow);
+	hysteresisPackedKernel.setArg(6, originCol);
+	hysteresisPackedKernel.setArg(7, (size_t)(padded ? 0 : 1));
+	hysteresisPackedKernel.setArg(8, wordsPerRow);
+	hysteresisPackedKernel.setArg(9, (cl_uchar)tLow);
+	hysteresisPackedKernel.setArg(10, (cl_uchar)tHigh);
 
 	queue.enqueueNDRangeKernel(
-		hysteresisThresholdingKernel,
-		cl::NDRange(1, 1),
-		cl::NDRange(inputBuffer.rows - 2, inputBuffer.cols - 2),
-		cl::NDRange(workgroup_size, workgroup_size),
+		hysteresisPackedKernel,
+		cl::NullRange,
+		cl::NDRange(inputBuffer.rows, RoundUp(wordsPerRow * 32, groupSize)),
+		cl::NDRange(1, groupSize),
 		NULL
 	);
-
-	SwapBuffer();
 }
 
 OCLCanny::~OCLCanny()
 {
 }
 
-cl::Kernel OCLCanny::LoadKernel(string kernelFileName, string kernelName)
+cl::Kernel OCLCanny::CreateKernel(const cl::Program &program, const char *kernelName)
+{
+	cl_int status = CL_SUCCESS;
+	cl::Kernel kernel(program, kernelName, &status);
+	if (status != CL_SUCCESS)
+	{
+		cerr << "Error: no kernel " << kernelName << " in the program, status " << status << endl;
+		return cl::Kernel();
+	}
+
+	return kernel;
+}
+
+bool OCLCanny::BuildProgram(const string &kernelFileName, const string &options, cl::Program &program)
 {
 	// Read from kernel file and create program
 	string oclString = FileToString(kernelFileName);
 	cl::Program::Sources sources(1, std::make_pair(oclString.c_str(), oclString.length()));
-	cl::Program program(context, sources);
+	program = cl::Program(context, sources);
 
 	// use jit compiler to build program for all available targets
-	program.build(allDevices);
+	if (program.build(allDevices, options.c_str()) != CL_SUCCESS)
+	{
+		cerr << "Error: unable to build " << kernelFileName << ":" << endl
+			<< program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(targetDevice) << endl;
+		program = cl::Program();
+		return false;
+	}
 
 	// print build log
 #ifdef DEBUG_PRINT
-	cout << "Building [" << kernelName << "] in [" << kernelFileName << "]"
+	cout << "Building [" << kernelFileName << "] with [" << options << "]"
 		<< endl << "Build Status:\n"
 		<< program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(targetDevice)
 		<< endl << "Build Options:\n"
@@ -224,7 +1603,7 @@ cl::Kernel OCLCanny::LoadKernel(string kernelFileName, string kernelName)
 		<< program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(targetDevice) << endl;
 #endif
 
-	return cl::Kernel(program, kernelName.c_str());
+	return true;
 }
 
 
@@ -1,13 +1,27 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <map>
+#include <iostream>
 #include <CL/cl.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/core/ocl.hpp>
 
-class OCLCanny 
+#include "CannyTypes.h"
+#include "CannyEngine.h"
+#include "TuningCache.h"
+
+class OCLCanny : public CannyEngine
 {
+public:
+	// where the Gaussian and Sobel stages read their input from
+	enum class MemoryPath
+	{
+		Buffer,		// __global uchar*, border pixels are not processed
+		Image		// image2d_t with clamp-to-edge sampler, whole image
+	};
+
 private:
 	// OCL device related
 	std::vector<cl::Platform> allPlatforms;
@@ -21,20 +35,186 @@ private:
 
 	// OCL kernels
 	cl::Kernel gaussianBlurKernel;
+	cl::Kernel gaussianBlurBGRKernel;
 	cl::Kernel sobelOperatorKernel;
 	cl::Kernel nonMaximaSuppressionKernel;
 	cl::Kernel hysteresisThresholdingKernel;
+	cl::Kernel hysteresisPackedKernel;
+	cl::Kernel hysteresisSweepKernel;
+	cl::Kernel hysteresisSweep16Kernel;
+	cl::Kernel hysteresisSweepGrowKernel;
+	cl::Kernel hysteresisSweepGrow16Kernel;
+	cl::Kernel gaussianBlurImageKernel;
+	cl::Kernel sobelOperatorImageKernel;
+	cl::Kernel compactEdgesKernel;
+	cl::Kernel edgeNeighboursKernel;
+	cl::Kernel houghVoteKernel;
+	cl::Kernel houghPeaksKernel;
+
+	// Sobel with orientation histograms, built for the pixels per item of
+	// sobelLaunch; 0 before the first build
+	cl::Kernel sobelHistogramKernel;
+	int histogramPixelsPerItem = 0;
+
+	MemoryPath memoryPath = MemoryPath::Buffer;
+	bool imageSupport = false;
+
+	// the current frame is interleaved BGR, converted inside the Gaussian
+	bool bgrInput = false;
+
+	// hysteresis thresholds, passed to the kernels at every launch
+	int tLow = 50;
+	int tHigh = 80;
 
-	// workgroup size
+	// dirty tracking for Evaluate; the suppressed magnitude stays in a
+	// ping-pong buffer after hysteresis, so re-thresholding starts there
+	CannyStage validStage = CannyStage::None;
+
+	// run the stages up to non-maxima suppression that are out of date,
+	// false without a frame
+	bool EvaluateSuppression();
+
+	// orientation histograms of the Sobel stage, off while the cell size is 0
+	int histogramCellSize = 0;
+	int histogramBins = 0;
+
+	// BGR frames always take the buffer path
+	inline bool UseImages() const
+	{
+		return memoryPath == MemoryPath::Image && !bgrInput;
+	}
+
+	// workgroup size of the image and typed kernels
 	int workgroup_size = 16;
 
-	cl::Kernel LoadKernel(std::string kernelFileName, std::string kernelName);
+	// launch shape of each buffer stencil stage, see Autotune
+	LaunchConfig gaussianLaunch;
+	LaunchConfig gaussianBGRLaunch;
+	LaunchConfig sobelLaunch;
+	LaunchConfig nonMaximaLaunch;
+	LaunchConfig hysteresisLaunch;
+
+	// Device buffer layout. Grey frames on the buffer path use the
+	// PaddedImage layout (rows padded to 64 bytes, replicated apron);
+	// BGR and image frames keep rows packed, pitch == cols.
+	bool padded = false;
+	size_t pitch = 0;
+	size_t paddedRows = 0;
+	size_t originRow = 0;
+	size_t originCol = 0;
+	cl::Kernel replicateApronKernel;
+
+	// whole image when padded, rows/cols 1 ~ n - 2 otherwise; the range
+	// is rounded up to whole work-groups, the kernels skip the overshoot
+	void LaunchStencil(cl::Kernel &kernel, const LaunchConfig &config);
+
+	// first failed enqueue of LaunchStencil or ReplicateApron since it was
+	// last reset to CL_SUCCESS, read by TuneStage
+	cl_int launchError = CL_SUCCESS;
+
+	// canny.cl built once for each pixels per item, the kernels of every
+	// stage and tuning run come from these programs
+	std::map<int, cl::Program> stencilPrograms;
+
+	// canny.cl kernel covering pixelsPerItem columns per work item
+	cl::Kernel LoadStencilKernel(const std::string &kernelName, int pixelsPerItem);
+
+	// switch a stage to config, taking a new kernel if the pixels per
+	// item change
+	void ApplyLaunch(cl::Kernel &kernel, LaunchConfig &launch, const std::string &kernelName, const LaunchConfig &config);
+
+	// time stage with every candidate shape on the current buffers and
+	// keep the fastest; false if none of them ran
+	bool TuneStage(cl::Kernel &kernel, LaunchConfig &launch, const std::string &kernelName, void (OCLCanny::*stage)());
+
+	// device name and driver version, the key of the tuning cache
+	std::string TuningKey() const;
+
+	// fill the apron of a padded buffer from its border pixels
+	void ReplicateApron(cl::Buffer &buffer);
+
+	// the image part of a device buffer into a packed CV_8UC1 image
+	void ReadImage(cl::Buffer &buffer, cv::Mat &output);
+
+	// compile a kernel file, printing the build log on failure
+	bool BuildProgram(const std::string &kernelFileName, const std::string &options, cl::Program &program);
+
+	// one kernel of a built program, empty if it is not there
+	cl::Kernel CreateKernel(const cl::Program &program, const char *kernelName);
+
+	void Initialize(const cl::Device &device);
+	bool initialized = false;
+
+	// canny_typed.cl built for the depth of the last typed frame, -1 before
+	int typedDepth = -1;
+	cl::Kernel gaussianBlurTypedKernel;
+	cl::Kernel sobelOperatorTypedKernel;
+	cl::Kernel nonMaximaSuppressionTypedKernel;
+	cl::Kernel hysteresisThresholdingTypedKernel;
+
+	// input and blurred pixels, magnitude and suppressed magnitude; the
+	// typed path leaves the 8 bit buffers alone
+	cl::Buffer typedPixels[2];
+	cl::Buffer typedGradient[2];
+	cl::Buffer typedTheta;
+	cl::Buffer typedEdges;
+
+	bool LoadTypedKernels(int depth);
 
 	// buffers
 	int buffer_idx = 0;
 	cl::Buffer buffers[2];
 	cl::Buffer theta;
 
+	// input and blurred image for the image path
+	cl::Image2D inputImage;
+	cl::Image2D gaussianImage;
+
+	// sparse edge list, allocated on first use
+	cl::Buffer edgeCount;
+	cl::Buffer edgeCoords;
+	cl::Buffer edgeMagnitude;
+	cl::Buffer edgeDirection;
+	cl::Buffer edgeMasks;
+	size_t edgeCapacity = 0;
+
+	// bit per pixel edge map, reallocated when it grows
+	cl::Buffer packedEdges;
+	size_t packedCapacity = 0;
+
+	// threshold pairs and bit masks of HysteresisSweep, and the flag its
+	// growing passes set while bits still spread
+	cl::Buffer sweepThresholds;
+	cl::Buffer sweepMasks;
+	cl::Buffer sweepChanged;
+	size_t sweepCapacity = 0;
+
+	// fixed-point bins of the last Sobel, histogramCount is 0 when that
+	// Sobel did not count them
+	cl::Buffer histograms;
+	size_t histogramCapacity = 0;
+	size_t histogramCount = 0;
+
+	// the Sobel stage that also adds every gradient to its cell's bin
+	void SobelHistograms();
+
+	// Hough accumulator and line list, reallocated when they grow, and
+	// the cos/sin table, rebuilt when the number of theta bins changes
+	cl::Buffer houghAccumulator;
+	cl::Buffer houghTrig;
+	cl::Buffer houghLineCount;
+	cl::Buffer houghLines;
+	size_t houghAccumulatorSize = 0;
+	size_t houghLineCapacity = 0;
+	int houghTrigBins = 0;
+
+	// run compact_edges and return the number of edges, tracing the edge
+	// map first if it is stale
+	cl_uint CompactEdges(bool withAttributes);
+
+	// whole image in square work-groups of workgroup_size, rounded up
+	void LaunchImage(cl::Kernel &kernel);
+
 	// buffer operations
 	inline cl::Buffer &NextBuffer()
 	{
@@ -56,20 +236,115 @@ private:
 
 
 public:
+	// first GPU found on any platform, otherwise the first device of any type
 	OCLCanny();
+
+	// own context and queue on the given (sub-)device
+	OCLCanny(const cl::Device &device);
+
+	// devices of every platform; CPU devices can optionally be partitioned
+	// into sub-devices, one per NUMA node or of unitsPerSubDevice compute units
+	static std::vector<cl::Device> GetDevices(cl_device_type type, bool splitNUMA = false, int unitsPerSubDevice = 0);
+
+	std::string getDeviceName() const;
+
+	// the context exists and canny.cl built; false means every launch
+	// would fail, e.g. a driver that cannot compile the kernels
+	bool isInitialized() const;
+
+	// "OCL " and the device name
+	std::string getName() const;
+
+	// the context and kernels are reused, buffers follow the frame size
+	void Process(const cv::Mat &input, cv::Mat &edges);
+
+	// like Process, but only a bit per pixel is written and read back
+	void ProcessPacked(const cv::Mat &input, PackedEdgeMap &edges);
+	void Suppress(const cv::Mat &input, cv::Mat &suppressed);
+
+	// all stages on a CV_16UC1 or CV_32FC1 frame as is, gradients in float;
+	// the thresholds are in units of the input, edges is CV_8UC1
+	void ProcessTyped(const cv::Mat &input, cv::Mat &edges, float tLow, float tHigh);
+
+	// grey or 3 channel BGR; BGR is uploaded as is and converted to luma
+	// by the Gaussian, so no grey copy is made on the host
 	void LoadOCVImage(cv::Mat &rawImage);
 
 	cv::Mat getOutputImage();
 
+	// read the edge map straight into a caller-provided CV_8UC1 image
+	void getOutputImage(cv::Mat &output);
+
+	// the edge map of the last HysteresisThresholdingPacked
+	void getPackedOutput(PackedEdgeMap &output);
+
+	// compact the edge pixels on the device and read back only those,
+	// optionally with their magnitude and direction
+	std::vector<EdgePoint> getEdgeList(bool withAttributes = false);
+
+	// link the compacted edges into chains; only the list and one
+	// neighbour mask per edge are read back
+	EdgeChains getEdgeChains();
+
+	// vote and find peaks on the device, only the peak lines are read back
+	std::vector<HoughLine> HoughLines(unsigned int threshold, size_t maxLines = 64, int thetaBins = 180, int angleWindow = 25);
+
 	void wait();
 
+	// square work-groups for every stage, replaces tuned shapes
 	void setWorkgroupSize(int size);
+	int getWorkgroupSize() const;
+
+	// Sweep work-group shapes and pixels per work item for each buffer
+	// stage on frames like sample (grey or BGR) and keep the fastest.
+	// Results are stored per device in cacheFile and read back on later
+	// runs instead of sweeping again, unless retune is set.
+	bool Autotune(const cv::Mat &sample, const std::string &cacheFile = "canny_tuning.txt", bool retune = false);
+
+	void PrintLaunchConfig(std::ostream &out) const;
+
+	// takes effect on the next HysteresisThresholding; only that stage
+	// is stale afterwards. Clamped to 0..255, the kernels take uchar.
+	void setThresholds(int low, int high);
+
+	// edge map of the loaded frame with the current thresholds, launching
+	// only the stages that are out of date: after setThresholds on the
+	// same frame that is hysteresis alone, on the suppressed magnitude
+	// still on the device, and the read back
+	cv::Mat Evaluate();
+
+	// hysteresis for up to 16 threshold pairs from one read of the
+	// suppressed magnitude on the device (stale stages run first, as for
+	// Evaluate). Bit k of each pixel is the edge map of thresholds[k], see
+	// SweepEdges; CV_8UC1 for up to 8 pairs, CV_16UC1 above. Edges are
+	// traced from the strong pixels as CPUCanny::HysteresisSweep does, so
+	// unlike HysteresisThresholding, whose rule looks at each pixel alone,
+	// bit k matches CPUCanny's Process at thresholds[k] and not this one.
+	cv::Mat HysteresisSweep(const std::vector<HysteresisThresholds> &thresholds);
+
+	// Accumulate orientation histograms in the Sobel pass from now on,
+	// as CPUCanny::setOrientationHistograms. They are only counted for
+	// grey frames on the buffer path; the others have no border pixels
+	// or no padded layout to count them in.
+	bool setOrientationHistograms(int cellSize, int bins);
+
+	// histograms of the last Sobel, CV_32FC1 with a row per row of cells
+	// and the bins of each cell side by side; empty if it had none
+	cv::Mat getOrientationHistograms();
+
+	// takes effect on the next LoadOCVImage
+	void setMemoryPath(MemoryPath path);
 
 	void Gaussian();
 	void Sobel();
 	void NonMaximaSuppression();
 	void HysteresisThresholding();
 
+	// thresholds the suppressed magnitude into a bit per pixel map; the
+	// byte buffers are left as they are, so getOutputImage and the edge
+	// list still need HysteresisThresholding
+	void HysteresisThresholdingPacked();
+
 	~OCLCanny();
 };
 
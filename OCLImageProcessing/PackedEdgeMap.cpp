@@ -0,0 +1,112 @@
+#include "PackedEdgeMap.h"
+#include <bitset>
+#include <algorithm>
+#include <cassert>
+
+using cv::Mat;
+
+
+int PackedEdgeMap::WordsPerRow(int cols)
+{
+	return (cols + 31) / 32;
+}
+
+void PackedEdgeMap::create(int rows, int cols)
+{
+	this->rows = rows;
+	this->cols = cols;
+	wordsPerRow = WordsPerRow(cols);
+	words.assign((size_t)rows * wordsPerRow, 0);
+	unpackedValid = false;
+}
+
+void PackedEdgeMap::Pack(const Mat &edges)
+{
+	assert(edges.type() == CV_8UC1);
+
+	create(edges.rows, edges.cols);
+
+	for (int row = 0; row < rows; row++)
+	{
+		const unsigned char *in = edges.ptr<unsigned char>(row);
+		uint32_t *out = &words[(size_t)row * wordsPerRow];
+
+		for (int word = 0; word < wordsPerRow; word++)
+		{
+			int first = word * 32;
+			int count = std::min(32, cols - first);
+			uint32_t bits = 0;
+
+			for (int bit = 0; bit < count; bit++)
+			{
+				bits |= (uint32_t)(in[first + bit] != 0) << bit;
+			}
+			out[word] = bits;
+		}
+	}
+}
+
+uint32_t *PackedEdgeMap::data()
+{
+	unpackedValid = false;
+	return words.data();
+}
+
+const uint32_t *PackedEdgeMap::data() const
+{
+	return words.data();
+}
+
+int PackedEdgeMap::getRows() const
+{
+	return rows;
+}
+
+int PackedEdgeMap::getCols() const
+{
+	return cols;
+}
+
+int PackedEdgeMap::getWordsPerRow() const
+{
+	return wordsPerRow;
+}
+
+size_t PackedEdgeMap::getSizeInBytes() const
+{
+	return words.size() * sizeof(uint32_t);
+}
+
+size_t PackedEdgeMap::countEdges() const
+{
+	// bits past the last column are never set
+	size_t count = 0;
+	for (size_t i = 0; i < words.size(); i++)
+	{
+		count += std::bitset<32>(words[i]).count();
+	}
+	return count;
+}
+
+const Mat &PackedEdgeMap::getMat() const
+{
+	if (unpackedValid)
+	{
+		return unpacked;
+	}
+
+	unpacked.create(rows, cols, CV_8UC1);
+	for (int row = 0; row < rows; row++)
+	{
+		const uint32_t *in = &words[(size_t)row * wordsPerRow];
+		unsigned char *out = unpacked.ptr<unsigned char>(row);
+
+		for (int col = 0; col < cols; col++)
+		{
+			out[col] = ((in[col / 32] >> (col % 32)) & 1) ? 255 : 0;
+		}
+	}
+
+	unpackedValid = true;
+	return unpacked;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <opencv2/imgproc/imgproc.hpp>
+
+// Binary edge map at one bit per pixel, an eighth of the 0/255 byte
+// image, for readback and for storing results. Pixel (row, col) is bit
+// col % 32 of word col / 32 of its row and every row starts on a new
+// word; hysteresis_thresholding_packed in canny.cl writes the same layout.
+class PackedEdgeMap
+{
+private:
+	std::vector<uint32_t> words;
+	int rows = 0;
+	int cols = 0;
+	int wordsPerRow = 0;
+
+	// CV_8UC1 0/255 copy, made on the first getMat after a change
+	mutable cv::Mat unpacked;
+	mutable bool unpackedValid = false;
+
+public:
+	static int WordsPerRow(int cols);
+
+	// all pixels cleared
+	void create(int rows, int cols);
+
+	// from a CV_8UC1 image, every non-zero pixel is an edge
+	void Pack(const cv::Mat &edges);
+
+	// raw words, row after row; writing through them invalidates getMat
+	uint32_t *data();
+	const uint32_t *data() const;
+
+	inline bool at(int row, int col) const
+	{
+		return (words[(size_t)row * wordsPerRow + col / 32] >> (col % 32)) & 1;
+	}
+
+	int getRows() const;
+	int getCols() const;
+	int getWordsPerRow() const;
+	size_t getSizeInBytes() const;
+
+	// number of edge pixels, a popcount per word
+	size_t countEdges() const;
+
+	// unpacked CV_8UC1 0/255 image, kept until the bits change
+	const cv::Mat &getMat() const;
+};
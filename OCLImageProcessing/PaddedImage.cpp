@@ -0,0 +1,94 @@
+#include "PaddedImage.h"
+#include "CannyStages.h"
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+
+using cv::Mat;
+
+
+int PaddedImage::OriginCol(int apron)
+{
+	return (apron + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+size_t PaddedImage::Stride(int cols, int apron)
+{
+	size_t bytes = OriginCol(apron) + cols + apron;
+	return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+void PaddedImage::create(int rows, int cols, int apron)
+{
+	this->rows = rows;
+	this->cols = cols;
+	this->apron = apron;
+	stride = Stride(cols, apron);
+
+	// one extra line to align the first row
+	size_t bytes = stride * (rows + 2 * apron) + ALIGNMENT;
+	if (storage.size() < bytes)
+	{
+		storage.resize(bytes);
+	}
+
+	uintptr_t base = (uintptr_t)storage.data();
+	unsigned char *aligned = storage.data() + ((ALIGNMENT - base % ALIGNMENT) % ALIGNMENT);
+	origin = aligned + apron * stride + OriginCol(apron);
+}
+
+void PaddedImage::Load(const Mat &image, int apron)
+{
+	assert(image.type() == CV_8UC1 || image.type() == CV_8UC3);
+
+	create(image.rows, image.cols, apron);
+
+	for (int row = 0; row < rows; row++)
+	{
+		const unsigned char *src = image.ptr(row);
+		unsigned char *dst = ptr(row);
+
+		if (image.channels() == 3)
+		{
+			// converted while copying, no separate grey image
+			for (int col = 0; col < cols; col++)
+			{
+				dst[col] = BGRLuma(src + 3 * col);
+			}
+		}
+		else
+		{
+			memcpy(dst, src, cols);
+		}
+	}
+
+	ReplicateBorder();
+}
+
+void PaddedImage::ReplicateBorder()
+{
+	if (rows == 0 || cols == 0)
+	{
+		return;
+	}
+
+	// left and right of every interior row
+	for (int row = 0; row < rows; row++)
+	{
+		unsigned char *line = ptr(row);
+		memset(line - apron, line[0], apron);
+		memset(line + cols, line[cols - 1], apron);
+	}
+
+	// whole padded rows above and below, corners included
+	for (int row = 1; row <= apron; row++)
+	{
+		memcpy(ptr(-row) - apron, ptr(0) - apron, cols + 2 * apron);
+		memcpy(ptr(rows - 1 + row) - apron, ptr(rows - 1) - apron, cols + 2 * apron);
+	}
+}
+
+Mat PaddedImage::getMat() const
+{
+	return Mat(rows, cols, CV_8UC1, (void *)origin, stride);
+}
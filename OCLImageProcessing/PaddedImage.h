@@ -0,0 +1,73 @@
+#pragma once
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+// Image with a padded row stride and a replicated border apron, so that
+// stencils can run over every pixel without border branches:
+//
+//   +-----------------------------+
+//   |         apron rows          |
+//   |   +---------------------+   |
+//   |   | rows x cols, every  |   | <- stride, a multiple of ALIGNMENT
+//   |   | row ALIGNMENT bytes |   |
+//   |   | aligned             |   |
+//   |   +---------------------+   |
+//   |         apron rows          |
+//   +-----------------------------+
+//
+// ptr(row) points at column 0 of a row; columns -apron ~ cols + apron - 1
+// and rows -apron ~ rows + apron - 1 may be read. The OpenCL buffers use
+// the same layout, see Stride() and OriginCol().
+class PaddedImage
+{
+public:
+	static const int ALIGNMENT = 64;
+
+	// reach of the largest stencil; the Gaussian reads 1 pixel up/left
+	// and 3 down/right of its output pixel
+	static const int APRON = 3;
+
+private:
+	std::vector<unsigned char> storage;
+	unsigned char *origin = NULL;
+	int rows = 0;
+	int cols = 0;
+	int apron = 0;
+	size_t stride = 0;
+
+public:
+	// columns in front of column 0, enough for the apron and keeping
+	// column 0 aligned
+	static int OriginCol(int apron);
+
+	// bytes per row for at least cols + apron pixels after OriginCol
+	static size_t Stride(int cols, int apron);
+
+	// keeps the allocation if it is large enough already
+	void create(int rows, int cols, int apron = APRON);
+
+	// copy a CV_8UC1 image, or the luma of a CV_8UC3 BGR image, into the
+	// interior and replicate its border into the apron
+	void Load(const cv::Mat &image, int apron = APRON);
+
+	// fill the apron with the nearest interior pixel
+	void ReplicateBorder();
+
+	inline unsigned char *ptr(int row)
+	{
+		return origin + row * (ptrdiff_t)stride;
+	}
+
+	inline const unsigned char *ptr(int row) const
+	{
+		return origin + row * (ptrdiff_t)stride;
+	}
+
+	size_t getStride() const
+	{
+		return stride;
+	}
+
+	// the interior as a CV_8UC1 header, no copy
+	cv::Mat getMat() const;
+};
@@ -0,0 +1,243 @@
+#include "PerfCounters.h"
+#include <cstring>
+#include <iomanip>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+using std::string;
+using std::vector;
+using std::ostream;
+using std::endl;
+
+
+#ifdef __linux__
+static int OpenCounter(unsigned int type, unsigned long long config, int groupFd)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = groupFd < 0 ? 1 : 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	// this thread, any CPU
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+static unsigned long long CacheMiss(unsigned long long cache)
+{
+	return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+#endif
+
+PerfCounters::PerfCounters()
+{
+	for (int i = 0; i < COUNTER_COUNT; i++)
+	{
+		fds[i] = -1;
+		readIndex[i] = -1;
+	}
+
+#ifdef __linux__
+	fds[CYCLES] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+	if (fds[CYCLES] < 0)
+	{
+		unavailableReason = string("perf_event_open: ") + strerror(errno);
+		return;
+	}
+
+	fds[INSTRUCTIONS] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, fds[CYCLES]);
+	fds[LLC_MISSES] = OpenCounter(PERF_TYPE_HW_CACHE, CacheMiss(PERF_COUNT_HW_CACHE_LL), fds[CYCLES]);
+	fds[BRANCH_MISSES] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, fds[CYCLES]);
+	fds[L1D_MISSES] = OpenCounter(PERF_TYPE_HW_CACHE, CacheMiss(PERF_COUNT_HW_CACHE_L1D), fds[CYCLES]);
+
+	// a group read lists the members in the order they were opened
+	for (int i = 0; i < COUNTER_COUNT; i++)
+	{
+		if (fds[i] >= 0)
+		{
+			readIndex[i] = openCount++;
+		}
+	}
+#else
+	unavailableReason = "hardware counters are only read on Linux";
+#endif
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+	for (int i = COUNTER_COUNT - 1; i >= 0; i--)
+	{
+		if (fds[i] >= 0)
+		{
+			close(fds[i]);
+		}
+	}
+#endif
+}
+
+bool PerfCounters::isAvailable() const
+{
+	return fds[CYCLES] >= 0;
+}
+
+void PerfCounters::Begin()
+{
+#ifdef __linux__
+	if (isAvailable())
+	{
+		ioctl(fds[CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(fds[CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+#endif
+}
+
+bool PerfCounters::Read(unsigned long long values[COUNTER_COUNT], bool counted[COUNTER_COUNT])
+{
+#ifdef __linux__
+	// nr, time enabled, time running, then one value per member
+	unsigned long long buffer[3 + COUNTER_COUNT];
+
+	ioctl(fds[CYCLES], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	ssize_t bytes = read(fds[CYCLES], buffer, sizeof(buffer));
+	if (bytes < (ssize_t)(3 * sizeof(buffer[0])) || buffer[0] != (unsigned long long)openCount)
+	{
+		return false;
+	}
+
+	// the group never got onto the PMU, e.g. too many other users
+	unsigned long long enabled = buffer[1];
+	unsigned long long running = buffer[2];
+	if (running == 0)
+	{
+		return false;
+	}
+
+	// scale up if the group was multiplexed with other events
+	double scale = (double)enabled / running;
+
+	for (int i = 0; i < COUNTER_COUNT; i++)
+	{
+		counted[i] = readIndex[i] >= 0;
+		values[i] = counted[i] ? (unsigned long long)(buffer[3 + readIndex[i]] * scale) : 0;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+void PerfCounters::End(const char *stage, size_t pixels)
+{
+	unsigned long long values[COUNTER_COUNT];
+	bool counted[COUNTER_COUNT];
+
+	if (!isAvailable() || !Read(values, counted))
+	{
+		return;
+	}
+
+	StageTotals *totals = NULL;
+	for (size_t i = 0; i < stages.size(); i++)
+	{
+		if (stages[i].name == stage)
+		{
+			totals = &stages[i];
+		}
+	}
+
+	if (!totals)
+	{
+		StageTotals added;
+		added.name = stage;
+		memset(added.values, 0, sizeof(added.values));
+		memcpy(added.counted, counted, sizeof(added.counted));
+		added.pixels = 0;
+		added.runs = 0;
+		stages.push_back(added);
+		totals = &stages.back();
+	}
+
+	for (int i = 0; i < COUNTER_COUNT; i++)
+	{
+		totals->values[i] += values[i];
+	}
+	totals->pixels += pixels;
+	totals->runs++;
+}
+
+void PerfCounters::Reset()
+{
+	stages.clear();
+}
+
+void PerfCounters::Print(ostream &out) const
+{
+	if (!isAvailable())
+	{
+		out << "Performance counters unavailable (" << unavailableReason << ")" << endl;
+		return;
+	}
+
+	const int width = 12;
+
+	out << std::left << std::setw(26) << "Stage"
+		<< std::right << std::setw(width) << "IPC"
+		<< std::setw(width) << "DRAM B/px"
+		<< std::setw(width) << "LLC m/px"
+		<< std::setw(width) << "L1D m/px"
+		<< std::setw(width) << "Br m/px" << endl;
+
+	for (size_t i = 0; i < stages.size(); i++)
+	{
+		const StageTotals &stage = stages[i];
+		double pixels = (double)(stage.pixels ? stage.pixels : 1);
+
+		out << std::left << std::setw(26) << stage.name << std::right << std::fixed << std::setprecision(3);
+
+		if (stage.counted[INSTRUCTIONS] && stage.values[CYCLES])
+		{
+			out << std::setw(width) << (double)stage.values[INSTRUCTIONS] / stage.values[CYCLES];
+		}
+		else
+		{
+			out << std::setw(width) << "n/a";
+		}
+
+		// every last level miss is one cache line from memory
+		if (stage.counted[LLC_MISSES])
+		{
+			out << std::setw(width) << stage.values[LLC_MISSES] * 64.0 / pixels;
+		}
+		else
+		{
+			out << std::setw(width) << "n/a";
+		}
+
+		const Counter perPixel[3] = { LLC_MISSES, L1D_MISSES, BRANCH_MISSES };
+		for (int c = 0; c < 3; c++)
+		{
+			if (stage.counted[perPixel[c]])
+			{
+				out << std::setw(width) << stage.values[perPixel[c]] / pixels;
+			}
+			else
+			{
+				out << std::setw(width) << "n/a";
+			}
+		}
+
+		out << endl;
+	}
+}
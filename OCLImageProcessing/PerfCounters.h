@@ -0,0 +1,95 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <iostream>
+
+// Hardware counters per pipeline stage, read through perf_event_open on
+// Linux. The counters are opened as one group on the calling thread, so
+// they only see stages that run on the thread that created them.
+//
+// Counters the CPU or the kernel does not offer (containers, VMs,
+// perf_event_paranoid, other platforms) are left out and reported as
+// n/a, the stages run as usual either way.
+class PerfCounters
+{
+public:
+	enum Counter
+	{
+		CYCLES,
+		INSTRUCTIONS,
+		LLC_MISSES,
+		BRANCH_MISSES,
+		L1D_MISSES,
+		COUNTER_COUNT
+	};
+
+private:
+	struct StageTotals
+	{
+		std::string name;
+		unsigned long long values[COUNTER_COUNT];
+		bool counted[COUNTER_COUNT];
+		unsigned long long pixels;
+		int runs;
+	};
+
+	// -1 where a counter could not be opened, CYCLES leads the group
+	int fds[COUNTER_COUNT];
+
+	// position of each open counter in a group read
+	int readIndex[COUNTER_COUNT];
+	int openCount = 0;
+
+	std::string unavailableReason;
+	std::vector<StageTotals> stages;
+
+	bool Read(unsigned long long values[COUNTER_COUNT], bool counted[COUNTER_COUNT]);
+
+public:
+	PerfCounters();
+	~PerfCounters();
+
+	PerfCounters(const PerfCounters &) = delete;
+	PerfCounters &operator=(const PerfCounters &) = delete;
+
+	bool isAvailable() const;
+
+	// count from now until End
+	void Begin();
+
+	// add what was counted since Begin to the named stage
+	void End(const char *stage, size_t pixels);
+
+	void Reset();
+
+	// IPC, estimated DRAM bytes per pixel (LLC misses of 64 byte lines)
+	// and misses per pixel for every stage, in the order first seen
+	void Print(std::ostream &out) const;
+};
+
+// counts its own lifetime as one run of a stage, does nothing without counters
+class PerfScope
+{
+private:
+	PerfCounters *counters;
+	const char *stage;
+	size_t pixels;
+
+public:
+	PerfScope(PerfCounters *counters, const char *stage, size_t pixels)
+		: counters(counters), stage(stage), pixels(pixels)
+	{
+		if (counters)
+		{
+			counters->Begin();
+		}
+	}
+
+	~PerfScope()
+	{
+		if (counters)
+		{
+			counters->End(stage, pixels);
+		}
+	}
+};
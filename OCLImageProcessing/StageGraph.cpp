@@ -0,0 +1,712 @@
+#include "StageGraph.h"
+#include "CPUCanny.h"
+#include "OCLCanny.h"
+#include "utils.h"
+#include <set>
+#include <sstream>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+
+using std::string;
+using std::vector;
+using std::map;
+using std::set;
+using std::min;
+using std::max;
+using std::cerr;
+using std::endl;
+using std::ostream;
+using std::ostringstream;
+using std::exception;
+using cv::Mat;
+
+
+// zero the pixels a stage does not write
+static void ClearBorder(unsigned char *image, int rows, int cols, int border)
+{
+	if (border <= 0)
+	{
+		return;
+	}
+
+	border = min(border, min(rows, cols));
+
+	memset(image, 0x00, border * cols);
+	memset(image + (rows - border) * cols, 0x00, border * cols);
+
+	for (int row = border; row < rows - border; row++)
+	{
+		memset(image + row * cols, 0x00, border);
+		memset(image + row * cols + cols - border, 0x00, border);
+	}
+}
+
+StageGraph::StageGraph(const string &input)
+	: input(input)
+{
+}
+
+StageGraph::~StageGraph()
+{
+}
+
+void StageGraph::AddStage(const Stage &stage)
+{
+	stages.push_back(stage);
+	compiled = false;
+}
+
+void StageGraph::SetOutput(const string &name)
+{
+	requestedOutput = name;
+	compiled = false;
+}
+
+void StageGraph::setBlockRows(int rows)
+{
+	blockRows = max(1, rows);
+}
+
+Stage StageGraph::Pointwise(const string &name, const string &input, const string &output,
+	std::function<unsigned char(unsigned char)> pixel, const string &expression)
+{
+	Stage stage;
+	stage.name = name;
+	stage.inputs.push_back(input);
+	stage.outputs.push_back(output);
+	stage.pixel = pixel;
+	stage.expression = expression;
+	return stage;
+}
+
+bool StageGraph::Compile()
+{
+	set<string> produced;
+	produced.insert(input);
+
+	for (size_t i = 0; i < stages.size(); i++)
+	{
+		const Stage &stage = stages[i];
+
+		for (size_t j = 0; j < stage.inputs.size(); j++)
+		{
+			if (!produced.count(stage.inputs[j]))
+			{
+				cerr << "Error: stage " << stage.name << " reads " << stage.inputs[j] << " before it is written" << endl;
+				return false;
+			}
+		}
+
+		for (size_t j = 0; j < stage.outputs.size(); j++)
+		{
+			if (!produced.insert(stage.outputs[j]).second)
+			{
+				cerr << "Error: stage " << stage.name << " writes " << stage.outputs[j] << " a second time" << endl;
+				return false;
+			}
+		}
+
+		if (stage.pixel && (stage.inputs.size() != 1 || stage.outputs.size() != 1 || stage.radius != 0))
+		{
+			cerr << "Error: pointwise stage " << stage.name << " needs one input, one output and radius 0" << endl;
+			return false;
+		}
+
+		if (!stage.pixel && !stage.cpu && stage.kernelName.empty())
+		{
+			cerr << "Error: stage " << stage.name << " has no implementation" << endl;
+			return false;
+		}
+	}
+
+	// resolved on every compile, stages may have been added since
+	output = requestedOutput;
+	if (output.empty() && !stages.empty())
+	{
+		output = stages.back().outputs.front();
+	}
+
+	if (!produced.count(output) || output == input)
+	{
+		cerr << "Error: graph output " << output << " is never written" << endl;
+		return false;
+	}
+
+	Fuse();
+
+	// OpenCL steps run one after another, CPU steps overlap in strips
+	// until a global step, so lifetimes only end at a global step there
+	vector<int> oclTimes(steps.size());
+	vector<int> cpuTimes(steps.size());
+	int segment = 0;
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		oclTimes[i] = (int)i;
+		if (steps[i].radius == Stage::GLOBAL)
+		{
+			segment++;
+		}
+		cpuTimes[i] = segment;
+		steps[i].segment = segment;
+	}
+
+	// the caller's image is never written, the device copy may be
+	cpuPlan = PlanBuffers(cpuTimes, false);
+	oclPlan = PlanBuffers(oclTimes, true);
+
+	cpuSlots.clear();
+	ocl.reset();
+	compiled = true;
+	return true;
+}
+
+void StageGraph::Fuse()
+{
+	// how often each buffer is read
+	map<string, int> readers;
+	for (size_t i = 0; i < stages.size(); i++)
+	{
+		for (size_t j = 0; j < stages[i].inputs.size(); j++)
+		{
+			readers[stages[i].inputs[j]]++;
+		}
+	}
+
+	steps.clear();
+
+	for (size_t i = 0; i < stages.size(); i++)
+	{
+		const Stage &stage = stages[i];
+
+		// extend the previous pointwise step if it is the only reader of
+		// what it writes, the buffer in between then disappears
+		if (stage.pixel && !steps.empty())
+		{
+			Step &previous = steps.back();
+			const string &between = previous.outputs.front();
+
+			if (previous.pointwise && between == stage.inputs.front() && readers[between] == 1 && between != output)
+			{
+				for (int v = 0; v < 256; v++)
+				{
+					previous.lut[v] = stage.pixel(previous.lut[v]);
+				}
+				previous.stages.push_back((int)i);
+				previous.outputs = stage.outputs;
+				continue;
+			}
+		}
+
+		Step step;
+		step.stages.push_back((int)i);
+		step.inputs = stage.inputs;
+		step.outputs = stage.outputs;
+		step.radius = stage.radius;
+		step.border = stage.border;
+		step.pointwise = (bool)stage.pixel;
+
+		if (step.pointwise)
+		{
+			step.lut.resize(256);
+			for (int v = 0; v < 256; v++)
+			{
+				step.lut[v] = stage.pixel((unsigned char)v);
+			}
+		}
+
+		steps.push_back(step);
+	}
+
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		ostringstream name;
+		name << "fused_pointwise_" << i;
+		steps[i].kernelName = steps[i].pointwise ? name.str() : stages[steps[i].stages.front()].kernelName;
+	}
+}
+
+StageGraph::BufferPlan StageGraph::PlanBuffers(const vector<int> &stepTimes, bool reuseInput) const
+{
+	// last time each buffer is read, the output lives forever
+	map<string, int> lastUse;
+	map<string, int> readers;
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		for (size_t j = 0; j < steps[i].inputs.size(); j++)
+		{
+			lastUse[steps[i].inputs[j]] = max(lastUse[steps[i].inputs[j]], stepTimes[i]);
+			readers[steps[i].inputs[j]]++;
+		}
+	}
+	lastUse[output] = INT_MAX;
+
+	BufferPlan plan;
+	vector<int> slotFreeAfter;
+
+	if (reuseInput)
+	{
+		plan.slots[input] = 0;
+		slotFreeAfter.push_back(lastUse[input]);
+	}
+	else
+	{
+		plan.slots[input] = -1;
+	}
+
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		const Step &step = steps[i];
+
+		for (size_t j = 0; j < step.outputs.size(); j++)
+		{
+			const string &name = step.outputs[j];
+			int slot = -1;
+
+			// a pointwise step may overwrite an input nobody else reads
+			if (step.pointwise && readers[step.inputs.front()] == 1 && plan.slots[step.inputs.front()] >= 0)
+			{
+				slot = plan.slots[step.inputs.front()];
+			}
+
+			// otherwise any slot whose buffer is dead by now
+			for (size_t s = 0; slot < 0 && s < slotFreeAfter.size(); s++)
+			{
+				if (slotFreeAfter[s] < stepTimes[i])
+				{
+					slot = (int)s;
+				}
+			}
+
+			if (slot < 0)
+			{
+				slot = (int)slotFreeAfter.size();
+				slotFreeAfter.push_back(0);
+			}
+
+			// an unread output still needs its own memory during the step
+			slotFreeAfter[slot] = max(lastUse[name], stepTimes[i]);
+			plan.slots[name] = slot;
+		}
+	}
+
+	plan.slotCount = (int)slotFreeAfter.size();
+	return plan;
+}
+
+Mat StageGraph::RunCPU(const Mat &image)
+{
+	if (!compiled && !Compile())
+	{
+		return Mat();
+	}
+
+	Mat source = image.isContinuous() ? image : image.clone();
+	int rows = source.rows;
+	int cols = source.cols;
+
+	cpuSlots.resize(cpuPlan.slotCount);
+	for (size_t s = 0; s < cpuSlots.size(); s++)
+	{
+		cpuSlots[s].create(rows, cols, CV_8UC1);
+	}
+
+	// buffer pointers of every step
+	vector<StageBuffers> buffers(steps.size());
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		buffers[i].rows = rows;
+		buffers[i].cols = cols;
+
+		for (size_t j = 0; j < steps[i].inputs.size(); j++)
+		{
+			int slot = cpuPlan.slots[steps[i].inputs[j]];
+			buffers[i].inputs.push_back(slot < 0 ? source.data : cpuSlots[slot].data);
+		}
+		for (size_t j = 0; j < steps[i].outputs.size(); j++)
+		{
+			buffers[i].outputs.push_back(cpuSlots[cpuPlan.slots[steps[i].outputs[j]]].data);
+		}
+	}
+
+	// rows of each buffer that are complete
+	map<string, int> available;
+	available[input] = rows;
+
+	vector<int> done(steps.size(), 0);
+	bool finished = false;
+
+	for (int end = blockRows; !finished; end += blockRows)
+	{
+		finished = true;
+
+		for (size_t i = 0; i < steps.size(); i++)
+		{
+			const Step &step = steps[i];
+			int limit = min(end, rows);
+
+			// a segment may reuse the memory of earlier ones, so it waits
+			// for them; a global step waits for everything before it
+			for (size_t k = 0; k < i; k++)
+			{
+				if (done[k] < rows && (steps[k].segment < step.segment || step.radius == Stage::GLOBAL))
+				{
+					limit = 0;
+				}
+			}
+
+			if (step.radius == Stage::GLOBAL)
+			{
+				limit = limit ? rows : 0;
+			}
+			else
+			{
+				for (size_t j = 0; j < step.inputs.size(); j++)
+				{
+					int rowsIn = available[step.inputs[j]];
+					limit = min(limit, rowsIn == rows ? rows : rowsIn - step.radius);
+				}
+			}
+
+			if (limit > done[i])
+			{
+				if (done[i] == 0)
+				{
+					for (size_t j = 0; j < buffers[i].outputs.size(); j++)
+					{
+						ClearBorder(buffers[i].outputs[j], rows, cols, step.border);
+					}
+				}
+
+				if (step.pointwise)
+				{
+					const unsigned char *lut = step.lut.data();
+					const unsigned char *in = buffers[i].inputs.front();
+					unsigned char *out = buffers[i].outputs.front();
+
+					for (int pos = done[i] * cols; pos < limit * cols; pos++)
+					{
+						out[pos] = lut[in[pos]];
+					}
+				}
+				else
+				{
+					stages[step.stages.front()].cpu(buffers[i], done[i], limit);
+				}
+
+				done[i] = limit;
+				for (size_t j = 0; j < step.outputs.size(); j++)
+				{
+					available[step.outputs[j]] = limit;
+				}
+			}
+
+			if (done[i] < rows)
+			{
+				finished = false;
+			}
+		}
+	}
+
+	return cpuSlots[cpuPlan.slots[output]];
+}
+
+bool StageGraph::InitializeOCL(const cl::Device &device)
+{
+	if (!compiled && !Compile())
+	{
+		return false;
+	}
+
+	ocl.reset(new OCLBackend());
+	ocl->device = device;
+
+	try
+	{
+		ocl->context = cl::Context(vector<cl::Device>(1, device));
+		ocl->queue = cl::CommandQueue(ocl->context, device);
+	}
+	catch (const exception &e)
+	{
+		cerr << "Error: " << e.what() << endl;
+		ocl.reset();
+		return false;
+	}
+
+	if (!BuildOCL())
+	{
+		ocl.reset();
+		return false;
+	}
+	return true;
+}
+
+bool StageGraph::BuildOCL()
+{
+	// the stock kernels, any stage kernels, then the generated ones
+	ostringstream source;
+	source << FileToString("canny.cl") << "\n";
+
+	for (size_t i = 0; i < stages.size(); i++)
+	{
+		source << stages[i].kernelSource << "\n";
+	}
+
+	source << "__kernel void clear_border(__global uchar *image, int rows, int cols, int border)\n"
+		<< "{\n"
+		<< "\tint row = get_global_id(0);\n"
+		<< "\tint col = get_global_id(1);\n"
+		<< "\tif (row < border || row >= rows - border || col < border || col >= cols - border)\n"
+		<< "\t\timage[row * cols + col] = 0;\n"
+		<< "}\n";
+
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		if (!steps[i].pointwise)
+		{
+			continue;
+		}
+
+		source << "__kernel void " << steps[i].kernelName << "(__global const uchar *in, __global uchar *out)\n"
+			<< "{\n"
+			<< "\tsize_t pos = get_global_id(0);\n"
+			<< "\tint v = in[pos];\n";
+
+		for (size_t k = 0; k < steps[i].stages.size(); k++)
+		{
+			const Stage &stage = stages[steps[i].stages[k]];
+			if (stage.expression.empty())
+			{
+				cerr << "Error: stage " << stage.name << " has no OpenCL expression" << endl;
+				return false;
+			}
+			source << "\tv = clamp((int)(" << stage.expression << "), 0, 255);\n";
+		}
+
+		source << "\tout[pos] = (uchar)v;\n"
+			<< "}\n";
+	}
+
+	string program = source.str();
+	cl::Program::Sources sources(1, std::make_pair(program.c_str(), program.length()));
+	ocl->program = cl::Program(ocl->context, sources);
+
+	if (ocl->program.build(vector<cl::Device>(1, ocl->device)) != CL_SUCCESS)
+	{
+		cerr << "Error: stage graph build failed" << endl
+			<< ocl->program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(ocl->device) << endl;
+		return false;
+	}
+
+	ocl->clearBorderKernel = cl::Kernel(ocl->program, "clear_border");
+	ocl->kernels.clear();
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		if (steps[i].kernelName.empty())
+		{
+			cerr << "Error: stage " << stages[steps[i].stages.front()].name << " has no OpenCL kernel" << endl;
+			return false;
+		}
+		ocl->kernels.push_back(cl::Kernel(ocl->program, steps[i].kernelName.c_str()));
+	}
+	return true;
+}
+
+Mat StageGraph::RunOCL(const Mat &image)
+{
+	if (!compiled && !Compile())
+	{
+		return Mat();
+	}
+
+	if (!ocl)
+	{
+		vector<cl::Device> devices = OCLCanny::GetDevices(CL_DEVICE_TYPE_GPU);
+		if (devices.empty())
+		{
+			devices = OCLCanny::GetDevices(CL_DEVICE_TYPE_ALL);
+		}
+		if (devices.empty() || !InitializeOCL(devices[0]))
+		{
+			cerr << "Error: no OpenCL device for the stage graph" << endl;
+			return Mat();
+		}
+	}
+
+	Mat source = image.isContinuous() ? image : image.clone();
+	int rows = source.rows;
+	int cols = source.cols;
+	size_t bytes = rows * cols;
+
+	if (ocl->rows != rows || ocl->cols != cols || (int)ocl->slots.size() != oclPlan.slotCount)
+	{
+		ocl->slots.clear();
+		for (int s = 0; s < oclPlan.slotCount; s++)
+		{
+			ocl->slots.push_back(cl::Buffer(ocl->context, CL_MEM_READ_WRITE, bytes));
+		}
+		ocl->rows = rows;
+		ocl->cols = cols;
+	}
+
+	ocl->queue.enqueueWriteBuffer(ocl->slots[oclPlan.slots[input]], CL_FALSE, 0, bytes, source.data);
+
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		const Step &step = steps[i];
+		cl::Kernel &kernel = ocl->kernels[i];
+
+		if (step.pointwise)
+		{
+			kernel.setArg(0, ocl->slots[oclPlan.slots[step.inputs.front()]]);
+			kernel.setArg(1, ocl->slots[oclPlan.slots[step.outputs.front()]]);
+			ocl->queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(bytes), cl::NullRange, NULL);
+			continue;
+		}
+
+		const Stage &stage = stages[step.stages.front()];
+		int border = min(step.border, min(rows, cols) / 2);
+
+		for (size_t j = 0; border > 0 && j < step.outputs.size(); j++)
+		{
+			ocl->clearBorderKernel.setArg(0, ocl->slots[oclPlan.slots[step.outputs[j]]]);
+			ocl->clearBorderKernel.setArg(1, rows);
+			ocl->clearBorderKernel.setArg(2, cols);
+			ocl->clearBorderKernel.setArg(3, border);
+			ocl->queue.enqueueNDRangeKernel(ocl->clearBorderKernel, cl::NullRange, cl::NDRange(rows, cols), cl::NullRange, NULL);
+		}
+
+		vector<string> args = stage.kernelArgs;
+		if (args.empty())
+		{
+			args = step.inputs;
+			args.insert(args.end(), step.outputs.begin(), step.outputs.end());
+		}
+
+		cl_uint arg = 0;
+		for (size_t j = 0; j < args.size(); j++)
+		{
+			kernel.setArg(arg++, ocl->slots[oclPlan.slots[args[j]]]);
+		}
+		for (size_t j = 0; j < stage.kernelConstants.size(); j++)
+		{
+			kernel.setArg(arg++, (cl_uchar)stage.kernelConstants[j]);
+		}
+		kernel.setArg(arg++, (size_t)rows);
+		kernel.setArg(arg++, (size_t)cols);
+		kernel.setArg(arg++, (size_t)(rows - border));
+		kernel.setArg(arg++, (size_t)(cols - border));
+
+		if (rows > 2 * border && cols > 2 * border)
+		{
+			ocl->queue.enqueueNDRangeKernel(
+				kernel,
+				cl::NDRange(border, border),
+				cl::NDRange(rows - 2 * border, cols - 2 * border),
+				cl::NullRange,
+				NULL
+			);
+		}
+	}
+
+	Mat result(rows, cols, CV_8UC1);
+	ocl->queue.enqueueReadBuffer(ocl->slots[oclPlan.slots[output]], CL_TRUE, 0, bytes, result.data);
+	return result;
+}
+
+void StageGraph::PrintPlan(ostream &out) const
+{
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		out << "Step " << i << ":";
+		for (size_t k = 0; k < steps[i].stages.size(); k++)
+		{
+			out << (k ? " + " : " ") << stages[steps[i].stages[k]].name;
+		}
+		out << (steps[i].radius == Stage::GLOBAL ? " (global)" : "") << endl;
+	}
+
+	// every buffer name counted once, against the memory actually used
+	const BufferPlan *plans[2] = { &cpuPlan, &oclPlan };
+	const char *names[2] = { "CPU", "OCL" };
+
+	for (int p = 0; p < 2; p++)
+	{
+		out << names[p] << " buffers:";
+		for (map<string, int>::const_iterator it = plans[p]->slots.begin(); it != plans[p]->slots.end(); it++)
+		{
+			out << " " << it->first << "=" << (it->second < 0 ? string("caller") : std::to_string(it->second));
+		}
+		out << " (" << plans[p]->slotCount << " images)" << endl;
+	}
+}
+
+void StageGraph::AddCanny(const string &source, const string &edges)
+{
+	const string blurred = edges + ".blurred";
+	const string magnitude = edges + ".magnitude";
+	const string theta = edges + ".theta";
+	const string suppressed = edges + ".suppressed";
+
+	// the 5x5 taps reach from row - 1 to row + 3
+	Stage gaussian;
+	gaussian.name = "gaussian";
+	gaussian.inputs.push_back(source);
+	gaussian.outputs.push_back(blurred);
+	gaussian.radius = 3;
+	gaussian.border = 3;
+	gaussian.kernelName = "gaussian_blur";
+	gaussian.cpu = [](const StageBuffers &b, int rowBegin, int rowEnd)
+	{
+		GaussianRows(b.inputs[0], b.outputs[0], b.rows, b.cols, rowBegin, rowEnd);
+	};
+	AddStage(gaussian);
+
+	Stage sobel;
+	sobel.name = "sobel";
+	sobel.inputs.push_back(blurred);
+	sobel.outputs.push_back(magnitude);
+	sobel.outputs.push_back(theta);
+	sobel.radius = 1;
+	sobel.border = 1;
+	sobel.kernelName = "sobel_operation";
+	sobel.cpu = [](const StageBuffers &b, int rowBegin, int rowEnd)
+	{
+		SobelRows(b.inputs[0], b.outputs[0], b.outputs[1], b.rows, b.cols, rowBegin, rowEnd);
+	};
+	AddStage(sobel);
+
+	Stage nms;
+	nms.name = "nms";
+	nms.inputs.push_back(magnitude);
+	nms.inputs.push_back(theta);
+	nms.outputs.push_back(suppressed);
+	nms.radius = 1;
+	nms.border = 1;
+	nms.kernelName = "non_maxima_suppression";
+	nms.kernelArgs.push_back(magnitude);
+	nms.kernelArgs.push_back(suppressed);
+	nms.kernelArgs.push_back(theta);
+	nms.cpu = [](const StageBuffers &b, int rowBegin, int rowEnd)
+	{
+		NonMaximaRows(b.inputs[0], b.inputs[1], b.outputs[0], b.rows, b.cols, rowBegin, rowEnd);
+	};
+	AddStage(nms);
+
+	// edge tracing on the CPU, the local threshold rule of canny.cl on the device
+	Stage hysteresis;
+	hysteresis.name = "hysteresis";
+	hysteresis.inputs.push_back(suppressed);
+	hysteresis.outputs.push_back(edges);
+	hysteresis.radius = Stage::GLOBAL;
+	hysteresis.border = 1;
+	hysteresis.kernelName = "hysteresis_thresholding";
+	hysteresis.kernelConstants.push_back(50);
+	hysteresis.kernelConstants.push_back(80);
+	hysteresis.cpu = [](const StageBuffers &b, int rowBegin, int rowEnd)
+	{
+		memset(b.outputs[0] + rowBegin * b.cols, 0x00, (rowEnd - rowBegin) * b.cols);
+		HysteresisRows(b.inputs[0], b.outputs[0], b.rows, b.cols, rowBegin, rowEnd, 50, 80);
+	};
+	AddStage(hysteresis);
+}
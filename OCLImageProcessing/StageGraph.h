@@ -0,0 +1,161 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <iostream>
+#include <CL/cl.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+// full frame pixel buffers of one stage, in the order the stage names them
+struct StageBuffers
+{
+	std::vector<unsigned char *> inputs;
+	std::vector<unsigned char *> outputs;
+	int rows;
+	int cols;
+};
+
+// One step of an image pipeline. Every buffer is a rows x cols uchar
+// image named by a string, a stage reads its inputs and writes its
+// outputs and never touches anything else.
+struct Stage
+{
+	// a row may depend on every row of the inputs (e.g. hysteresis)
+	static const int GLOBAL = -1;
+
+	std::string name;
+	std::vector<std::string> inputs;
+	std::vector<std::string> outputs;
+
+	// rows of input read above or below an output row, 0 if pointwise
+	int radius = 0;
+
+	// pixels on each side that are not written, cleared by the engine
+	int border = 0;
+
+	// CPU implementation, writes output rows [rowBegin, rowEnd)
+	std::function<void(const StageBuffers &, int rowBegin, int rowEnd)> cpu;
+
+	// OpenCL implementation, launched with offset (border, border) over
+	// the remaining rows x cols and taking (buffers..., constants...,
+	// size_t rows, size_t cols, size_t rowEnd, size_t colEnd)
+	std::string kernelName;
+	std::string kernelSource;
+
+	// buffer names in kernel argument order, inputs then outputs if empty
+	std::vector<std::string> kernelArgs;
+
+	// uchar arguments after the buffers, e.g. thresholds
+	std::vector<unsigned char> kernelConstants;
+
+	// pointwise stages only: the per pixel function, and the same as an
+	// OpenCL C expression of int v, so that chains of them fuse into one pass
+	std::function<unsigned char(unsigned char)> pixel;
+	std::string expression;
+};
+
+// Stages are added in execution order, Compile() then fuses chains of
+// pointwise stages and plans which buffers can share memory.
+//
+// The CPU backend runs the graph in row strips, every stage lagging
+// behind its producers by its radius, so a row is normally still in
+// cache when the next stage reads it. A GLOBAL stage waits for everything
+// before it. The OpenCL backend runs one launch per fused step.
+class StageGraph
+{
+private:
+	// stages after fusion
+	struct Step
+	{
+		std::vector<int> stages;
+		std::vector<std::string> inputs;
+		std::vector<std::string> outputs;
+		int radius = 0;
+		int border = 0;
+		bool pointwise = false;
+
+		// global steps seen so far, CPU buffers are only shared across segments
+		int segment = 0;
+
+		// composed pixel functions of a fused pointwise chain
+		std::vector<unsigned char> lut;
+		std::string kernelName;
+	};
+
+	// buffer name -> memory slot; the graph input is -1 when it stays external
+	struct BufferPlan
+	{
+		std::map<std::string, int> slots;
+		int slotCount = 0;
+	};
+
+	struct OCLBackend
+	{
+		cl::Device device;
+		cl::Context context;
+		cl::CommandQueue queue;
+		cl::Program program;
+		std::vector<cl::Kernel> kernels;
+		cl::Kernel clearBorderKernel;
+		std::vector<cl::Buffer> slots;
+		int rows = 0;
+		int cols = 0;
+	};
+
+	std::string input;
+	std::string requestedOutput;
+	std::vector<Stage> stages;
+
+	// requestedOutput, or the last stage's first output; set by Compile
+	std::string output;
+
+	bool compiled = false;
+	std::vector<Step> steps;
+	BufferPlan cpuPlan;
+	BufferPlan oclPlan;
+
+	// rows per strip on the CPU
+	int blockRows = 32;
+
+	std::vector<cv::Mat> cpuSlots;
+	std::unique_ptr<OCLBackend> ocl;
+
+	void Fuse();
+	BufferPlan PlanBuffers(const std::vector<int> &stepTimes, bool reuseInput) const;
+	bool BuildOCL();
+
+public:
+	StageGraph(const std::string &input = "input");
+	~StageGraph();
+
+	void AddStage(const Stage &stage);
+
+	// the buffer Run* return, by default the first output of whichever
+	// stage is last when the graph is compiled
+	void SetOutput(const std::string &name);
+
+	// check the graph, fuse stages and plan buffers
+	bool Compile();
+
+	// the result aliases graph memory and is valid until the next run
+	cv::Mat RunCPU(const cv::Mat &image);
+
+	// on the given device, or the first GPU (else any device) if not set
+	bool InitializeOCL(const cl::Device &device);
+	cv::Mat RunOCL(const cv::Mat &image);
+
+	void setBlockRows(int rows);
+
+	// fused steps and buffer assignments of both backends
+	void PrintPlan(std::ostream &out) const;
+
+	// a stage that maps every pixel on its own
+	static Stage Pointwise(const std::string &name, const std::string &input, const std::string &output,
+		std::function<unsigned char(unsigned char)> pixel, const std::string &expression);
+
+	// append Gaussian, Sobel, NMS and hysteresis from input to output;
+	// intermediate buffers are prefixed with the output name
+	void AddCanny(const std::string &input, const std::string &output);
+};
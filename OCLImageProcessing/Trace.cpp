@@ -0,0 +1,134 @@
+#include "Trace.h"
+
+#ifdef CANNY_TRACE
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::mutex;
+using std::lock_guard;
+using std::ofstream;
+using std::endl;
+
+namespace Trace
+{
+	// buffers outlive their threads so that late exports still see them;
+	// the buffer of a finished thread is handed to the next new thread
+	// (its events stay on the same track), so short lived workers do not
+	// grow the registry
+	static mutex registryMutex;
+	static vector<shared_ptr<Buffer> > registry;
+	static vector<Buffer *> retired;
+
+	class BufferLease
+	{
+	public:
+		Buffer *buffer = NULL;
+
+		~BufferLease()
+		{
+			if (buffer)
+			{
+				lock_guard<mutex> lock(registryMutex);
+				retired.push_back(buffer);
+			}
+		}
+	};
+
+	Buffer &ThreadBuffer()
+	{
+		thread_local BufferLease lease;
+
+		if (!lease.buffer)
+		{
+			lock_guard<mutex> lock(registryMutex);
+
+			if (!retired.empty())
+			{
+				lease.buffer = retired.back();
+				retired.pop_back();
+			}
+			else
+			{
+				registry.push_back(std::make_shared<Buffer>((unsigned int)registry.size() + 1));
+				lease.buffer = registry.back().get();
+			}
+		}
+		return *lease.buffer;
+	}
+
+	bool ExportChrome(const string &fileName)
+	{
+		struct Record
+		{
+			Event event;
+			unsigned int threadId;
+		};
+
+		vector<Record> records;
+		{
+			lock_guard<mutex> lock(registryMutex);
+
+			for (size_t b = 0; b < registry.size(); b++)
+			{
+				Buffer &buffer = *registry[b];
+
+				// the writer keeps going while we copy, so anything it may
+				// have overwritten in the meantime (or is writing right now) is dropped
+				size_t end = buffer.written.load(std::memory_order_acquire);
+				size_t begin = end > Buffer::CAPACITY ? end - Buffer::CAPACITY : 0;
+				size_t first = records.size();
+
+				for (size_t i = begin; i < end; i++)
+				{
+					Record record;
+					record.event = buffer.events[i & (Buffer::CAPACITY - 1)];
+					record.threadId = buffer.threadId;
+					records.push_back(record);
+				}
+
+				size_t now = buffer.written.load(std::memory_order_acquire);
+				size_t stale = now + 1 > Buffer::CAPACITY + begin ? now + 1 - Buffer::CAPACITY - begin : 0;
+				records.erase(records.begin() + first, records.begin() + first + std::min(stale, end - begin));
+			}
+		}
+
+		ofstream file(fileName.c_str());
+		if (!file)
+		{
+			std::cerr << "Error: unable to write " << fileName << endl;
+			return false;
+		}
+
+		long long origin = 0;
+		for (size_t i = 0; i < records.size(); i++)
+		{
+			origin = i ? std::min(origin, records[i].event.beginNs) : records[i].event.beginNs;
+		}
+
+		// complete events, timestamps in microseconds
+		file << std::fixed << std::setprecision(3);
+		file << "{\"traceEvents\":[" << endl;
+		for (size_t i = 0; i < records.size(); i++)
+		{
+			const Event &event = records[i].event;
+			file << (i ? ",\n" : "")
+				<< "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << records[i].threadId
+				<< ",\"ts\":" << (event.beginNs - origin) / 1000.0
+				<< ",\"dur\":" << (event.endNs - event.beginNs) / 1000.0 << "}";
+		}
+		file << endl << "],\"displayTimeUnit\":\"ns\"}" << endl;
+
+		return true;
+	}
+}
+
+#endif
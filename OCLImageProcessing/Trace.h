@@ -0,0 +1,97 @@
+#pragma once
+
+// Scoped trace zones, compiled in only when CANNY_TRACE is defined:
+//
+//   void Stage()
+//   {
+//       TRACE_ZONE("Stage");
+//       ...
+//   }
+//
+// A zone records its begin and end on a monotonic nanosecond clock into
+// a ring buffer owned by the calling thread, so recording takes no lock
+// and never allocates. Trace::ExportChrome() writes everything recorded
+// so far as Chrome trace JSON, which chrome://tracing and Perfetto open.
+// Zone names must be string literals (only the pointer is stored).
+#ifdef CANNY_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace Trace
+{
+	struct Event
+	{
+		const char *name;
+		long long beginNs;
+		long long endNs;
+	};
+
+	// single writer ring, the oldest events are overwritten when full
+	class Buffer
+	{
+	public:
+		static const size_t CAPACITY = 1 << 14;
+
+		Event events[CAPACITY];
+		std::atomic<size_t> written;
+		unsigned int threadId;
+
+		Buffer(unsigned int threadId) : written(0), threadId(threadId)
+		{
+		}
+
+		inline void push(const char *name, long long beginNs, long long endNs)
+		{
+			size_t index = written.load(std::memory_order_relaxed);
+			Event &event = events[index & (CAPACITY - 1)];
+			event.name = name;
+			event.beginNs = beginNs;
+			event.endNs = endNs;
+			written.store(index + 1, std::memory_order_release);
+		}
+	};
+
+	inline long long Now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// the calling thread's buffer, registered on first use
+	Buffer &ThreadBuffer();
+
+	// every event still in the rings, timestamps relative to the earliest
+	bool ExportChrome(const std::string &fileName);
+
+	class Zone
+	{
+	private:
+		const char *name;
+		long long beginNs;
+
+	public:
+		Zone(const char *name) : name(name), beginNs(Now())
+		{
+		}
+
+		~Zone()
+		{
+			ThreadBuffer().push(name, beginNs, Now());
+		}
+
+		Zone(const Zone &) = delete;
+		Zone &operator=(const Zone &) = delete;
+	};
+}
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_ZONE(name) Trace::Zone TRACE_CONCAT(traceZone, __LINE__)(name)
+
+#else
+
+#define TRACE_ZONE(name)
+
+#endif
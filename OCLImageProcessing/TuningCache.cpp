@@ -0,0 +1,129 @@
+#include "TuningCache.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+using std::string;
+using std::vector;
+using std::map;
+using std::ifstream;
+using std::ofstream;
+using std::istringstream;
+using std::endl;
+
+
+TuningCache::TuningCache(const string &fileName)
+	: fileName(fileName)
+{
+}
+
+bool TuningCache::Load()
+{
+	ifstream file(fileName.c_str());
+	if (!file)
+	{
+		return false;
+	}
+
+	const string prefix = "device ";
+	string line;
+	map<string, LaunchConfig> *current = NULL;
+
+	devices.clear();
+	while (std::getline(file, line))
+	{
+		if (line.compare(0, prefix.size(), prefix) == 0)
+		{
+			current = &devices[line.substr(prefix.size())];
+			continue;
+		}
+
+		string kernel;
+		LaunchConfig config;
+		istringstream fields(line);
+		if (current && fields >> kernel >> config.localRows >> config.localCols >> config.pixelsPerItem >> config.microSec)
+		{
+			(*current)[kernel] = config;
+		}
+	}
+
+	return true;
+}
+
+bool TuningCache::Save() const
+{
+	ofstream file(fileName.c_str());
+	if (!file)
+	{
+		std::cerr << "Error: unable to write " << fileName << endl;
+		return false;
+	}
+
+	for (auto device = devices.begin(); device != devices.end(); ++device)
+	{
+		file << "device " << device->first << endl;
+		for (auto entry = device->second.begin(); entry != device->second.end(); ++entry)
+		{
+			const LaunchConfig &config = entry->second;
+			file << entry->first << " " << config.localRows << " " << config.localCols << " "
+				<< config.pixelsPerItem << " " << config.microSec << endl;
+		}
+	}
+
+	return true;
+}
+
+bool TuningCache::find(const string &device, const string &kernel, LaunchConfig &config) const
+{
+	auto entries = devices.find(device);
+	if (entries == devices.end())
+	{
+		return false;
+	}
+
+	auto entry = entries->second.find(kernel);
+	if (entry == entries->second.end())
+	{
+		return false;
+	}
+
+	config = entry->second;
+	return true;
+}
+
+void TuningCache::store(const string &device, const string &kernel, const LaunchConfig &config)
+{
+	devices[device][kernel] = config;
+}
+
+vector<LaunchConfig> TuningCache::Candidates(size_t maxGroupSize, size_t maxRows, size_t maxCols)
+{
+	const int pixelCounts[] = { 1, 2, 4 };
+
+	// tiny groups leave most of a SIMD unit idle, unless nothing else fits
+	size_t minGroupSize = std::min<size_t>(16, maxGroupSize);
+
+	vector<LaunchConfig> candidates;
+	for (size_t rows = 1; rows <= maxRows && rows <= maxGroupSize; rows *= 2)
+	{
+		for (size_t cols = 1; cols <= maxCols && rows * cols <= maxGroupSize; cols *= 2)
+		{
+			if (rows * cols < minGroupSize)
+			{
+				continue;
+			}
+
+			for (size_t p = 0; p < sizeof(pixelCounts) / sizeof(pixelCounts[0]); p++)
+			{
+				LaunchConfig config;
+				config.localRows = (int)rows;
+				config.localCols = (int)cols;
+				config.pixelsPerItem = pixelCounts[p];
+				candidates.push_back(config);
+			}
+		}
+	}
+
+	return candidates;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+
+// launch shape of a 2D stencil kernel
+struct LaunchConfig
+{
+	// work-group rows x columns; columns are the contiguous dimension
+	int localRows = 16;
+	int localCols = 16;
+
+	// neighbouring columns covered by one work item, in a plain loop;
+	// the kernels do no vector loads
+	int pixelsPerItem = 1;
+
+	// time of the stage with this shape when it was tuned, 0 otherwise
+	double microSec = 0.0;
+};
+
+// Tuned launch shapes per device and kernel, kept in a text file so
+// later runs skip the sweep:
+//
+//   device <name>, driver <version>
+//   <kernel> <localRows> <localCols> <pixelsPerItem> <microSec>
+//   ...
+//
+// A device with another name or driver has no entries and is tuned anew,
+// entries of other devices are kept when the file is saved.
+class TuningCache
+{
+private:
+	std::string fileName;
+	std::map<std::string, std::map<std::string, LaunchConfig> > devices;
+
+public:
+	TuningCache(const std::string &fileName);
+
+	// false if the file does not exist yet
+	bool Load();
+	bool Save() const;
+
+	bool find(const std::string &device, const std::string &kernel, LaunchConfig &config) const;
+	void store(const std::string &device, const std::string &kernel, const LaunchConfig &config);
+
+	// power of two work-groups of 16 to maxGroupSize items within the per
+	// dimension limits, each with 1, 2 and 4 pixels per item
+	static std::vector<LaunchConfig> Candidates(size_t maxGroupSize, size_t maxRows, size_t maxCols);
+};
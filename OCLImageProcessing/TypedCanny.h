@@ -0,0 +1,104 @@
+#pragma once
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "CannyStages.h"
+#include "Trace.h"
+
+// CPU Canny on 16 bit or float frames as they come from the source, no
+// conversion to 8 bit first. Gradients are kept in float, a 16 bit Sobel
+// magnitude goes up to 4 * 65535 * sqrt(2) which no 16 bit type holds.
+//
+//   TypedCanny<unsigned short> canny;
+//   canny.setThresholds(50 * 257, 80 * 257);
+//   canny.Process(depth16, edges);
+//
+// Thresholds are in units of the input, by default the 8 bit thresholds
+// scaled to the range of the pixel type (0~1 for float).
+template <typename Pixel>
+class TypedCanny
+{
+public:
+	typedef typename PixelTraits<Pixel>::Gradient Gradient;
+
+private:
+	std::vector<Pixel> gaussian;
+	std::vector<Gradient> magnitude;
+	std::vector<Gradient> suppressed;
+	std::vector<unsigned char> theta;
+
+	float tLow = 50.0f / 255.0f * PixelTraits<Pixel>::Range();
+	float tHigh = 80.0f / 255.0f * PixelTraits<Pixel>::Range();
+
+	bool RunSuppression(const cv::Mat &input)
+	{
+		if (input.type() != PixelTraits<Pixel>::cvType)
+		{
+			std::cerr << "Error: TypedCanny expects a single channel image of its pixel type" << std::endl;
+			return false;
+		}
+
+		cv::Mat image = input.isContinuous() ? input : input.clone();
+		const int rows = image.rows;
+		const int cols = image.cols;
+		const size_t pixels = (size_t)rows * cols;
+
+		// borders are never written, keep them at zero
+		gaussian.assign(pixels, 0);
+		magnitude.assign(pixels, 0);
+		suppressed.assign(pixels, 0);
+		theta.assign(pixels, 0);
+
+		GaussianRows<Pixel>((const Pixel *)image.data, gaussian.data(), rows, cols, 0, rows);
+		SobelRows<Pixel>(gaussian.data(), magnitude.data(), theta.data(), rows, cols, 0, rows);
+		NonMaximaRows<Gradient>(magnitude.data(), theta.data(), suppressed.data(), rows, cols, 0, rows);
+		return true;
+	}
+
+public:
+	void setThresholds(float low, float high)
+	{
+		tLow = low;
+		tHigh = high;
+	}
+
+	float getLowThreshold() const
+	{
+		return tLow;
+	}
+
+	float getHighThreshold() const
+	{
+		return tHigh;
+	}
+
+	// all stages, edges is a CV_8UC1 image of 0 and 255
+	void Process(const cv::Mat &input, cv::Mat &edges)
+	{
+		TRACE_ZONE("Typed Process");
+
+		if (!RunSuppression(input))
+		{
+			return;
+		}
+
+		edges.create(input.rows, input.cols, CV_8UC1);
+		memset(edges.data, 0x00, input.total());
+		HysteresisRows<Gradient>(suppressed.data(), edges.data, input.rows, input.cols, 0, input.rows, tLow, tHigh);
+	}
+
+	// unsaturated non-maxima suppressed magnitude, of the gradient type
+	void Suppress(const cv::Mat &input, cv::Mat &result)
+	{
+		TRACE_ZONE("Typed Suppress");
+
+		if (!RunSuppression(input))
+		{
+			return;
+		}
+
+		cv::Mat(input.rows, input.cols, PixelTraits<Pixel>::gradientCvType, suppressed.data()).copyTo(result);
+	}
+};
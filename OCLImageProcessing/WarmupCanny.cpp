@@ -0,0 +1,163 @@
+#include "WarmupCanny.h"
+#include "Timer.h"
+#include "Trace.h"
+#include <iostream>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+using cv::Mat;
+
+
+WarmupCanny::WarmupCanny()
+	: ready(false), finished(false), cpuFrames(0)
+{
+	builder = std::thread(&WarmupCanny::Build, this);
+}
+
+WarmupCanny::~WarmupCanny()
+{
+	WaitForBuild();
+}
+
+void WarmupCanny::Build()
+{
+	TRACE_ZONE("OCL background build");
+
+	Timer timer;
+	timer.start();
+
+	vector<cl::Device> devices = OCLCanny::GetDevices(CL_DEVICE_TYPE_GPU);
+	if (devices.empty())
+	{
+		devices = OCLCanny::GetDevices(CL_DEVICE_TYPE_ALL);
+	}
+
+	if (devices.empty())
+	{
+		cerr << "Error: no OpenCL device found, staying on the CPU" << endl;
+		finished = true;
+		return;
+	}
+
+	// the context and every program are built here
+	ocl.reset(new OCLCanny(devices[0]));
+
+	// a warm-up with empty kernels would only compare garbage
+	if (!ocl->isInitialized())
+	{
+		cerr << "Error: OpenCL did not initialize on " << ocl->getDeviceName() << ", staying on the CPU" << endl;
+		finished = true;
+		return;
+	}
+
+	Mat sample = SyntheticFrame(256);
+
+	// the first launch pays for the driver's lazy setup; the suppressed
+	// magnitude is the same on both backends, so a broken build shows
+	Mat edges, expected, actual;
+	ocl->Process(sample, edges);
+	ocl->Suppress(sample, actual);
+
+	CPUCanny reference;
+	reference.Suppress(sample, expected);
+
+	size_t edgePixels = 0;
+	size_t mismatches = 0;
+	for (size_t pixel = 0; pixel < expected.total(); pixel++)
+	{
+		edgePixels += expected.data[pixel] != 0;
+		mismatches += expected.data[pixel] != actual.data[pixel];
+	}
+
+	timer.stop();
+	warmupMicroSec = timer.getElapsedTimeInMicroSec();
+
+	if (edgePixels == 0 || mismatches > expected.total() / 1000)
+	{
+		cerr << "Error: OpenCL warm-up on " << ocl->getDeviceName() << " differs from the CPU in "
+			<< mismatches << " pixels, staying on the CPU" << endl;
+		finished = true;
+		return;
+	}
+
+	deviceName = ocl->getDeviceName();
+	ready = true;
+	finished = true;
+}
+
+void WarmupCanny::WaitForBuild()
+{
+	if (builder.joinable())
+	{
+		builder.join();
+	}
+}
+
+double WarmupCanny::getWarmupMicroSec() const
+{
+	return finished ? warmupMicroSec : 0.0;
+}
+
+string WarmupCanny::getName() const
+{
+	if (ready)
+	{
+		return "Warm-up (" + deviceName + ")";
+	}
+	return finished ? "Warm-up (CPU)" : "Warm-up (CPU, building)";
+}
+
+CannyEngine &WarmupCanny::Select()
+{
+	if (ready)
+	{
+		// a no-op unless they changed
+		ocl->setThresholds(tLow, tHigh);
+		return *ocl;
+	}
+
+	cpuFrames++;
+	return cpu;
+}
+
+void WarmupCanny::Process(const Mat &input, Mat &edges)
+{
+	last = &Select();
+	last->Process(input, edges);
+}
+
+void WarmupCanny::ProcessPacked(const Mat &input, PackedEdgeMap &edges)
+{
+	last = &Select();
+	last->ProcessPacked(input, edges);
+}
+
+void WarmupCanny::Suppress(const Mat &input, Mat &suppressed)
+{
+	Select().Suppress(input, suppressed);
+}
+
+void WarmupCanny::setThresholds(int low, int high)
+{
+	tLow = ClampThreshold(low);
+	tHigh = ClampThreshold(high);
+	cpu.setThresholds(low, high);
+
+	// for getEdgeList on the last frame
+	if (ready)
+	{
+		ocl->setThresholds(low, high);
+	}
+}
+
+vector<EdgePoint> WarmupCanny::getEdgeList(bool withAttributes)
+{
+	return last ? last->getEdgeList(withAttributes) : vector<EdgePoint>();
+}
+
+vector<HoughLine> WarmupCanny::HoughLines(unsigned int threshold, size_t maxLines, int thetaBins, int angleWindow)
+{
+	return last ? last->HoughLines(threshold, maxLines, thetaBins, angleWindow) : vector<HoughLine>();
+}
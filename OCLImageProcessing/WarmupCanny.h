@@ -0,0 +1,90 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "CannyEngine.h"
+#include "CPUCanny.h"
+#include "OCLCanny.h"
+
+// OpenCL without the start-up wait. Building canny.cl can take seconds,
+// so the context and kernels are created on a background thread while
+// the first frames run on the CPU. Once a warm-up frame on the device
+// matches the CPU result, every later frame goes to OpenCL; if the build
+// or the warm-up fails, the engine simply stays on the CPU.
+class WarmupCanny : public CannyEngine
+{
+private:
+	CPUCanny cpu;
+
+	// owned by the build thread until ready is set
+	std::unique_ptr<OCLCanny> ocl;
+	std::thread builder;
+	std::atomic<bool> ready;
+	std::atomic<bool> finished;
+
+	double warmupMicroSec = 0;
+	std::string deviceName;
+
+	// frames that ran on the CPU while OpenCL was building
+	std::atomic<size_t> cpuFrames;
+
+	// handed to OpenCL by Select, the build thread owns it before
+	int tLow = 50;
+	int tHigh = 80;
+
+	// backend of the last frame, for getEdgeList and HoughLines
+	CannyEngine *last = NULL;
+
+	void Build();
+
+	// OpenCL once it is ready, the CPU before that
+	CannyEngine &Select();
+
+public:
+	// starts building right away
+	WarmupCanny();
+
+	// waits for a build still in progress, it cannot be cancelled
+	~WarmupCanny();
+
+	WarmupCanny(const WarmupCanny &) = delete;
+	WarmupCanny &operator=(const WarmupCanny &) = delete;
+
+	std::string getName() const;
+
+	void Process(const cv::Mat &input, cv::Mat &edges);
+	void ProcessPacked(const cv::Mat &input, PackedEdgeMap &edges);
+	void Suppress(const cv::Mat &input, cv::Mat &suppressed);
+
+	void setThresholds(int low, int high);
+
+	std::vector<EdgePoint> getEdgeList(bool withAttributes = false);
+	std::vector<HoughLine> HoughLines(unsigned int threshold, size_t maxLines = 64, int thetaBins = 180, int angleWindow = 25);
+
+	// frames go to OpenCL from now on
+	bool isUsingOpenCL() const
+	{
+		return ready;
+	}
+
+	// the build thread is done, whether OpenCL made it or not
+	bool isSettled() const
+	{
+		return finished;
+	}
+
+	// block until isSettled, e.g. before timing
+	void WaitForBuild();
+
+	// build plus warm-up time, valid once settled
+	double getWarmupMicroSec() const;
+
+	size_t getCPUFrames() const
+	{
+		return cpuFrames;
+	}
+};
@@ -18,14 +18,27 @@ __constant int sobel_gy_kernel[3][3] = {
 	{ 1, 2, 1 }
 };
 
-__kernel void gaussian_blur(
+// Work items of the stencil kernels cover PIXELS_PER_ITEM neighbouring
+// columns each, the autotuner builds variants with -D PIXELS_PER_ITEM=n.
+// The host rounds the range up to whole work-groups, so every stencil
+// kernel takes the end of the rows and columns it writes as its last two
+// arguments and drops the items past them.
+#ifndef PIXELS_PER_ITEM
+#define PIXELS_PER_ITEM 1
+#endif
+
+// first column of this work item, the global offset counts in pixels
+inline size_t item_column(void)
+{
+	return get_global_offset(1) + (get_global_id(1) - get_global_offset(1)) * PIXELS_PER_ITEM;
+}
+
+inline void gaussian_pixel(
 	__global uchar *inImage,
 	__global uchar *outImage,
-	size_t rows, size_t cols)
+	size_t cols, size_t row, size_t col)
 {
 	int sum = 0;
-	size_t row = get_global_id(0);
-	size_t col = get_global_id(1);
 	size_t pos = row * cols + col;
 
 	for (int i = 0; i < 5; i++)
@@ -36,16 +49,96 @@ __kernel void gaussian_blur(
 	outImage[pos] = min(255, max(0, sum));
 }
 
-__kernel void sobel_operation(
+__kernel void gaussian_blur(
 	__global uchar *inImage,
 	__global uchar *outImage,
-	__global uchar *theta,
-	size_t rows, size_t cols)
+	size_t rows, size_t cols,
+	size_t rowEnd, size_t colEnd)
 {
-	const float MPI = 3.14159265f;
-	float sumx = 0, sumy = 0, angle = 0;
 	size_t row = get_global_id(0);
-	size_t col = get_global_id(1);
+	size_t col = item_column();
+
+	if (row >= rowEnd)
+	{
+		return;
+	}
+
+	for (int k = 0; k < PIXELS_PER_ITEM && col + k < colEnd; k++)
+	{
+		gaussian_pixel(inImage, outImage, cols, row, col + k);
+	}
+}
+
+// luma as in cvtColor(COLOR_BGR2GRAY), 14 bit fixed point
+inline uchar bgr_luma(uchar3 bgr)
+{
+	return (uchar)((bgr.x * 1868 + bgr.y * 9617 + bgr.z * 4899 + 8192) >> 14);
+}
+
+inline void gaussian_bgr_pixel(
+	__global uchar *inImage,
+	__global uchar *outImage,
+	size_t cols, size_t row, size_t col)
+{
+	int sum = 0;
+	size_t pos = row * cols + col;
+
+	for (int i = 0; i < 5; i++)
+		#pragma unroll
+		for (int j = 0; j < 5; j++)
+			sum += gaussian_kernel[i][j] * bgr_luma(vload3((i + row - 1)*cols + (j + col - 1), inImage));
+
+	outImage[pos] = min(255, max(0, sum));
+}
+
+// gaussian_blur on interleaved BGR, the grey image is never stored
+__kernel void gaussian_blur_bgr(
+	__global uchar *inImage,
+	__global uchar *outImage,
+	size_t rows, size_t cols,
+	size_t rowEnd, size_t colEnd)
+{
+	size_t row = get_global_id(0);
+	size_t col = item_column();
+
+	if (row >= rowEnd)
+	{
+		return;
+	}
+
+	for (int k = 0; k < PIXELS_PER_ITEM && col + k < colEnd; k++)
+	{
+		gaussian_bgr_pixel(inImage, outImage, cols, row, col + k);
+	}
+}
+
+// gradient direction rounded to 0, 45, 90 or 135 degrees, as
+// QuantizeGradient in CannyStages.h: tan(PI / 8) and tan(3 PI / 8) are
+// compared in integers, atan2 could round across a boundary
+inline uchar quantize_gradient(int gx, int gy)
+{
+	int ax = abs(gx);
+	int ay = abs(gy);
+
+	if ((ax + ay) * (ax + ay) <= 2 * ax * ax)
+	{
+		return 0;
+	}
+	if (ay > ax && (ay - ax) * (ay - ax) > 2 * ax * ax)
+	{
+		return 90;
+	}
+	return (gx ^ gy) >= 0 ? 45 : 135;
+}
+
+// returns the gradient, for the histograms
+inline float2 sobel_pixel(
+	__global uchar *inImage,
+	__global uchar *outImage,
+	__global uchar *theta,
+	size_t cols, size_t row, size_t col)
+{
+	float sumx = 0, sumy = 0;
 	size_t pos = row * cols + col;
 
 	// find gx and gy
@@ -62,78 +155,146 @@ __kernel void sobel_operation(
 	// hypot is defined as sqrt(x^2, y^2)
 	outImage[pos] = min(255, max(0, (int)hypot(sumx, sumy)));
 
-	// get direction
-	angle = atan2(sumy, sumx);
+	// the sums of 8 bit pixels are whole numbers
+	theta[pos] = quantize_gradient((int)sumx, (int)sumy);
+
+	return (float2)(sumx, sumy);
+}
+
+__kernel void sobel_operation(
+	__global uchar *inImage,
+	__global uchar *outImage,
+	__global uchar *theta,
+	size_t rows, size_t cols,
+	size_t rowEnd, size_t colEnd)
+{
+	size_t row = get_global_id(0);
+	size_t col = item_column();
 
-	// if angle is negative, then shift by 2PI
+	if (row >= rowEnd)
+	{
+		return;
+	}
+
+	for (int k = 0; k < PIXELS_PER_ITEM && col + k < colEnd; k++)
+	{
+		sobel_pixel(inImage, outImage, theta, cols, row, col + k);
+	}
+}
+
+// Orientation histograms accumulated by the Sobel pass itself: per cell
+// of cellSize x cellSize image pixels, the unsigned orientation (0 ~ PI)
+// in bins equal bins, weighted by the magnitude. OpenCL 1.2 has no float
+// atomics, so weights are 1/HIST_SCALE fixed point uints. Only whole
+// cells are counted, histograms holds cellRows x cellCols x bins.
+#define HIST_SCALE 16.0f
+
+// bins of the cells one work-group touches, in local memory
+#define HIST_LOCAL_SIZE 2048
+
+inline uint histogram_bin(float2 gradient, uint bins)
+{
+	const float MPI = 3.14159265f;
+
+	float angle = atan2(gradient.y, gradient.x);
 	if (angle < 0.0f)
 	{
-		angle = fmod((angle + 2 * MPI), (2 * MPI));
+		angle += MPI;
 	}
+	return min((uint)(angle * bins / MPI), bins - 1);
+}
 
-	// round angles to 0, 45, 90 and 135 degs
-	// angles are equally likely to distribute between 
-	// 0~PI and PI~2PI
-	if (angle <= MPI)
+inline uint histogram_weight(float2 gradient)
+{
+	return (uint)(hypot(gradient.x, gradient.y) * HIST_SCALE + 0.5f);
+}
+
+// sobel_operation plus the histograms. A work-group gathers the bins of
+// the cells it covers in local memory and adds each to the global
+// histograms once; groups spanning more bins than fit go straight to
+// global atomics instead.
+__kernel void sobel_operation_histogram(
+	__global uchar *inImage,
+	__global uchar *outImage,
+	__global uchar *theta,
+	__global uint *histograms,
+	size_t originRow, size_t originCol,
+	uint cellSize, uint bins,
+	uint cellRows, uint cellCols,
+	size_t rows, size_t cols,
+	size_t rowEnd, size_t colEnd)
+{
+	__local uint groupBins[HIST_LOCAL_SIZE];
+
+	size_t row = get_global_id(0);
+	size_t col = item_column();
+
+	// the cells under this work-group
+	size_t groupRow = get_global_offset(0) + get_group_id(0) * get_local_size(0);
+	size_t groupCol = get_global_offset(1) + get_group_id(1) * get_local_size(1) * PIXELS_PER_ITEM;
+	size_t firstCellRow = (groupRow - originRow) / cellSize;
+	size_t firstCellCol = (groupCol - originCol) / cellSize;
+	size_t spanRows = (groupRow + get_local_size(0) - 1 - originRow) / cellSize - firstCellRow + 1;
+	size_t spanCols = (groupCol + get_local_size(1) * PIXELS_PER_ITEM - 1 - originCol) / cellSize - firstCellCol + 1;
+	size_t spanSize = spanRows * spanCols * bins;
+	bool gather = spanSize <= HIST_LOCAL_SIZE;
+
+	uint lid = get_local_id(0) * get_local_size(1) + get_local_id(1);
+	uint groupSize = get_local_size(0) * get_local_size(1);
+
+	if (gather)
 	{
-		if (angle <= MPI / 8)
-		{
-			theta[pos] = 0;
-		}
-		else if (angle <= 3 * MPI / 8)
-		{
-			theta[pos] = 45;
-		}
-		else if (angle <= 5 * MPI / 8)
-		{
-			theta[pos] = 90;
-		}
-		else if (angle <= 7 * MPI / 8)
+		for (uint i = lid; i < spanSize; i += groupSize)
 		{
-			theta[pos] = 135;
-		}
-		else
-		{
-			theta[pos] = 0;
+			groupBins[i] = 0;
 		}
 	}
-	else
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// no early return, every item has to reach the barriers
+	for (int k = 0; k < PIXELS_PER_ITEM && row < rowEnd && col + k < colEnd; k++)
 	{
-		if (angle <= 9 * MPI / 8)
-		{
-			theta[pos] = 0;
-		}
-		else if (angle <= 11 * MPI / 8)
-		{
-			theta[pos] = 45;
-		}
-		else if (angle <= 13 * MPI / 8)
-		{
-			theta[pos] = 90;
-		}
-		else if (angle <= 15 * MPI / 8)
+		float2 gradient = sobel_pixel(inImage, outImage, theta, cols, row, col + k);
+		size_t cellRow = (row - originRow) / cellSize;
+		size_t cellCol = (col + k - originCol) / cellSize;
+		uint weight = histogram_weight(gradient);
+
+		if (cellRow < cellRows && cellCol < cellCols && weight > 0)
 		{
-			theta[pos] = 135;
+			uint bin = histogram_bin(gradient, bins);
+			if (gather)
+			{
+				atomic_add(&groupBins[((cellRow - firstCellRow) * spanCols + cellCol - firstCellCol) * bins + bin], weight);
+			}
+			else
+			{
+				atomic_add(&histograms[(cellRow * cellCols + cellCol) * bins + bin], weight);
+			}
 		}
-		else
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (gather)
+	{
+		for (uint i = lid; i < spanSize; i += groupSize)
 		{
-			theta[pos] = 0;
+			// only bins of whole cells inside the image are ever non-zero
+			if (groupBins[i] != 0)
+			{
+				size_t cellRow = firstCellRow + i / bins / spanCols;
+				size_t cellCol = firstCellCol + i / bins % spanCols;
+				atomic_add(&histograms[(cellRow * cellCols + cellCol) * bins + i % bins], groupBins[i]);
+			}
 		}
 	}
-	
 }
 
-__kernel void non_maxima_suppression(
+inline void non_maxima_pixel(
 	__global uchar *inImage,
 	__global uchar *outImage,
 	__global uchar *theta,
-	size_t rows,
-	size_t cols
-)
+	size_t cols, size_t row, size_t col)
 {
-	size_t row = get_global_id(0);
-	size_t col = get_global_id(1);
-
 	// define directions
 	const size_t pos = row * cols + col;
 	const size_t N = (row - 1) * cols + col;
@@ -210,43 +371,698 @@ __kernel void non_maxima_suppression(
 	}
 }
 
-__kernel void hysteresis_thresholding(
+__kernel void non_maxima_suppression(
 	__global uchar *inImage,
 	__global uchar *outImage,
-	size_t rows, size_t cols
+	__global uchar *theta,
+	size_t rows,
+	size_t cols,
+	size_t rowEnd,
+	size_t colEnd
 )
 {
-	uchar low = 50;
-	uchar high = 80;
+	size_t row = get_global_id(0);
+	size_t col = item_column();
+
+	if (row >= rowEnd)
+	{
+		return;
+	}
+
+	for (int k = 0; k < PIXELS_PER_ITEM && col + k < colEnd; k++)
+	{
+		non_maxima_pixel(inImage, outImage, theta, cols, row, col + k);
+	}
+}
+
+inline bool hysteresis_edge(uchar magnitude, uchar low, uchar high)
+{
 	uchar median = (low + high) / 2;
+
+	// in each position of (x, y), output the pixel if it is strong
+	if (magnitude > high)
+	{
+		return true;
+	}
+
+	// discard the pixel (x, y) if it is weak
+	else if (magnitude < low)
+	{
+		return false;
+	}
+
+	// if the pixel is a candidate, 
+	else
+	{
+		return magnitude >= median;
+	}
+}
+
+inline void hysteresis_pixel(
+	__global uchar *inImage,
+	__global uchar *outImage,
+	uchar low, uchar high,
+	size_t cols, size_t row, size_t col)
+{
 	const uchar EDGE = 255;
+	size_t pos = row * cols + col;
+
+	outImage[pos] = hysteresis_edge(inImage[pos], low, high) ? EDGE : 0;
+}
+
+// low and high come from the host, so re-thresholding the suppressed
+// magnitude left on the device needs no rebuild and no earlier stage
+__kernel void hysteresis_thresholding(
+	__global uchar *inImage,
+	__global uchar *outImage,
+	uchar low, uchar high,
+	size_t rows, size_t cols,
+	size_t rowEnd, size_t colEnd
+)
+{
+	size_t row = get_global_id(0);
+	size_t col = item_column();
+
+	if (row >= rowEnd)
+	{
+		return;
+	}
+
+	for (int k = 0; k < PIXELS_PER_ITEM && col + k < colEnd; k++)
+	{
+		hysteresis_pixel(inImage, outImage, low, high, cols, row, col + k);
+	}
+}
+
+// hysteresis_thresholding at one bit per pixel: bit col % 32 of word
+// col / 32 of each row, an eighth of the byte map to read back. A
+// work-group covers PACK_GROUP_SIZE columns of one row and gathers its
+// bits in local memory, so every word is stored once. Pixels within
+// border of the image edge are left clear, like the unwritten border of
+// the byte map.
+#define PACK_GROUP_SIZE 256
+
+__kernel __attribute__((reqd_work_group_size(1, PACK_GROUP_SIZE, 1)))
+void hysteresis_thresholding_packed(
+	__global uchar *inImage,
+	__global uint *packed,
+	size_t rows, size_t cols,
+	size_t pitch, size_t originRow, size_t originCol,
+	size_t border, size_t wordsPerRow,
+	uchar low, uchar high)
+{
+	__local uint words[PACK_GROUP_SIZE / 32];
 
 	size_t row = get_global_id(0);
 	size_t col = get_global_id(1);
-	size_t pos = row * cols + col;
+	uint lid = get_local_id(1);
 
-	// in each position of (x, y), output the pixel if it is strong
-	if (inImage[pos] > high)
+	if (lid < PACK_GROUP_SIZE / 32)
 	{
-		outImage[pos] = EDGE;
+		words[lid] = 0;
 	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	// discard the pixel (x, y) if it is weak
-	else if (inImage[pos] < low)
+	// groups start on a word, so lid gives the bit; only the columns of
+	// the last group overshoot
+	if (col >= border && col + border < cols && row >= border && row + border < rows &&
+		hysteresis_edge(inImage[(row + originRow) * pitch + col + originCol], low, high))
 	{
-		outImage[pos] = 0;
+		atomic_or(&words[lid / 32], 1u << (lid % 32));
 	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	// if the pixel is a candidate, 
+	size_t word = get_group_id(1) * (PACK_GROUP_SIZE / 32) + lid;
+	if (lid < PACK_GROUP_SIZE / 32 && word < wordsPerRow)
+	{
+		packed[row * wordsPerRow + word] = words[lid];
+	}
+}
+
+// Hysteresis for up to 16 (low, high) pairs from one read of the
+// magnitude, traced as CPUCanny::HysteresisSweep does: bit k of each pixel
+// is the edge map of thresholds[k]. hysteresis_sweep seeds the pairs a
+// pixel is above high for, then hysteresis_sweep_grow passes the bits on
+// to neighbours at or above low until a pass changes nothing. Where the
+// thresholds nest their bits travel together, so the pairs share one
+// trace of each component. Output rows are packed, cols apart; pixels
+// within border of the image edge hold no magnitude and stay clear, and
+// as on the CPU no edge starts on the outermost ring.
+
+// bits of the pairs an edge starts at this magnitude for
+inline uint sweep_seeds(uchar magnitude, __constant uchar2 *thresholds, uint count)
+{
+	uint bits = 0;
+	for (uint k = 0; k < count; k++)
+	{
+		if (magnitude > thresholds[k].y)
+		{
+			bits |= 1u << k;
+		}
+	}
+	return bits;
+}
+
+// bits of the pairs an edge carries on through this magnitude for
+inline uint sweep_allowed(uchar magnitude, __constant uchar2 *thresholds, uint count)
+{
+	uint bits = 0;
+	for (uint k = 0; k < count; k++)
+	{
+		if (magnitude >= thresholds[k].x)
+		{
+			bits |= 1u << k;
+		}
+	}
+	return bits;
+}
+
+inline uint hysteresis_sweep_bits(
+	__global uchar *inImage,
+	__constant uchar2 *thresholds, uint count,
+	size_t rows, size_t cols,
+	size_t pitch, size_t originRow, size_t originCol,
+	size_t row, size_t col)
+{
+	if (col < 1 || col + 1 >= cols || row < 1 || row + 1 >= rows)
+	{
+		return 0;
+	}
+
+	uchar magnitude = inImage[(row + originRow) * pitch + col + originCol];
+	return sweep_seeds(magnitude, thresholds, count);
+}
+
+// seeds of up to 8 pairs, a byte per pixel
+__kernel void hysteresis_sweep(
+	__global uchar *inImage,
+	__global uchar *sweep,
+	__constant uchar2 *thresholds, uint count,
+	size_t rows, size_t cols,
+	size_t pitch, size_t originRow, size_t originCol)
+{
+	size_t row = get_global_id(0);
+	size_t col = get_global_id(1);
+
+	if (row >= rows || col >= cols)
+	{
+		return;
+	}
+
+	sweep[row * cols + col] = (uchar)hysteresis_sweep_bits(inImage, thresholds, count,
+		rows, cols, pitch, originRow, originCol, row, col);
+}
+
+// seeds of 9 to 16 pairs, two bytes per pixel
+__kernel void hysteresis_sweep16(
+	__global uchar *inImage,
+	__global ushort *sweep,
+	__constant uchar2 *thresholds, uint count,
+	size_t rows, size_t cols,
+	size_t pitch, size_t originRow, size_t originCol)
+{
+	size_t row = get_global_id(0);
+	size_t col = get_global_id(1);
+
+	if (row >= rows || col >= cols)
+	{
+		return;
+	}
+
+	sweep[row * cols + col] = (ushort)hysteresis_sweep_bits(inImage, thresholds, count,
+		rows, cols, pitch, originRow, originCol, row, col);
+}
+
+// must match SWEEP_TILE in OCLCanny.cpp
+#define SWEEP_TILE 16
+#define SWEEP_SPAN (SWEEP_TILE + 2)
+
+// One pass of growing the sweep bits. Each work-group copies its tile and
+// a ring of neighbours to local memory and spreads the bits inside the
+// tile until they settle, so a pass carries an edge across a whole tile;
+// the ring is only read, other groups own it. tile holds the bits read
+// from sweep, the return value is what the pixel holds after the pass.
+inline uint hysteresis_sweep_grow_tile(
+	__global uchar *inImage,
+	__local uint *tile,
+	__local int *grew,
+	__constant uchar2 *thresholds, uint count,
+	size_t rows, size_t cols,
+	size_t pitch, size_t originRow, size_t originCol,
+	size_t border)
+{
+	size_t row = get_global_id(0);
+	size_t col = get_global_id(1);
+	size_t localRow = get_local_id(0) + 1;
+	size_t localCol = get_local_id(1) + 1;
+
+	uint allowed = 0;
+	if (row >= border && col >= border && row + border < rows && col + border < cols)
+	{
+		allowed = sweep_allowed(inImage[(row + originRow) * pitch + col + originCol], thresholds, count);
+	}
+
+	uint bits = tile[localRow * SWEEP_SPAN + localCol];
+	int settled = 0;
+	while (!settled)
+	{
+		if (localRow == 1 && localCol == 1)
+		{
+			*grew = 0;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		uint gained = 0;
+		for (int dy = -1; dy <= 1; dy++)
+		{
+			for (int dx = -1; dx <= 1; dx++)
+			{
+				gained |= tile[(localRow + dy) * SWEEP_SPAN + localCol + dx];
+			}
+		}
+		gained &= allowed & ~bits;
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		if (gained)
+		{
+			bits |= gained;
+			tile[localRow * SWEEP_SPAN + localCol] = bits;
+			*grew = 1;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		settled = !*grew;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	return bits;
+}
+
+// growing pass of up to 8 pairs; changed is set when any pixel gained bits
+__kernel __attribute__((reqd_work_group_size(SWEEP_TILE, SWEEP_TILE, 1)))
+void hysteresis_sweep_grow(
+	__global uchar *inImage,
+	__global uchar *sweep,
+	__constant uchar2 *thresholds, uint count,
+	size_t rows, size_t cols,
+	size_t pitch, size_t originRow, size_t originCol,
+	size_t border,
+	__global uint *changed)
+{
+	__local uint tile[SWEEP_SPAN * SWEEP_SPAN];
+	__local int grew;
+
+	// the tile and its ring, no bits outside the image
+	size_t firstRow = get_group_id(0) * SWEEP_TILE;
+	size_t firstCol = get_group_id(1) * SWEEP_TILE;
+	for (size_t i = get_local_id(0) * SWEEP_TILE + get_local_id(1); i < SWEEP_SPAN * SWEEP_SPAN; i += SWEEP_TILE * SWEEP_TILE)
+	{
+		size_t r = firstRow + i / SWEEP_SPAN - 1;
+		size_t c = firstCol + i % SWEEP_SPAN - 1;
+		tile[i] = r < rows && c < cols ? sweep[r * cols + c] : 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	size_t row = get_global_id(0);
+	size_t col = get_global_id(1);
+	uint before = row < rows && col < cols ? sweep[row * cols + col] : 0;
+	uint bits = hysteresis_sweep_grow_tile(inImage, tile, &grew, thresholds, count,
+		rows, cols, pitch, originRow, originCol, border);
+
+	if (bits != before)
+	{
+		sweep[row * cols + col] = (uchar)bits;
+		*changed = 1;
+	}
+}
+
+// growing pass of 9 to 16 pairs
+__kernel __attribute__((reqd_work_group_size(SWEEP_TILE, SWEEP_TILE, 1)))
+void hysteresis_sweep_grow16(
+	__global uchar *inImage,
+	__global ushort *sweep,
+	__constant uchar2 *thresholds, uint count,
+	size_t rows, size_t cols,
+	size_t pitch, size_t originRow, size_t originCol,
+	size_t border,
+	__global uint *changed)
+{
+	__local uint tile[SWEEP_SPAN * SWEEP_SPAN];
+	__local int grew;
+
+	// the tile and its ring, no bits outside the image
+	size_t firstRow = get_group_id(0) * SWEEP_TILE;
+	size_t firstCol = get_group_id(1) * SWEEP_TILE;
+	for (size_t i = get_local_id(0) * SWEEP_TILE + get_local_id(1); i < SWEEP_SPAN * SWEEP_SPAN; i += SWEEP_TILE * SWEEP_TILE)
+	{
+		size_t r = firstRow + i / SWEEP_SPAN - 1;
+		size_t c = firstCol + i % SWEEP_SPAN - 1;
+		tile[i] = r < rows && c < cols ? sweep[r * cols + c] : 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	size_t row = get_global_id(0);
+	size_t col = get_global_id(1);
+	uint before = row < rows && col < cols ? sweep[row * cols + col] : 0;
+	uint bits = hysteresis_sweep_grow_tile(inImage, tile, &grew, thresholds, count,
+		rows, cols, pitch, originRow, originCol, border);
+
+	if (bits != before)
+	{
+		sweep[row * cols + col] = (ushort)bits;
+		*changed = 1;
+	}
+}
+
+// Fill the apron of a padded buffer with the nearest image pixel. The
+// image starts at (originRow, originCol) and rows are pitch bytes apart;
+// items cover the apron rows above and below first (corners included),
+// then the apron columns left and right of each image row.
+__kernel void replicate_apron(
+	__global uchar *image,
+	size_t rows, size_t cols,
+	size_t pitch, size_t originRow, size_t originCol,
+	size_t apron)
+{
+	size_t id = get_global_id(0);
+	size_t width = cols + 2 * apron;
+	long row, col;
+
+	if (id < 2 * apron * width)
+	{
+		row = id / width;
+		col = id % width;
+		row = row < apron ? row - apron : rows + row - apron;
+		col -= apron;
+	}
 	else
 	{
-		if (inImage[pos] >= median)
+		id -= 2 * apron * width;
+		if (id >= 2 * apron * rows)
+		{
+			return;
+		}
+
+		row = id / (2 * apron);
+		col = id % (2 * apron);
+		col = col < apron ? col - apron : cols + col - apron;
+	}
+
+	long sourceRow = clamp(row, 0L, (long)rows - 1);
+	long sourceCol = clamp(col, 0L, (long)cols - 1);
+
+	long stride = (long)pitch;
+	long origin = (long)originRow * stride + (long)originCol;
+	image[origin + row * stride + col] = image[origin + sourceRow * stride + sourceCol];
+}
+
+// image2d_t variants of the stencil stages. Reads go through the texture
+// path and the sampler clamps coordinates to the edge, so these kernels
+// run over the whole image with no offset and no border branches; only
+// the items of the last work-groups past the image return early.
+#ifdef __IMAGE_SUPPORT__
+
+__constant sampler_t clampSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+__kernel void gaussian_blur_image(
+	__read_only image2d_t inImage,
+	__write_only image2d_t outImage,
+	size_t rows, size_t cols)
+{
+	int sum = 0;
+	int row = get_global_id(0);
+	int col = get_global_id(1);
+
+	// the range is rounded up to whole work-groups
+	if (row >= rows || col >= cols)
+	{
+		return;
+	}
+
+	for (int i = 0; i < 5; i++)
+		#pragma unroll
+		for (int j = 0; j < 5; j++)
+			sum += gaussian_kernel[i][j] * read_imageui(inImage, clampSampler, (int2)(j + col - 1, i + row - 1)).x;
+
+	write_imageui(outImage, (int2)(col, row), (uint4)(min(255, max(0, sum)), 0, 0, 0));
+}
+
+__kernel void sobel_operation_image(
+	__read_only image2d_t inImage,
+	__global uchar *outImage,
+	__global uchar *theta,
+	size_t rows, size_t cols)
+{
+	float sumx = 0, sumy = 0;
+	int row = get_global_id(0);
+	int col = get_global_id(1);
+	size_t pos = row * cols + col;
+
+	if (row >= rows || col >= cols)
+	{
+		return;
+	}
+
+	// find gx and gy
+	for (int i = 0; i < 3; i++)
+	{
+		#pragma unroll
+		for (int j = 0; j < 3; j++)
+		{
+			float pixel = read_imageui(inImage, clampSampler, (int2)(j + col - 1, i + row - 1)).x;
+			sumx += sobel_gx_kernel[i][j] * pixel;
+			sumy += sobel_gy_kernel[i][j] * pixel;
+		}
+	}
+
+	outImage[pos] = min(255, max(0, (int)hypot(sumx, sumy)));
+
+	theta[pos] = quantize_gradient((int)sumx, (int)sumy);
+}
+
+#endif
+
+// Stream compaction of the final edge map into a list of coordinates.
+// Each work-group prefix-sums its edge flags in local memory and
+// reserves space in the output with a single atomic, so only the count
+// and the list need to be read back. Pixels within border of the image
+// edge are skipped, the stencils never write them in packed buffers.
+#define COMPACT_GROUP_SIZE 256
+
+__kernel __attribute__((reqd_work_group_size(COMPACT_GROUP_SIZE, 1, 1)))
+void compact_edges(
+	__global uchar *edges,
+	__global uchar *magnitude,
+	__global uchar *theta,
+	__global uint *count,
+	__global uint2 *coords,
+	__global uchar *edgeMagnitude,
+	__global uchar *edgeDirection,
+	uint withAttributes,
+	size_t rows, size_t cols,
+	size_t pitch, size_t originRow, size_t originCol,
+	size_t border)
+{
+	__local uint scan[COMPACT_GROUP_SIZE];
+	__local uint groupOffset;
+
+	// work items walk the image pixels, pos is where one sits in a
+	// (possibly padded) buffer
+	size_t index = get_global_id(0);
+	size_t row = index / cols;
+	size_t col = index % cols;
+	size_t pos = (row + originRow) * pitch + col + originCol;
+	uint lid = get_local_id(0);
+	uint isEdge = (index < rows * cols &&
+		col >= border && col + border < cols && row >= border && row + border < rows &&
+		edges[pos] == 255) ? 1 : 0;
+
+	// inclusive scan of the edge flags
+	scan[lid] = isEdge;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint offset = 1; offset < COMPACT_GROUP_SIZE; offset <<= 1)
+	{
+		uint value = (lid >= offset) ? scan[lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scan[lid] += value;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	// the last item holds the group total
+	if (lid == COMPACT_GROUP_SIZE - 1)
+	{
+		groupOffset = atomic_add(count, scan[lid]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (isEdge)
+	{
+		uint slot = groupOffset + scan[lid] - 1;
+		coords[slot] = (uint2)(col, row);
+
+		if (withAttributes)
+		{
+			edgeMagnitude[slot] = magnitude[pos];
+			edgeDirection[slot] = theta[pos];
+		}
+	}
+}
+
+// 8-neighbourhood of every compacted edge as a bit mask, in the order
+// E, N, W, S, NE, NW, SW, SE. The host links chains from the list and
+// the masks without downloading the edge map. Neighbours within border
+// of the image edge never count, as in compact_edges.
+__constant int link_dx[8] = { 1, 0, -1, 0, 1, -1, -1, 1 };
+__constant int link_dy[8] = { 0, -1, 0, 1, -1, -1, 1, 1 };
+
+__kernel void edge_neighbours(
+	__global uchar *edges,
+	__global uint2 *coords,
+	__global uchar *masks,
+	uint count,
+	size_t rows, size_t cols,
+	size_t pitch, size_t originRow, size_t originCol,
+	size_t border)
+{
+	size_t index = get_global_id(0);
+	if (index >= count)
+	{
+		return;
+	}
+
+	int x = coords[index].x;
+	int y = coords[index].y;
+	uchar mask = 0;
+
+	for (int i = 0; i < 8; i++)
+	{
+		int nx = x + link_dx[i];
+		int ny = y + link_dy[i];
+
+		if (nx >= (int)border && nx + (int)border < (int)cols && ny >= (int)border && ny + (int)border < (int)rows &&
+			edges[(ny + originRow) * pitch + nx + originCol] == 255)
 		{
-			outImage[pos] = EDGE;
+			mask |= (uchar)(1 << i);
 		}
-		else
+	}
+
+	masks[index] = mask;
+}
+
+// Hough voting from the compacted edge list. Each work-group owns a
+// tile of the (theta, rho) accumulator in local memory, so the votes
+// are local atomics and the tile is written out once without global
+// atomics. Edges only vote within window bins of their direction.
+__kernel void hough_vote(
+	__global uint2 *coords,
+	__global uchar *directions,
+	uint count,
+	__global float2 *trig,
+	__global uint *accumulator,
+	__local uint *localAccumulator,
+	int thetaBins, int rhoBins, int rhoOffset, int window,
+	int thetaTile, int rhoTile)
+{
+	int rhoTiles = (rhoBins + rhoTile - 1) / rhoTile;
+	int thetaStart = (get_group_id(0) / rhoTiles) * thetaTile;
+	int rhoStart = (get_group_id(0) % rhoTiles) * rhoTile;
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+
+	for (int i = lid; i < thetaTile * rhoTile; i += lsize)
+	{
+		localAccumulator[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint e = lid; e < count; e += lsize)
+	{
+		float x = coords[e].x;
+		float y = coords[e].y;
+		int centre = directions[e] * thetaBins / 180;
+
+		for (int t = 0; t < thetaTile; t++)
 		{
-			outImage[pos] = 0;
+			int theta = thetaStart + t;
+			if (theta >= thetaBins)
+			{
+				break;
+			}
+
+			int distance = abs(theta - centre);
+			if (min(distance, thetaBins - distance) > window)
+			{
+				continue;
+			}
+
+			int rho = (int)floor(x * trig[theta].x + y * trig[theta].y + 0.5f) + rhoOffset - rhoStart;
+			if (rho >= 0 && rho < rhoTile)
+			{
+				atomic_inc(&localAccumulator[t * rhoTile + rho]);
+			}
 		}
 	}
-}
\ No newline at end of file
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < thetaTile * rhoTile; i += lsize)
+	{
+		int theta = thetaStart + i / rhoTile;
+		int rho = rhoStart + i % rhoTile;
+
+		if (theta < thetaBins && rho < rhoBins)
+		{
+			accumulator[theta * rhoBins + rho] = localAccumulator[i];
+		}
+	}
+}
+
+// local maxima of the accumulator, appended as (rho, theta, votes)
+__kernel void hough_peaks(
+	__global uint *accumulator,
+	int thetaBins, int rhoBins, int rhoOffset, uint threshold,
+	__global uint *lineCount,
+	__global float4 *lines,
+	uint capacity)
+{
+	int theta = get_global_id(0);
+	int rho = get_global_id(1);
+
+	if (theta >= thetaBins || rho >= rhoBins)
+	{
+		return;
+	}
+
+	uint votes = accumulator[theta * rhoBins + rho];
+	if (votes < threshold)
+	{
+		return;
+	}
+
+	// on a plateau the first cell in scan order wins
+	for (int dt = -1; dt <= 1; dt++)
+	{
+		for (int dr = -1; dr <= 1; dr++)
+		{
+			int t = theta + dt;
+			int r = rho + dr;
+			if ((dt == 0 && dr == 0) || t < 0 || t >= thetaBins || r < 0 || r >= rhoBins)
+			{
+				continue;
+			}
+
+			uint neighbour = accumulator[t * rhoBins + r];
+			bool earlier = dt < 0 || (dt == 0 && dr < 0);
+			if (neighbour > votes || (neighbour == votes && earlier))
+			{
+				return;
+			}
+		}
+	}
+
+	uint index = atomic_inc(lineCount);
+	if (index < capacity)
+	{
+		lines[index] = (float4)(rho - rhoOffset, theta * M_PI_F / thetaBins, votes, 0);
+	}
+}
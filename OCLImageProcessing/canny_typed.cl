@@ -0,0 +1,230 @@
+// Canny stages on 16 bit or float pixels, built with the pixel type
+// given on the command line, e.g.
+//   -D PIXEL=ushort -D CONVERT_PIXEL=convert_ushort_sat_rte
+// Gradients are float, the full 16 bit magnitude range does not fit any
+// narrower type. The 8 bit kernels are in canny.cl.
+#ifndef GRAD
+#define GRAD float
+#endif
+
+__constant float gaussian_kernel[5][5] = {
+	{ 0.00224214, 0.0165673, 0.0165673, 0.0165673, 0.00224214 },
+	{ 0.0165673, 0.0450347, 0.122417, 0.0450347, 0.0165673 },
+	{ 0.0165673, 0.122417, 0.122417, 0.122417, 0.0165673 },
+	{ 0.0165673, 0.0450347, 0.122417, 0.0450347, 0.0165673 },
+	{ 0.00224214, 0.0165673, 0.0165673, 0.0165673, 0.00224214 }
+};
+
+__constant int sobel_gx_kernel[3][3] = {
+	{ -1, 0, 1 },
+	{ -2, 0, 2 },
+	{ -1, 0, 1 }
+};
+
+__constant int sobel_gy_kernel[3][3] = {
+	{ -1,-2,-1 },
+	{ 0, 0, 0 },
+	{ 1, 2, 1 }
+};
+
+__kernel void gaussian_blur_typed(
+	__global PIXEL *inImage,
+	__global PIXEL *outImage,
+	size_t rows, size_t cols)
+{
+	float sum = 0;
+	size_t row = get_global_id(0);
+	size_t col = get_global_id(1);
+	size_t pos = row * cols + col;
+
+	// the range is rounded up to whole work-groups
+	if (row >= rows - 1 || col >= cols - 1)
+	{
+		return;
+	}
+
+	for (int i = 0; i < 5; i++)
+		#pragma unroll
+		for (int j = 0; j < 5; j++)
+			sum += gaussian_kernel[i][j] * inImage[(i + row - 1)*cols + (j + col - 1)];
+
+	outImage[pos] = CONVERT_PIXEL(sum);
+}
+
+__kernel void sobel_operation_typed(
+	__global PIXEL *inImage,
+	__global GRAD *outImage,
+	__global uchar *theta,
+	size_t rows, size_t cols)
+{
+	const float MPI = 3.14159265f;
+	float sumx = 0, sumy = 0, angle = 0;
+	size_t row = get_global_id(0);
+	size_t col = get_global_id(1);
+	size_t pos = row * cols + col;
+
+	if (row >= rows - 1 || col >= cols - 1)
+	{
+		return;
+	}
+
+	// find gx and gy
+	for (int i = 0; i < 3; i++)
+	{
+		#pragma unroll
+		for (int j = 0; j < 3; j++)
+		{
+			sumx += sobel_gx_kernel[i][j] * (float)inImage[(i + row - 1) * cols + (j + col - 1)];
+			sumy += sobel_gy_kernel[i][j] * (float)inImage[(i + row - 1) * cols + (j + col - 1)];
+		}
+	}
+
+	// no saturation, the magnitude keeps the range of the input
+	outImage[pos] = hypot(sumx, sumy);
+
+	// get direction; these gradients are not whole numbers, so unlike
+	// canny.cl this keeps the rounded angle, as QuantizeAngle does
+	angle = atan2(sumy, sumx);
+
+	// if angle is negative, then shift by 2PI
+	if (angle < 0.0f)
+	{
+		angle = fmod((angle + 2 * MPI), (2 * MPI));
+	}
+
+	// round angles to 0, 45, 90 and 135 degs
+	// angles are equally likely to distribute between 
+	// 0~PI and PI~2PI
+	if (angle <= MPI)
+	{
+		if (angle <= MPI / 8)
+		{
+			theta[pos] = 0;
+		}
+		else if (angle <= 3 * MPI / 8)
+		{
+			theta[pos] = 45;
+		}
+		else if (angle <= 5 * MPI / 8)
+		{
+			theta[pos] = 90;
+		}
+		else if (angle <= 7 * MPI / 8)
+		{
+			theta[pos] = 135;
+		}
+		else
+		{
+			theta[pos] = 0;
+		}
+	}
+	else
+	{
+		if (angle <= 9 * MPI / 8)
+		{
+			theta[pos] = 0;
+		}
+		else if (angle <= 11 * MPI / 8)
+		{
+			theta[pos] = 45;
+		}
+		else if (angle <= 13 * MPI / 8)
+		{
+			theta[pos] = 90;
+		}
+		else if (angle <= 15 * MPI / 8)
+		{
+			theta[pos] = 135;
+		}
+		else
+		{
+			theta[pos] = 0;
+		}
+	}
+}
+
+__kernel void non_maxima_suppression_typed(
+	__global GRAD *inImage,
+	__global GRAD *outImage,
+	__global uchar *theta,
+	size_t rows,
+	size_t cols
+)
+{
+	size_t row = get_global_id(0);
+	size_t col = get_global_id(1);
+	size_t pos = row * cols + col;
+
+	if (row >= rows - 1 || col >= cols - 1)
+	{
+		return;
+	}
+
+	size_t a, b;
+
+	// the two neighbours along the gradient
+	switch (theta[pos])
+	{
+		case 0:
+			a = pos + 1;
+			b = pos - 1;
+			break;
+		case 45:
+			a = pos - cols + 1;
+			b = pos + cols - 1;
+			break;
+		case 90:
+			a = pos - cols;
+			b = pos + cols;
+			break;
+		case 135:
+			a = pos - cols - 1;
+			b = pos + cols + 1;
+			break;
+		default:
+			a = pos;
+			b = pos;
+			break;
+	}
+
+	// supress current pixel if a neighbour has larger magnitude
+	if (inImage[pos] < inImage[a] || inImage[pos] < inImage[b])
+	{
+		outImage[pos] = 0;
+	}
+	else
+	{
+		outImage[pos] = inImage[pos];
+	}
+}
+
+// hysteresis_thresholding with the thresholds in units of the input
+__kernel void hysteresis_thresholding_typed(
+	__global GRAD *inImage,
+	__global uchar *outImage,
+	size_t rows, size_t cols,
+	float low, float high
+)
+{
+	float median = (low + high) / 2;
+	const uchar EDGE = 255;
+
+	size_t row = get_global_id(0);
+	size_t col = get_global_id(1);
+	size_t pos = row * cols + col;
+
+	if (row >= rows - 1 || col >= cols - 1)
+	{
+		return;
+	}
+
+	// strong pixels and candidates above the median are edges
+	if (inImage[pos] > high || (inImage[pos] >= low && inImage[pos] >= median))
+	{
+		outImage[pos] = EDGE;
+	}
+	else
+	{
+		outImage[pos] = 0;
+	}
+}
@@ -1,13 +1,31 @@
-#include <iostream>
+﻿#include <iostream>
 #include <string>
 #include <random>
 #include <cmath>
+#include <thread>
+#include <stdexcept>
+#include <csignal>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/core/ocl.hpp>
 
 #include "utils.h"
 #include "Timer.h"
+#include "MappedImage.h"
+#include "BatchProcessor.h"
+#include "HybridCanny.h"
+#include "MultiDeviceCanny.h"
+#include "StageGraph.h"
+#include "AutoCanny.h"
+#include "Trace.h"
+#include "PerfCounters.h"
+#include "TypedCanny.h"
+#include "AsyncCanny.h"
+#include "LiveCapture.h"
+#include "EdgeServer.h"
+#include "EdgeClient.h"
+#include "WarmupCanny.h"
+#include "CPUDispatch.h"
 
 #include "OCLCanny.h"
 #include "CPUCanny.h"
@@ -157,6 +175,41 @@ void CannyDetailCPUTest(size_t size)
 	cout << "Hysteresis: " << timer.getElapsedTimeInMicroSec() << "\n";
 }
 
+void CannyCounterCPUTest(size_t size, int frames)
+{
+	// create random image
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+	unsigned char *pRandomImage = (unsigned char *)malloc(size * size);
+
+	for (size_t pixel = 0; pixel < size * size; pixel++)
+	{
+		pRandomImage[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	Mat inputImage(size, size, CV_8UC1, pRandomImage);
+	Mat edges;
+
+	PerfCounters counters;
+	CPUCanny imageProcessor;
+	imageProcessor.setPerfCounters(&counters);
+
+	// the first frame warms caches and allocations
+	imageProcessor.Process(inputImage, edges);
+	counters.Reset();
+
+	for (int frame = 0; frame < frames; frame++)
+	{
+		imageProcessor.Process(inputImage, edges);
+	}
+
+	cout << "Size: " << size << " x " << frames << " frames\n";
+	counters.Print(cout);
+
+	free(pRandomImage);
+}
+
 void CannyDetailGPUTest(size_t size)
 {
 	// create random image
@@ -214,15 +267,838 @@ void CannyDetailGPUTest(size_t size)
 	cout << "Hysteresis: " << timer.getElapsedTimeInMicroSec() << "\n";
 }
 
+void CannyHybridTest(size_t size, int cpuWorkers, int oclWorkers)
+{
+	// create random image
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+	unsigned char *pRandomImage = (unsigned char *)malloc(size * size);
+
+	for (size_t pixel = 0; pixel < size * size; pixel++)
+	{
+		pRandomImage[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	Mat inputImage(size, size, CV_8UC1, pRandomImage);
+
+	Timer timer;
+	HybridCanny imageProcessor(cpuWorkers, oclWorkers);
+
+	cout << "Size: " << size << "\n";
+
+	// the split settles after a few frames
+	for (int frame = 0; frame < 8; frame++)
+	{
+		timer.start();
+		imageProcessor.Process(inputImage);
+		timer.stop();
+		cout << "Frame " << frame << ": " << timer.getElapsedTimeInMicroSec() << "us\n";
+	}
+
+	imageProcessor.PrintSplit(cout);
+	free(pRandomImage);
+}
+
+void CannyMultiDeviceTest(size_t size, int frameCount, bool splitNUMA)
+{
+	// create random images
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+
+	vector<Mat> frames(frameCount);
+	for (int frame = 0; frame < frameCount; frame++)
+	{
+		frames[frame] = Mat(size, size, CV_8UC1);
+		for (size_t pixel = 0; pixel < size * size; pixel++)
+		{
+			frames[frame].data[pixel] = (unsigned char)std::round(d(gen));
+		}
+	}
+
+	Timer timer;
+	MultiDeviceCanny imageProcessor(splitNUMA);
+
+	vector<Mat> edges;
+	timer.start();
+	imageProcessor.Process(frames, edges);
+	timer.stop();
+
+	cout << "Size: " << size << " Frames: " << frameCount
+		<< " Devices: " << imageProcessor.getDeviceCount()
+		<< " Total: " << timer.getElapsedTimeInMicroSec() << "us\n";
+	imageProcessor.PrintDevices(cout);
+}
+
+void CannyMemoryPathTest(size_t size)
+{
+	// create random image
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+	unsigned char *pRandomImage = (unsigned char *)malloc(size * size);
+
+	for (size_t pixel = 0; pixel < size * size; pixel++)
+	{
+		pRandomImage[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	Mat inputImage(size, size, CV_8UC1, pRandomImage);
+
+	Timer timer;
+	OCLCanny imageProcessor;
+	const char *names[2] = { "Buffer", "Image" };
+	OCLCanny::MemoryPath paths[2] = { OCLCanny::MemoryPath::Buffer, OCLCanny::MemoryPath::Image };
+
+	cout << "Size: " << size << "\n";
+	for (int path = 0; path < 2; path++)
+	{
+		imageProcessor.setMemoryPath(paths[path]);
+
+		double totalTime = 0.0f;
+		for (int tried = 0; tried < 10; tried++)
+		{
+			timer.start();
+
+			imageProcessor.LoadOCVImage(inputImage);
+			imageProcessor.Gaussian();
+			imageProcessor.Sobel();
+			imageProcessor.NonMaximaSuppression();
+			imageProcessor.HysteresisThresholding();
+			imageProcessor.getOutputImage();
+
+			timer.stop();
+			totalTime += timer.getElapsedTimeInMicroSec();
+		}
+		cout << names[path] << " Avg: " << totalTime / 10 << "us\n";
+	}
+
+	free(pRandomImage);
+}
+
+void CannyEdgeListTest(size_t size)
+{
+	// create random image
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+	unsigned char *pRandomImage = (unsigned char *)malloc(size * size);
+
+	for (size_t pixel = 0; pixel < size * size; pixel++)
+	{
+		pRandomImage[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	Mat inputImage(size, size, CV_8UC1, pRandomImage);
+
+	Timer timer;
+	OCLCanny imageProcessor;
+
+	imageProcessor.LoadOCVImage(inputImage);
+	imageProcessor.Gaussian();
+	imageProcessor.Sobel();
+	imageProcessor.NonMaximaSuppression();
+	imageProcessor.HysteresisThresholding();
+	imageProcessor.wait();
+
+	cout << "Size: " << size << "\n";
+
+	timer.start();
+	Mat out = imageProcessor.getOutputImage();
+	timer.stop();
+	cout << "Full readback: " << timer.getElapsedTimeInMicroSec() << "us, "
+		<< cv::countNonZero(out) << " edges\n";
+
+	timer.start();
+	vector<EdgePoint> edges = imageProcessor.getEdgeList(true);
+	timer.stop();
+	cout << "Edge list: " << timer.getElapsedTimeInMicroSec() << "us, "
+		<< edges.size() << " edges\n";
+
+	free(pRandomImage);
+}
+
+void CannyStageGraphTest(size_t size)
+{
+	// create random image
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+	unsigned char *pRandomImage = (unsigned char *)malloc(size * size);
+
+	for (size_t pixel = 0; pixel < size * size; pixel++)
+	{
+		pRandomImage[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	Mat inputImage(size, size, CV_8UC1, pRandomImage);
+
+	// contrast stretch before and inverted edges after. Only chains of
+	// pointwise stages fuse, so each of these is a pass of its own next
+	// to the Canny stencils; the plan shows the steps.
+	Stage stretch = StageGraph::Pointwise("stretch", "input", "stretched",
+		[](unsigned char v) { return (unsigned char)std::min(255, std::max(0, 2 * v - 64)); }, "2 * v - 64");
+
+	StageGraph graph;
+	graph.AddStage(stretch);
+	graph.AddCanny("stretched", "edges");
+	graph.AddStage(StageGraph::Pointwise("invert", "edges", "inverted",
+		[](unsigned char v) { return (unsigned char)(255 - v); }, "255 - v"));
+
+	if (!graph.Compile())
+	{
+		free(pRandomImage);
+		return;
+	}
+	graph.PrintPlan(cout);
+
+	// the same without the inversion, inverted afterwards
+	StageGraph reference;
+	reference.AddStage(stretch);
+	reference.AddCanny("stretched", "edges");
+
+	Mat expected;
+	cv::bitwise_not(reference.RunCPU(inputImage), expected);
+
+	Timer timer;
+
+	timer.start();
+	Mat cpuOut = graph.RunCPU(inputImage);
+	timer.stop();
+	cout << "Graph CPU: " << timer.getElapsedTimeInMicroSec() << "us\n";
+
+	timer.start();
+	Mat oclOut = graph.RunOCL(inputImage);
+	timer.stop();
+	cout << "Graph OCL: " << timer.getElapsedTimeInMicroSec() << "us\n";
+
+	cout << "Graph CPU: " << cv::norm(cpuOut, expected, cv::NORM_L1) / 255 << " pixels differ from the reference\n";
+	if (!oclOut.empty())
+	{
+		cout << "Graph OCL: " << cv::norm(oclOut, expected, cv::NORM_L1) / 255 << " pixels differ from the reference\n";
+	}
+
+	free(pRandomImage);
+}
+
+void CannyAutoBackendTest()
+{
+	AutoCanny engine;
+	engine.PrintProfile(cout);
+
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+
+	const int sizes[] = { 100, 300, 720, 1500, 3000 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		Mat inputImage(sizes[i], sizes[i], CV_8UC1);
+		for (size_t pixel = 0; pixel < inputImage.total(); pixel++)
+		{
+			inputImage.data[pixel] = (unsigned char)std::round(d(gen));
+		}
+
+		Timer timer;
+		Mat edges;
+
+		timer.start();
+		engine.Process(inputImage, edges);
+		timer.stop();
+
+		cout << sizes[i] << "^2 -> " << engine.Select(sizes[i], sizes[i]).getName()
+			<< ": " << timer.getElapsedTimeInMicroSec() << "us\n";
+	}
+}
+
+// TypedCanny and OCLCanny::ProcessTyped on the same frame, timed and
+// compared; the float gradients may round differently on the device
+template <typename Pixel>
+void CannyTypedCompare(const Mat &inputImage, const char *label)
+{
+	Timer timer;
+	Mat cpuEdges, oclEdges;
+
+	TypedCanny<Pixel> cpuCanny;
+	timer.start();
+	cpuCanny.Process(inputImage, cpuEdges);
+	timer.stop();
+	cout << "Typed CPU (" << label << "): " << timer.getElapsedTimeInMicroSec() << "us\n";
+
+	OCLCanny oclCanny;
+	timer.start();
+	oclCanny.ProcessTyped(inputImage, oclEdges, cpuCanny.getLowThreshold(), cpuCanny.getHighThreshold());
+	timer.stop();
+	cout << "Typed OCL (" << label << "): " << timer.getElapsedTimeInMicroSec() << "us\n";
+
+	if (oclEdges.rows != cpuEdges.rows || oclEdges.cols != cpuEdges.cols)
+	{
+		cout << "Typed OCL (" << label << "): no output\n";
+		return;
+	}
+	cout << "Typed (" << label << "): " << cv::countNonZero(cpuEdges) << " edges, "
+		<< cv::norm(cpuEdges, oclEdges, cv::NORM_L1) / 255 << " pixels differ between CPU and OCL\n";
+}
+
+void CannyTypedTest(size_t size)
+{
+	// 16 bit random image, as a depth or X-ray source would deliver it
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64 * 257, 25 * 257);
+
+	Mat inputImage(size, size, CV_16UC1);
+	for (size_t row = 0; row < size; row++)
+	{
+		for (size_t col = 0; col < size; col++)
+		{
+			inputImage.at<unsigned short>(row, col) = (unsigned short)std::min(65535.0, std::max(0.0, std::round(d(gen))));
+		}
+	}
+
+	// the same frame as float in 0~1
+	Mat floatImage;
+	inputImage.convertTo(floatImage, CV_32FC1, 1.0 / 65535);
+
+	CannyTypedCompare<unsigned short>(inputImage, "16 bit");
+	CannyTypedCompare<float>(floatImage, "float");
+}
+
+void CannyPackedTest(size_t size)
+{
+	// create random image
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+
+	Mat inputImage(size, size, CV_8UC1);
+	for (size_t pixel = 0; pixel < inputImage.total(); pixel++)
+	{
+		inputImage.data[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	Timer timer;
+	Mat edges;
+	PackedEdgeMap packedEdges;
+	OCLCanny imageProcessor;
+
+	// warm up buffers and kernels
+	imageProcessor.Process(inputImage, edges);
+	imageProcessor.ProcessPacked(inputImage, packedEdges);
+
+	timer.start();
+	imageProcessor.Process(inputImage, edges);
+	timer.stop();
+	cout << "Bytes: " << timer.getElapsedTimeInMicroSec() << "us, " << edges.total() << " bytes read back\n";
+
+	timer.start();
+	imageProcessor.ProcessPacked(inputImage, packedEdges);
+	timer.stop();
+	cout << "Packed: " << timer.getElapsedTimeInMicroSec() << "us, " << packedEdges.getSizeInBytes() << " bytes read back, "
+		<< packedEdges.countEdges() << " edges\n";
+
+	// unpacked only when an image is needed
+	timer.start();
+	Mat unpacked = packedEdges.getMat();
+	timer.stop();
+	cout << "Unpack: " << timer.getElapsedTimeInMicroSec() << "us\n";
+
+	// both ran on the same frame, so they must agree bit for bit
+	int byteEdges = cv::countNonZero(edges);
+	if (packedEdges.countEdges() != (size_t)byteEdges)
+	{
+		cout << "Packed: " << packedEdges.countEdges() << " edges, bytes have " << byteEdges << "\n";
+	}
+	cout << "Packed: " << cv::norm(unpacked, edges, cv::NORM_L1) / 255 << " pixels differ from the bytes\n";
+}
+
+void CannyAutotuneTest(size_t rows, size_t cols)
+{
+	// odd sizes on purpose, no square work-group divides them
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+
+	Mat inputImage(rows, cols, CV_8UC1);
+	for (size_t pixel = 0; pixel < inputImage.total(); pixel++)
+	{
+		inputImage.data[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	Timer timer;
+	Mat edges;
+	OCLCanny imageProcessor;
+
+	imageProcessor.Process(inputImage, edges);
+	timer.start();
+	imageProcessor.Process(inputImage, edges);
+	timer.stop();
+	cout << "Untuned " << cols << "x" << rows << ": " << timer.getElapsedTimeInMicroSec() << "us\n";
+
+	// sweeps on the first run, reads canny_tuning.txt afterwards
+	timer.start();
+	imageProcessor.Autotune(inputImage);
+	timer.stop();
+	cout << "Autotune: " << timer.getElapsedTimeInMicroSec() << "us\n";
+	imageProcessor.PrintLaunchConfig(cout);
+
+	imageProcessor.Process(inputImage, edges);
+	timer.start();
+	imageProcessor.Process(inputImage, edges);
+	timer.stop();
+	cout << "Tuned " << cols << "x" << rows << ": " << timer.getElapsedTimeInMicroSec() << "us\n";
+}
+
+void CannyAsyncTest(size_t largeSize, size_t smallSize, int smallFrames)
+{
+	// one large frame followed by a burst of small ones, the small ones
+	// should not have to wait for the large one to finish
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+
+	Mat largeImage(largeSize, largeSize, CV_8UC1);
+	Mat smallImage(smallSize, smallSize, CV_8UC1);
+	for (size_t pixel = 0; pixel < largeImage.total(); pixel++)
+	{
+		largeImage.data[pixel] = (unsigned char)std::round(d(gen));
+	}
+	for (size_t pixel = 0; pixel < smallImage.total(); pixel++)
+	{
+		smallImage.data[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	AsyncCanny engine;
+	Timer timer;
+
+	timer.start();
+	std::future<EdgeResult> large = engine.submit(largeImage);
+	vector<std::future<EdgeResult> > small;
+	for (int i = 0; i < smallFrames; i++)
+	{
+		small.push_back(engine.submit(smallImage));
+	}
+
+	double smallLatency = 0.0;
+	for (size_t i = 0; i < small.size(); i++)
+	{
+		smallLatency += small[i].get().latencyMicroSec;
+	}
+	double largeLatency = large.get().latencyMicroSec;
+	timer.stop();
+
+	cout << "Async " << engine.getThreadCount() << " threads: " << timer.getElapsedTimeInMicroSec() << "us total, "
+		<< largeSize << "^2 " << largeLatency << "us, "
+		<< smallSize << "^2 avg " << (smallFrames ? smallLatency / smallFrames : 0.0) << "us, "
+		<< engine.getStolenTasks() << " tasks stolen\n";
+}
+
+void CannyLiveCaptureTest(const string &source, FrameRing::DropPolicy policy)
+{
+	// a video file decodes faster than real time, so the ring has to drop
+	LiveCapture live(source, 2, policy);
+	if (!live.isOpened())
+	{
+		return;
+	}
+
+	CPUCanny engine;
+	Timer timer;
+
+	timer.start();
+	size_t frames = live.Run(engine);
+	timer.stop();
+
+	cout << "Live " << source << ": " << frames << " frames in " << timer.getElapsedTimeInMicroSec() << "us\n";
+	live.PrintStats(cout);
+}
+
+// pixels where a pair's sweep edges differ from a run with that pair alone
+double SweepMismatch(CannyEngine &engine, const Mat &input, const Mat &sweep, const vector<HysteresisThresholds> &thresholds)
+{
+	double mismatch = 0;
+	Mat edges;
+	for (size_t k = 0; k < thresholds.size(); k++)
+	{
+		engine.setThresholds(thresholds[k].low, thresholds[k].high);
+		engine.Process(input, edges);
+		mismatch += cv::norm(SweepEdges(sweep, (int)k), edges, cv::NORM_L1) / 255;
+	}
+	return mismatch;
+}
+
+void CannySweepTest(size_t size, int pairCount)
+{
+	// create random image
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+
+	Mat inputImage(size, size, CV_8UC1);
+	for (size_t pixel = 0; pixel < inputImage.total(); pixel++)
+	{
+		inputImage.data[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	// nested pairs, as a parameter search would try them
+	vector<HysteresisThresholds> thresholds;
+	for (int k = 0; k < pairCount; k++)
+	{
+		HysteresisThresholds pair = { 20 + k * 5, 60 + k * 5 };
+		thresholds.push_back(pair);
+	}
+
+	Timer timer;
+	Mat edges;
+	CPUCanny cpuProcessor;
+	OCLCanny oclProcessor;
+
+	timer.start();
+	cpuProcessor.Process(inputImage, edges);
+	timer.stop();
+	double single = timer.getElapsedTimeInMicroSec();
+
+	timer.start();
+	cpuProcessor.AttachOCVImage(inputImage);
+	Mat cpuSweep = cpuProcessor.HysteresisSweep(thresholds);
+	timer.stop();
+	cout << "Sweep CPU: " << pairCount << " pairs in " << timer.getElapsedTimeInMicroSec() << "us, one run "
+		<< single << "us\n";
+
+	oclProcessor.Process(inputImage, edges);
+	timer.start();
+	oclProcessor.Process(inputImage, edges);
+	timer.stop();
+	single = timer.getElapsedTimeInMicroSec();
+
+	timer.start();
+	oclProcessor.LoadOCVImage(inputImage);
+	Mat oclSweep = oclProcessor.HysteresisSweep(thresholds);
+	timer.stop();
+	cout << "Sweep OCL: " << pairCount << " pairs in " << timer.getElapsedTimeInMicroSec() << "us, one run "
+		<< single << "us\n";
+
+	// one pair's edge map out of the masks
+	cout << "First pair: " << cv::countNonZero(SweepEdges(oclSweep, 0)) << " edges\n";
+
+	// every pair against a Process with just that pair
+	cout << "Sweep CPU: " << SweepMismatch(cpuProcessor, inputImage, cpuSweep, thresholds) << " pixels differ from Process\n";
+	// the device traces the sweep as the CPU does, its own Process does not
+	cout << "Sweep OCL: " << SweepMismatch(cpuProcessor, inputImage, oclSweep, thresholds) << " pixels differ from CPU Process\n";
+}
+
+// Process without histograms, turn them on and Evaluate the same frame;
+// the edges and histograms have to match a Process with them on
+template <typename Canny>
+double LateHistogramMismatch(Canny &processor, const Mat &input, int cellSize, int bins)
+{
+	Mat edges;
+	processor.setOrientationHistograms(0, bins);
+	processor.Process(input, edges);
+
+	processor.setOrientationHistograms(cellSize, bins);
+	Mat lateEdges = processor.Evaluate().clone();
+	Mat lateHistograms = processor.getOrientationHistograms().clone();
+
+	processor.Process(input, edges);
+	Mat histograms = processor.getOrientationHistograms();
+
+	double mismatch = cv::norm(lateEdges, edges, cv::NORM_L1) / 255;
+	if (lateHistograms.empty() != histograms.empty())
+	{
+		return mismatch + 1;
+	}
+	if (!histograms.empty())
+	{
+		mismatch += cv::norm(lateHistograms, histograms, cv::NORM_L1);
+	}
+	return mismatch;
+}
+
+void CannyHistogramTest(size_t size, int cellSize, int bins)
+{
+	// create random image
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+
+	Mat inputImage(size, size, CV_8UC1);
+	for (size_t pixel = 0; pixel < inputImage.total(); pixel++)
+	{
+		inputImage.data[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	Timer timer;
+	Mat edges;
+	CPUCanny cpuProcessor;
+	OCLCanny oclProcessor;
+
+	timer.start();
+	cpuProcessor.Process(inputImage, edges);
+	timer.stop();
+	double plain = timer.getElapsedTimeInMicroSec();
+
+	// the histograms come out of the Sobel pass, no second read of the frame
+	cpuProcessor.setOrientationHistograms(cellSize, bins);
+	timer.start();
+	cpuProcessor.Process(inputImage, edges);
+	timer.stop();
+	cout << "Histograms CPU: " << timer.getElapsedTimeInMicroSec() << "us, without " << plain << "us\n";
+
+	oclProcessor.Process(inputImage, edges);
+	timer.start();
+	oclProcessor.Process(inputImage, edges);
+	timer.stop();
+	plain = timer.getElapsedTimeInMicroSec();
+
+	oclProcessor.setOrientationHistograms(cellSize, bins);
+	oclProcessor.Process(inputImage, edges);
+	timer.start();
+	oclProcessor.Process(inputImage, edges);
+	timer.stop();
+	cout << "Histograms OCL: " << timer.getElapsedTimeInMicroSec() << "us, without " << plain << "us\n";
+
+	Mat cpuHistograms = cpuProcessor.getOrientationHistograms();
+	Mat oclHistograms = oclProcessor.getOrientationHistograms();
+	cout << "Cells: " << cpuHistograms.rows << " x " << cpuHistograms.cols / bins << ", largest difference "
+		<< cv::norm(cpuHistograms, oclHistograms, cv::NORM_INF) << "\n";
+
+	cout << "Histograms CPU: " << LateHistogramMismatch(cpuProcessor, inputImage, cellSize, bins) << " difference when turned on after Process\n";
+	cout << "Histograms OCL: " << LateHistogramMismatch(oclProcessor, inputImage, cellSize, bins) << " difference when turned on after Process\n";
+}
+
+// low threshold of each step of CannyRethresholdTest, high is 30 above
+int RethresholdLow(int step, int steps)
+{
+	return 20 + step * 60 / steps;
+}
+
+// each Evaluate of the slider sweep against a fresh Process at the same
+// thresholds
+double RethresholdMismatch(CannyEngine &engine, const Mat &input, const vector<Mat> &evaluated)
+{
+	double mismatch = 0;
+	Mat edges;
+	const int steps = (int)evaluated.size();
+	for (int step = 0; step < steps; step++)
+	{
+		int low = RethresholdLow(step, steps);
+		engine.setThresholds(low, low + 30);
+		engine.Process(input, edges);
+		mismatch += cv::norm(evaluated[step], edges, cv::NORM_L1) / 255;
+	}
+	return mismatch;
+}
+
+void CannyRethresholdTest(size_t size, int steps)
+{
+	// create random image
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+
+	Mat inputImage(size, size, CV_8UC1);
+	for (size_t pixel = 0; pixel < inputImage.total(); pixel++)
+	{
+		inputImage.data[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	Timer timer;
+	Mat edges;
+	CPUCanny cpuProcessor;
+	OCLCanny oclProcessor;
+
+	cpuProcessor.Process(inputImage, edges);
+	oclProcessor.Process(inputImage, edges);
+
+	// a slider sweep: only hysteresis runs again, on the stored suppressed
+	// magnitude (left on the device for OpenCL)
+	double cpuTime = 0.0;
+	double oclTime = 0.0;
+	vector<Mat> cpuEdges;
+	vector<Mat> oclEdges;
+	for (int step = 0; step < steps; step++)
+	{
+		int low = RethresholdLow(step, steps);
+
+		timer.start();
+		cpuProcessor.setThresholds(low, low + 30);
+		Mat cpuEvaluated = cpuProcessor.Evaluate();
+		timer.stop();
+		cpuTime += timer.getElapsedTimeInMicroSec();
+		cpuEdges.push_back(cpuEvaluated.clone());
+
+		timer.start();
+		oclProcessor.setThresholds(low, low + 30);
+		Mat oclEvaluated = oclProcessor.Evaluate();
+		timer.stop();
+		oclTime += timer.getElapsedTimeInMicroSec();
+		oclEdges.push_back(oclEvaluated.clone());
+	}
+
+	timer.start();
+	cpuProcessor.Process(inputImage, edges);
+	timer.stop();
+	cout << "Rethreshold CPU: " << cpuTime / steps << "us per step, full frame " << timer.getElapsedTimeInMicroSec() << "us\n";
+
+	timer.start();
+	oclProcessor.Process(inputImage, edges);
+	timer.stop();
+	cout << "Rethreshold OCL: " << oclTime / steps << "us per step, full frame " << timer.getElapsedTimeInMicroSec() << "us\n";
+
+	cout << "Rethreshold CPU: " << RethresholdMismatch(cpuProcessor, inputImage, cpuEdges) << " pixels differ from Process\n";
+	cout << "Rethreshold OCL: " << RethresholdMismatch(oclProcessor, inputImage, oclEdges) << " pixels differ from Process\n";
+}
+
+void CannyWarmupTest(size_t size, int frames)
+{
+	// create random image
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+
+	Mat inputImage(size, size, CV_8UC1);
+	for (size_t pixel = 0; pixel < inputImage.total(); pixel++)
+	{
+		inputImage.data[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	Timer timer;
+	Mat edges;
+
+	// results come from the CPU while canny.cl builds in the background
+	timer.start();
+	WarmupCanny engine;
+	engine.Process(inputImage, edges);
+	timer.stop();
+	cout << "First result: " << timer.getElapsedTimeInMicroSec() << "us on " << engine.getName() << "\n";
+
+	for (int frame = 1; frame < frames; frame++)
+	{
+		engine.Process(inputImage, edges);
+	}
+
+	engine.WaitForBuild();
+	cout << engine.getCPUFrames() << " of " << frames << " frames on the CPU, OpenCL ready after "
+		<< engine.getWarmupMicroSec() << "us, now " << engine.getName() << "\n";
+}
+
+void CannyServerTest(size_t size, int clientCount, int framesPerClient)
+{
+	const string socketPath = "/tmp/canny_edge_test.sock";
+
+	EdgeServer server("cpu", socketPath);
+	if (!server.Start())
+	{
+		return;
+	}
+	std::thread serverThread([&server]() { server.Run(); });
+
+	// every client renders its frames straight into shared memory
+	vector<std::thread> clients;
+	vector<double> latency(clientCount, 0.0);
+	for (int c = 0; c < clientCount; c++)
+	{
+		clients.emplace_back([&, c]()
+		{
+			EdgeClient client;
+			if (!client.Connect(socketPath))
+			{
+				return;
+			}
+
+			std::mt19937 gen(c);
+			std::normal_distribution<> d(64, 25);
+
+			Timer timer;
+			Mat edges;
+			for (int frame = 0; frame < framesPerClient; frame++)
+			{
+				Mat input = client.getInputFrame(size, size);
+				for (size_t pixel = 0; pixel < input.total(); pixel++)
+				{
+					input.data[pixel] = (unsigned char)std::round(d(gen));
+				}
+
+				timer.start();
+				client.Detect(edges);
+				timer.stop();
+				latency[c] += timer.getElapsedTimeInMicroSec();
+			}
+		});
+	}
+
+	for (size_t c = 0; c < clients.size(); c++)
+	{
+		clients[c].join();
+	}
+
+	server.Stop();
+	serverThread.join();
+
+	for (int c = 0; c < clientCount; c++)
+	{
+		cout << "Client " << c << ": avg " << latency[c] / framesPerClient << "us per frame\n";
+	}
+	server.PrintStats(cout);
+}
+
+void CannyInstructionSetTest(size_t size)
+{
+	// create random image
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::normal_distribution<> d(64, 25);
+
+	Mat inputImage(size, size, CV_8UC1);
+	for (size_t pixel = 0; pixel < inputImage.total(); pixel++)
+	{
+		inputImage.data[pixel] = (unsigned char)std::round(d(gen));
+	}
+
+	InstructionSet detected = DetectInstructionSet();
+	InstructionSet selected = getInstructionSet();
+	cout << "CPU supports " << InstructionSetName(detected) << ", running " << InstructionSetName(selected) << "\n";
+
+	Timer timer;
+	Mat reference, edges;
+	CPUCanny cpuProcessor;
+
+	// every level up to the detected one, each must give the same edges
+	const InstructionSet levels[] = { InstructionSet::Baseline, InstructionSet::SSE42, InstructionSet::AVX2, InstructionSet::AVX512 };
+	for (InstructionSet level : levels)
+	{
+		if (level > detected)
+		{
+			break;
+		}
+		setInstructionSet(level);
+
+		cpuProcessor.Process(inputImage, edges);
+		timer.start();
+		cpuProcessor.Process(inputImage, edges);
+		timer.stop();
+
+		if (reference.empty())
+		{
+			reference = edges.clone();
+		}
+		cout << InstructionSetName(level) << ": " << timer.getElapsedTimeInMicroSec() << "us, "
+			<< cv::norm(edges, reference, cv::NORM_L1) / 255 << " pixels differ from baseline\n";
+	}
+
+	setInstructionSet(selected);
+}
+
 void CannyRealImageTest()
 {
 #define DEBUG_PRINT
 	Mat rawImage = cv::imread("D:\\image_samples\\machine.jpg");
-	Mat input;
-	cv::cvtColor(rawImage, input, cv::COLOR_BGR2GRAY);
 
+	// BGR goes in as is, the luma conversion happens inside the Gaussian
 	CPUCanny imageProcessor;
-	imageProcessor.LoadOCVImage(input);
+	imageProcessor.LoadOCVImage(rawImage);
 
 	imageProcessor.Gaussian();
 	imageProcessor.Sobel();
@@ -232,7 +1108,7 @@ void CannyRealImageTest()
 	Mat output = imageProcessor.getTheta();
 
 
-	cv::imshow("Title2", input);
+	cv::imshow("Title2", rawImage);
 	cv::imshow("Title", output);
 	cv::waitKey(0);
 
@@ -249,11 +1125,246 @@ void CannyRealImageTest()
 #endif
 }
 
+void CannyMappedImageTest(const string &inputFile, const string &outputFile)
+{
+	// input is used straight from the page cache, no imread/cvtColor/clone
+	MappedImage inputImage;
+	if (!inputImage.OpenPGM(inputFile))
+	{
+		return;
+	}
+
+	Mat input = inputImage.getImage();
+
+	MappedImage outputImage;
+	if (!outputImage.CreatePGM(outputFile, input.rows, input.cols))
+	{
+		return;
+	}
+
+	Mat output = outputImage.getImage();
+
+	Timer timer;
+	timer.start();
+
+	CPUCanny imageProcessor;
+	imageProcessor.AttachOCVImage(input);
+
+	imageProcessor.Gaussian();
+	imageProcessor.Sobel();
+	imageProcessor.NonMaximaSuppression();
+	imageProcessor.HysteresisThresholding(output);
+
+	timer.stop();
+	cout << "Mapped " << input.cols << "x" << input.rows << ": "
+		<< timer.getElapsedTimeInMicroSec() << "us\n";
+
+	outputImage.Flush();
+	outputImage.Close();
+
+	// read the written file back and check it against Process
+	MappedImage writtenImage;
+	if (!writtenImage.OpenPGM(outputFile))
+	{
+		return;
+	}
+
+	Mat written = writtenImage.getImage();
+	Mat edges;
+	CPUCanny reference;
+	reference.Process(input, edges);
+
+	if (written.rows != edges.rows || written.cols != edges.cols)
+	{
+		cerr << "Error: " << outputFile << " is " << written.cols << "x" << written.rows << endl;
+		return;
+	}
+	cout << "Mapped: " << cv::norm(written, edges, cv::NORM_L1) / 255 << " pixels differ from Process\n";
+}
+
+// the server --serve runs, stopped by SIGINT or SIGTERM
+static EdgeServer *runningServer = NULL;
+
+static void StopServer(int)
+{
+	if (runningServer != NULL)
+	{
+		runningServer->Stop();
+	}
+}
+
+void PrintUsage(const char *program)
+{
+	cout << "Usage: " << program << " [--batch <directory|list> [options]]\n"
+		<< "  --out <directory>    output directory (default .)\n"
+		<< "  --format png|pgm     output format (default png)\n"
+		<< "  --backend cpu|ocl|auto|warmup\n"
+		<< "                       Canny engine (default cpu), auto picks per frame\n"
+		<< "                       size from canny_profile.txt, calibrating if needed,\n"
+		<< "                       warmup runs on the CPU until OpenCL has been built\n"
+		<< "  --decoders <n>       decoder threads (default 2)\n"
+		<< "  --encoders <n>       encoder threads (default 2)\n"
+		<< "  --queue <n>          depth of each stage queue (default 8)\n"
+		<< "  --trace <file>       write a Chrome trace (needs CANNY_TRACE)\n"
+		<< "  --isa baseline|sse4.2|avx2|avx512\n"
+		<< "                       CPU loops to run (default: the best this CPU has,\n"
+		<< "                       or CANNY_ISA)\n"
+		<< "       " << program << " --mapped <input.pgm> <output.pgm>\n"
+		<< "                       edges of an 8-bit PGM through mapped files\n"
+		<< "       " << program << " --serve <socket> [--backend cpu|ocl|auto|warmup]\n"
+		<< "                       keep one engine warm and serve EdgeClient frames\n"
+		<< "                       until SIGINT or SIGTERM\n";
+}
+
+// a whole number of at least 1, false for anything else
+bool ParseCount(const string &text, int &count)
+{
+	try
+	{
+		size_t used = 0;
+		count = std::stoi(text, &used);
+		return used == text.size() && count >= 1;
+	}
+	catch (const std::exception &)
+	{
+		return false;
+	}
+}
+
 int main(int argc, char **argv)
 {
+	BatchOptions options;
+	string batchSource;
+	string traceFile;
+	string serveSocket;
+	string mappedInput;
+	string mappedOutput;
 
-	
-	CannyRealImageTest();
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--batch" && hasValue)
+		{
+			batchSource = argv[++i];
+		}
+		else if (arg == "--out" && hasValue)
+		{
+			options.outputDirectory = argv[++i];
+		}
+		else if (arg == "--format" && hasValue)
+		{
+			options.outputFormat = argv[++i];
+		}
+		else if (arg == "--backend" && hasValue)
+		{
+			options.backend = argv[++i];
+		}
+		else if (arg == "--decoders" && hasValue)
+		{
+			if (!ParseCount(argv[++i], options.decoderThreads))
+			{
+				PrintUsage(argv[0]);
+				return 1;
+			}
+		}
+		else if (arg == "--encoders" && hasValue)
+		{
+			if (!ParseCount(argv[++i], options.encoderThreads))
+			{
+				PrintUsage(argv[0]);
+				return 1;
+			}
+		}
+		else if (arg == "--queue" && hasValue)
+		{
+			int depth;
+			if (!ParseCount(argv[++i], depth))
+			{
+				PrintUsage(argv[0]);
+				return 1;
+			}
+			options.queueDepth = depth;
+		}
+		else if (arg == "--trace" && hasValue)
+		{
+			traceFile = argv[++i];
+		}
+		else if (arg == "--serve" && hasValue)
+		{
+			serveSocket = argv[++i];
+		}
+		else if (arg == "--mapped" && i + 2 < argc)
+		{
+			mappedInput = argv[++i];
+			mappedOutput = argv[++i];
+		}
+		else if (arg == "--isa" && hasValue)
+		{
+			InstructionSet level;
+			if (!ParseInstructionSet(argv[++i], level))
+			{
+				PrintUsage(argv[0]);
+				return 1;
+			}
+			if (!setInstructionSet(level))
+			{
+				return 1;
+			}
+		}
+		else
+		{
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!serveSocket.empty())
+	{
+		// runs until SIGINT or SIGTERM; the socket file goes with the server
+		EdgeServer server(options.backend, serveSocket);
+		if (!server.Start())
+		{
+			return 1;
+		}
+
+		runningServer = &server;
+		std::signal(SIGINT, StopServer);
+		std::signal(SIGTERM, StopServer);
+
+		server.Run();
+
+		std::signal(SIGINT, SIG_DFL);
+		std::signal(SIGTERM, SIG_DFL);
+		runningServer = NULL;
+		server.PrintStats(cout);
+	}
+	else if (!mappedInput.empty())
+	{
+		CannyMappedImageTest(mappedInput, mappedOutput);
+	}
+	else if (!batchSource.empty())
+	{
+		options.inputs = BatchProcessor::ListInputs(batchSource);
+
+		BatchProcessor processor(options);
+		processor.Run();
+		processor.PrintReport(cout);
+	}
+	else
+	{
+		CannyRealImageTest();
+	}
+
+	if (!traceFile.empty())
+	{
+#ifdef CANNY_TRACE
+		Trace::ExportChrome(traceFile);
+#else
+		cerr << "Error: built without CANNY_TRACE, no trace written" << endl;
+#endif
+	}
 
 	return 0;
 }
\ No newline at end of file
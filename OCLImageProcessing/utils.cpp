@@ -8,12 +8,20 @@
 
 #include "utils.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
 using std::cout;
 using std::cerr;
 using std::endl;
 using std::setw;
 using std::string;
 using std::ifstream;
+using std::vector;
 
 string FileToString(const string fileName)
 {
@@ -61,6 +69,52 @@ string FileToString(const string fileName)
 	throw(errorMsg);
 }
 
+bool ListDirectory(const string path, vector<string> &files)
+{
+#ifdef _WIN32
+	WIN32_FIND_DATAA entry;
+	HANDLE search = FindFirstFileA((path + "\\*").c_str(), &entry);
+
+	if (search == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	do
+	{
+		if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			files.push_back(path + "\\" + entry.cFileName);
+		}
+	} while (FindNextFileA(search, &entry));
+
+	FindClose(search);
+#else
+	DIR *directory = opendir(path.c_str());
+
+	if (directory == NULL)
+	{
+		return false;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(directory)) != NULL)
+	{
+		string fileName = path + "/" + entry->d_name;
+		struct stat info;
+
+		if (stat(fileName.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+		{
+			files.push_back(fileName);
+		}
+	}
+
+	closedir(directory);
+#endif
+
+	return true;
+}
+
 void createGaussianFilter(float * kernel, int size, float sd)
 {
 	float s;
@@ -1,8 +1,12 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 std::string FileToString(const std::string fileName);
 
+// list the regular files in a directory, returns false if path is not a directory
+bool ListDirectory(const std::string path, std::vector<std::string> &files);
+
 // create a normalized Gaussian mask
 void createGaussianFilter(float *kernel, int size, float sd);
\ No newline at end of file